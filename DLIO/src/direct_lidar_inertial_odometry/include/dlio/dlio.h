@@ -75,6 +75,7 @@ std::string to_string_with_precision(const T a_value, const int n = 6)
 
 // DLIO
 #include <nano_gicp/nano_gicp.h>
+#include <nano_gicp/keyframe_submap.h>
 #include <direct_lidar_inertial_odometry/save_pcd.h>
 
 namespace dlio {
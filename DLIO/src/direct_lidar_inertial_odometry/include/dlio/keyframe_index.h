@@ -0,0 +1,67 @@
+/***********************************************************
+ *                                                         *
+ * Copyright (c)                                           *
+ *                                                         *
+ * The Verifiable & Control-Theoretic Robotics (VECTR) Lab *
+ * University of California, Los Angeles                   *
+ *                                                         *
+ * Authors: Kenny J. Chen, Ryan Nemiroff, Brett T. Lopez   *
+ * Contact: {kennyjchen, ryguyn, btlopez}@ucla.edu         *
+ *                                                         *
+ ***********************************************************/
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "nano_gicp/nanoflann.h"
+
+namespace dlio {
+
+/*
+ * Spatial index over the keyframe positions.
+ *
+ * Keyframes are only ever added, so the positions are kept in nanoflann's dynamic index, a set of static kdtrees
+ * of doubling sizes: adding a keyframe rebuilds O(log n) positions amortized, and a search visits O(log n) small
+ * trees instead of every keyframe. Searches can be limited to the first n keyframes, e.g. the ones that have been
+ * processed for the submap.
+ *
+ * Searches may run concurrently with each other, but not with add().
+ */
+class KeyframeIndex {
+public:
+  KeyframeIndex();
+  KeyframeIndex(const KeyframeIndex&) = delete;
+  KeyframeIndex& operator=(const KeyframeIndex&) = delete;
+
+  void add(const Eigen::Vector3f& position);
+
+  int size() const { return positions_.size(); }
+  const Eigen::Vector3f& position(int i) const { return positions_[i]; }
+
+  // the k keyframes among the first n that are closest to point, closest first
+  int nearestKSearch(const Eigen::Vector3f& point, int k, int n, std::vector<int>& indices, std::vector<float>& sq_dists) const;
+
+  // the keyframes among the first n that are closer than radius to point, closest first
+  int radiusSearch(const Eigen::Vector3f& point, float radius, int n, std::vector<int>& indices, std::vector<float>& sq_dists) const;
+
+private:
+  struct Adaptor {
+    size_t kdtree_get_point_count() const { return positions->size(); }
+    float kdtree_get_pt(const size_t idx, int dim) const { return (*positions)[idx][dim]; }
+    template <class BBOX> bool kdtree_get_bbox(BBOX&) const { return false; }
+    const std::vector<Eigen::Vector3f>* positions;
+  };
+
+  typedef nanoflann::KDTreeSingleIndexDynamicAdaptor<
+    nanoflann::L2_Simple_Adaptor<float, Adaptor>, Adaptor, 3> Tree;
+
+  std::vector<Eigen::Vector3f> positions_;
+  Adaptor adaptor_;
+  std::unique_ptr<Tree> tree_;
+};
+
+}  // namespace dlio
@@ -11,6 +11,7 @@
  ***********************************************************/
 
 #include "dlio/dlio.h"
+#include "dlio/keyframe_index.h"
 
 class dlio::OdomNode {
 
@@ -74,11 +75,10 @@ private:
 
   void updateKeyframes();
   void computeConvexHull();
-  void computeConcaveHull();
+  void computeConcaveHull(const Eigen::Vector3f& p);
   void pushSubmapIndices(std::vector<float> dists, int k, std::vector<int> frames);
   void buildSubmap(State vehicle_state);
   void buildKeyframesAndSubmap(State vehicle_state);
-  void pauseSubmapBuildIfNeeded();
 
   void debug();
 
@@ -153,24 +153,23 @@ private:
   pcl::PointCloud<PointType>::ConstPtr keyframe_cloud;
   int num_processed_keyframes;
 
+  dlio::KeyframeIndex keyframe_index;
+
   pcl::ConvexHull<PointType> convex_hull;
   pcl::ConcaveHull<PointType> concave_hull;
   std::vector<int> keyframe_convex;
+  std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f>> keyframe_convex_planes;
+  int num_convex_keyframes;
   std::vector<int> keyframe_concave;
 
   // Submap
-  pcl::PointCloud<PointType>::ConstPtr submap_cloud;
-  std::shared_ptr<const nano_gicp::CovarianceList> submap_normals;
-  std::shared_ptr<const nanoflann::KdTreeFLANN<PointType>> submap_kdtree;
+  std::shared_ptr<const nano_gicp::KeyframeSubmap<PointType>> submap;
 
   std::vector<int> submap_kf_idx_curr;
   std::vector<int> submap_kf_idx_prev;
 
   bool new_submap_is_ready;
   std::future<void> submap_future;
-  std::condition_variable submap_build_cv;
-  bool main_loop_running;
-  std::mutex main_loop_running_mutex;
 
   // Timestamps
   ros::Time scan_header_stamp;
@@ -186,7 +185,6 @@ private:
 
   // GICP
   nano_gicp::NanoGICP<PointType, PointType> gicp;
-  nano_gicp::NanoGICP<PointType, PointType> gicp_temp;
 
   // Transformations
   Eigen::Matrix4f T, T_prior, T_corr;
@@ -321,6 +319,7 @@ private:
   int gicp_min_num_points_;
   int gicp_k_correspondences_;
   double gicp_max_corr_dist_;
+  double gicp_corr_reuse_thresh_;
   int gicp_max_iter_;
   double gicp_transformation_ep_;
   double gicp_rotation_ep_;
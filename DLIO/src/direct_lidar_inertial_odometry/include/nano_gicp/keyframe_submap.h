@@ -0,0 +1,95 @@
+/***********************************************************
+ *                                                         *
+ * Copyright (c)                                           *
+ *                                                         *
+ * The Verifiable & Control-Theoretic Robotics (VECTR) Lab *
+ * University of California, Los Angeles                   *
+ *                                                         *
+ * Authors: Kenny J. Chen, Ryan Nemiroff, Brett T. Lopez   *
+ * Contact: {kennyjchen, ryguyn, btlopez}@ucla.edu         *
+ *                                                         *
+ ***********************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <pcl/point_cloud.h>
+
+#include "nano_gicp/nano_gicp.h"
+#include "nano_gicp/nanoflann_adaptor.h"
+
+namespace nano_gicp {
+
+/*
+ * GICP target made of keyframes that can be added and removed without rebuilding the whole submap.
+ *
+ * The keyframes are kept in a few blocks, each with its own kdtree: typically a large block of the older
+ * keyframes and smaller ones of the keyframes that joined the submap later. Keyframes that leave the submap
+ * are only switched off in their block. A submap change therefore builds a kdtree over the new keyframes only;
+ * a block is rebuilt when it is mostly switched off, and two blocks are merged when the younger one has grown
+ * to half the size of the older one. There are at most MAX_BLOCKS blocks, so a nearest point search takes at most
+ * that many kdtree searches, each bounded by the distance of the best match so far.
+ *
+ * A submap is never modified after update() returned it, so one thread can build the next submap while
+ * another registers against the current one.
+ */
+template <typename PointT>
+class KeyframeSubmap {
+public:
+  using PointCloudConstPtr = typename pcl::PointCloud<PointT>::ConstPtr;
+
+  struct Keyframe {
+    int id;
+    PointCloudConstPtr cloud;
+    std::shared_ptr<const CovarianceList> covariances;
+  };
+
+  struct Match {
+    int index;                          // index of the point in the submap, -1 if there is none in range
+    float sq_dist;
+    const PointT* point;
+    const Eigen::Matrix4d* covariance;
+  };
+
+  // the submap of the given keyframes, reusing the blocks of this submap
+  std::shared_ptr<const KeyframeSubmap> update(const std::vector<Keyframe>& keyframes) const;
+
+  // nearest point closer than sqrt(max_sq_dist)
+  bool nearest(const PointT& point, float max_sq_dist, Match& match) const;
+
+  const std::vector<int>& keyframes() const { return keyframes_; }
+  size_t size() const { return size_; }
+  int numBlocks() const { return blocks_.size(); }
+  PointCloudConstPtr blockCloud(int b) const { return blocks_[b].data->cloud; }
+
+private:
+  struct BlockData {
+    std::vector<Keyframe> keyframes;
+    std::vector<int> point_keyframe;    // keyframe of every point, as an index into keyframes
+    PointCloudConstPtr cloud;
+    CovarianceList covariances;
+    nanoflann::KdTreeFLANN<PointT> kdtree;
+  };
+
+  struct Block {
+    std::shared_ptr<const BlockData> data;
+    std::vector<char> active;           // per keyframe of the block
+    size_t size;                        // points of the active keyframes
+    int offset;                         // index of the first point of the block in the submap
+  };
+
+  static constexpr int MAX_BLOCKS = 3;
+
+  static std::shared_ptr<const BlockData> build(const std::vector<Keyframe>& keyframes);
+  static Block activeBlock(const std::shared_ptr<const BlockData>& data);
+  static std::vector<Keyframe> activeKeyframes(const Block& block);
+
+  std::vector<Block> blocks_;           // largest first
+  std::vector<int> keyframes_;          // sorted ids
+  size_t size_ = 0;
+};
+
+}  // namespace nano_gicp
@@ -60,6 +60,9 @@ typedef std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d>>
 
 enum class RegularizationMethod { NONE, MIN_EIG, NORMALIZED_MIN_EIG, PLANE, FROBENIUS };
 
+template<typename PointT>
+class KeyframeSubmap;
+
 template<typename PointSource, typename PointTarget>
 class NanoGICP : public LsqRegistration<PointSource, PointTarget> {
 public:
@@ -87,6 +90,7 @@ public:
   void setNumThreads(int n);
   void setCorrespondenceRandomness(int k);
   void setMaxCorrespondenceDistance(double corr);
+  void setCorrespondenceReuseThreshold(double max_motion);
   void setRegularizationMethod(RegularizationMethod method);
 
   virtual void swapSourceAndTarget() override;
@@ -97,6 +101,7 @@ public:
   virtual void setSourceCovariances(const std::shared_ptr<const CovarianceList>& covs);
   virtual void setInputTarget(const PointCloudTargetConstPtr& cloud) override;
   virtual void setTargetCovariances(const std::shared_ptr<const CovarianceList>& covs);
+  virtual void setTargetSubmap(const std::shared_ptr<const KeyframeSubmap<PointTarget>>& submap);
 
   virtual void registerInputSource(const PointCloudSourceConstPtr& cloud);
   virtual void registerInputTarget(const PointCloudTargetConstPtr& cloud);
@@ -121,6 +126,9 @@ protected:
 
   virtual double compute_error(const Eigen::Isometry3d& trans) override;
 
+  Eigen::Matrix3d mahalanobis(int i) const;
+  void invalidate_correspondences();
+
   template<typename PointT>
   bool calculate_covariances(const typename pcl::PointCloud<PointT>::ConstPtr& cloud, const nanoflann::KdTreeFLANN<PointT>& kdtree, CovarianceList& covariances, float& density);
 
@@ -131,6 +139,9 @@ public:
   std::shared_ptr<const CovarianceList> source_covs_;
   std::shared_ptr<const CovarianceList> target_covs_;
 
+  // if set, the target points and covariances are searched here instead of in target_kdtree_
+  std::shared_ptr<const KeyframeSubmap<PointTarget>> target_submap_;
+
   float source_density_;
   float target_density_;
 
@@ -141,12 +152,23 @@ protected:
   int k_correspondences_;
   double corr_dist_threshold_;
 
+  // a correspondence is kept without a new search as long as its source point moved less than this since the
+  // search and the target point is still in range. It is then at most twice this farther than the nearest point.
+  double reuse_max_motion_;
+
   RegularizationMethod regularization_method_;
 
-  CovarianceList mahalanobis_;
+  // upper triangles (xx, xy, xz, yy, yz, zz) of the 3x3 mahalanobis matrices, one array per entry so that
+  // they are inverted in one vectorized pass
+  std::vector<float> mahalanobis_[6];
+  std::vector<Eigen::Vector4d, Eigen::aligned_allocator<Eigen::Vector4d>> target_points_;
 
   std::vector<int> correspondences_;
   std::vector<float> sq_distances_;
+
+  bool correspondences_valid_;          // correspondences_ refer to the current source and target
+  std::vector<Eigen::Vector3f> search_points_;       // transformed source points of the last search
+  std::vector<const Eigen::Matrix4d*> target_covs_ptr_;
 };
 }  // namespace nano_gicp
 
@@ -84,6 +84,10 @@ public:
   int radiusSearch (const PointT &point, double radius, std::vector<int> &k_indices,
                     std::vector<float> &k_sqr_distances) const;
 
+  // search with a caller-defined nanoflann result set, e.g. one that starts with a distance bound
+  template <typename ResultSet>
+  void findNeighbors (ResultSet &result, const PointT &point) const;
+
 protected:
 
   nanoflann::SearchParams _params;
@@ -174,6 +178,12 @@ int KdTreeFLANN<PointT>::radiusSearch(const PointT &point, double radius,
   return nFound;
 }
 
+template<typename PointT> template<typename ResultSet> inline
+void KdTreeFLANN<PointT>::findNeighbors(ResultSet &result, const PointT &point) const
+{
+  _kdtree.findNeighbors(result, point.data, _params);
+}
+
 template<typename PointT> inline
 size_t KdTreeFLANN<PointT>::PointCloud_Adaptor::kdtree_get_point_count() const {
   if( indices ) return indices->size();
@@ -0,0 +1,73 @@
+/***********************************************************
+ *                                                         *
+ * Copyright (c)                                           *
+ *                                                         *
+ * The Verifiable & Control-Theoretic Robotics (VECTR) Lab *
+ * University of California, Los Angeles                   *
+ *                                                         *
+ * Authors: Kenny J. Chen, Ryan Nemiroff, Brett T. Lopez   *
+ * Contact: {kennyjchen, ryguyn, btlopez}@ucla.edu         *
+ *                                                         *
+ ***********************************************************/
+
+#include "dlio/keyframe_index.h"
+
+#include <algorithm>
+
+dlio::KeyframeIndex::KeyframeIndex() {
+  this->adaptor_.positions = &this->positions_;
+  this->tree_.reset(new Tree(3, this->adaptor_, nanoflann::KDTreeSingleIndexAdaptorParams(10)));
+}
+
+void dlio::KeyframeIndex::add(const Eigen::Vector3f& position) {
+  this->positions_.push_back(position);
+  this->tree_->addPoints(this->positions_.size() - 1, this->positions_.size() - 1);
+}
+
+int dlio::KeyframeIndex::nearestKSearch(const Eigen::Vector3f& point, int k, int n,
+                                        std::vector<int>& indices, std::vector<float>& sq_dists) const {
+  indices.clear();
+  sq_dists.clear();
+
+  n = std::min(n, this->size());
+  if (k <= 0 || n <= 0) {
+    return 0;
+  }
+
+  // the keyframes past the first n can take some of the k places, search that many more
+  const size_t num_results = std::min(k + this->size() - n, this->size());
+  std::vector<size_t> result_indices(num_results);
+  std::vector<float> result_sq_dists(num_results);
+  nanoflann::KNNResultSet<float, size_t> result(num_results);
+  result.init(result_indices.data(), result_sq_dists.data());
+  this->tree_->findNeighbors(result, point.data(), nanoflann::SearchParams());
+
+  for (size_t i = 0; i < result.size() && indices.size() < k; i++) {
+    if (result_indices[i] < n) {
+      indices.push_back(result_indices[i]);
+      sq_dists.push_back(result_sq_dists[i]);
+    }
+  }
+
+  return indices.size();
+}
+
+int dlio::KeyframeIndex::radiusSearch(const Eigen::Vector3f& point, float radius, int n,
+                                      std::vector<int>& indices, std::vector<float>& sq_dists) const {
+  indices.clear();
+  sq_dists.clear();
+
+  std::vector<std::pair<size_t, float>> matches;
+  nanoflann::RadiusResultSet<float, size_t> result(radius * radius, matches);
+  this->tree_->findNeighbors(result, point.data(), nanoflann::SearchParams());
+  std::sort(matches.begin(), matches.end(), nanoflann::IndexDist_Sorter());
+
+  for (const auto& m : matches) {
+    if (m.first < n) {
+      indices.push_back(m.first);
+      sq_dists.push_back(m.second);
+    }
+  }
+
+  return indices.size();
+}
@@ -70,9 +70,10 @@ dlio::OdomNode::OdomNode(ros::NodeHandle node_handle) : nh(node_handle) {
   this->original_scan = pcl::PointCloud<PointType>::ConstPtr (boost::make_shared<const pcl::PointCloud<PointType>>());
   this->deskewed_scan = pcl::PointCloud<PointType>::ConstPtr (boost::make_shared<const pcl::PointCloud<PointType>>());
   this->current_scan = pcl::PointCloud<PointType>::ConstPtr (boost::make_shared<const pcl::PointCloud<PointType>>());
-  this->submap_cloud = pcl::PointCloud<PointType>::ConstPtr (boost::make_shared<const pcl::PointCloud<PointType>>());
+  this->submap = std::make_shared<const nano_gicp::KeyframeSubmap<PointType>>();
 
   this->num_processed_keyframes = 0;
+  this->num_convex_keyframes = 0;
 
   this->submap_hasChanged = true;
   this->submap_kf_idx_prev.clear();
@@ -88,23 +89,15 @@ dlio::OdomNode::OdomNode(ros::NodeHandle node_handle) : nh(node_handle) {
 
   this->gicp.setCorrespondenceRandomness(this->gicp_k_correspondences_);
   this->gicp.setMaxCorrespondenceDistance(this->gicp_max_corr_dist_);
+  this->gicp.setCorrespondenceReuseThreshold(this->gicp_corr_reuse_thresh_);
   this->gicp.setMaximumIterations(this->gicp_max_iter_);
   this->gicp.setTransformationEpsilon(this->gicp_transformation_ep_);
   this->gicp.setRotationEpsilon(this->gicp_rotation_ep_);
   this->gicp.setInitialLambdaFactor(this->gicp_init_lambda_factor_);
 
-  this->gicp_temp.setCorrespondenceRandomness(this->gicp_k_correspondences_);
-  this->gicp_temp.setMaxCorrespondenceDistance(this->gicp_max_corr_dist_);
-  this->gicp_temp.setMaximumIterations(this->gicp_max_iter_);
-  this->gicp_temp.setTransformationEpsilon(this->gicp_transformation_ep_);
-  this->gicp_temp.setRotationEpsilon(this->gicp_rotation_ep_);
-  this->gicp_temp.setInitialLambdaFactor(this->gicp_init_lambda_factor_);
-
   pcl::Registration<PointType, PointType>::KdTreeReciprocalPtr temp;
   this->gicp.setSearchMethodSource(temp, true);
   this->gicp.setSearchMethodTarget(temp, true);
-  this->gicp_temp.setSearchMethodSource(temp, true);
-  this->gicp_temp.setSearchMethodTarget(temp, true);
 
   this->geo.first_opt_done = false;
   this->geo.prev_vel = Eigen::Vector3f(0., 0., 0.);
@@ -287,6 +280,7 @@ void dlio::OdomNode::getParams() {
   ros::param::param<int>("~dlio/odom/gicp/kCorrespondences", this->gicp_k_correspondences_, 20);
   ros::param::param<double>("~dlio/odom/gicp/maxCorrespondenceDistance", this->gicp_max_corr_dist_,
       std::sqrt(std::numeric_limits<double>::max()));
+  ros::param::param<double>("~dlio/odom/gicp/correspondenceReuseThreshold", this->gicp_corr_reuse_thresh_, 0.0);
   ros::param::param<int>("~dlio/odom/gicp/maxIterations", this->gicp_max_iter_, 64);
   ros::param::param<double>("~dlio/odom/gicp/transformationEpsilon", this->gicp_transformation_ep_, 0.0005);
   ros::param::param<double>("~dlio/odom/gicp/rotationEpsilon", this->gicp_rotation_ep_, 0.0005);
@@ -733,6 +727,7 @@ void dlio::OdomNode::initializeInputTarget() {
 
   // keep history of keyframes
   this->keyframes.push_back(std::make_pair(std::make_pair(this->lidarPose.p, this->lidarPose.q), this->current_scan));
+  this->keyframe_index.add(this->lidarPose.p);
   this->keyframe_timestamps.push_back(this->scan_header_stamp);
   this->keyframe_normals.push_back(this->gicp.getSourceCovariances());
   this->keyframe_transformations.push_back(this->T_corr);
@@ -758,10 +753,6 @@ void dlio::OdomNode::initializeDLIO() {
 
 void dlio::OdomNode::callbackPointCloud(const sensor_msgs::PointCloud2ConstPtr& pc) {
 
-  std::unique_lock<decltype(this->main_loop_running_mutex)> lock(main_loop_running_mutex);
-  this->main_loop_running = true;
-  lock.unlock();
-
   double then = ros::Time::now().toSec();
 
   if (this->first_scan_stamp == 0.) {
@@ -803,7 +794,6 @@ void dlio::OdomNode::callbackPointCloud(const sensor_msgs::PointCloud2ConstPtr&
   // Set initial frame as first keyframe
   if (this->keyframes.size() == 0) {
     this->initializeInputTarget();
-    this->main_loop_running = false;
     this->submap_future =
       std::async( std::launch::async, &dlio::OdomNode::buildKeyframesAndSubmap, this, this->state );
     this->submap_future.wait(); // wait until completion
@@ -818,14 +808,8 @@ void dlio::OdomNode::callbackPointCloud(const sensor_msgs::PointCloud2ConstPtr&
 
   // Build keyframe normals and submap if needed (and if we're not already waiting)
   if (this->new_submap_is_ready) {
-    this->main_loop_running = false;
     this->submap_future =
       std::async( std::launch::async, &dlio::OdomNode::buildKeyframesAndSubmap, this, this->state );
-  } else {
-    lock.lock();
-    this->main_loop_running = false;
-    lock.unlock();
-    this->submap_build_cv.notify_one();
   }
 
   // Update trajectory
@@ -1010,14 +994,8 @@ void dlio::OdomNode::getNextPose() {
 
   if (this->new_submap_is_ready && this->submap_hasChanged) {
 
-    // Set the current global submap as the target cloud
-    this->gicp.registerInputTarget(this->submap_cloud);
-
-    // Set submap kdtree
-    this->gicp.target_kdtree_ = this->submap_kdtree;
-
-    // Set target cloud's normals as submap normals
-    this->gicp.setTargetCovariances(this->submap_normals);
+    // Set the current global submap (points, kdtrees and normals) as the target
+    this->gicp.setTargetSubmap(this->submap);
 
     this->submap_hasChanged = false;
   }
@@ -1465,107 +1443,228 @@ void dlio::OdomNode::computeConvexHull() {
     return;
   }
 
-  // create a pointcloud with points at keyframes
+  // keyframes are only ever added, so the hull of all keyframes is the hull of the current hull keyframes and the
+  // new keyframes outside of it; nothing is recomputed while the new keyframes are inside
+  std::vector<int> candidates;
   pcl::PointCloud<PointType>::Ptr cloud =
     pcl::PointCloud<PointType>::Ptr (boost::make_shared<pcl::PointCloud<PointType>>());
 
-  std::unique_lock<decltype(this->keyframes_mutex)> lock(this->keyframes_mutex);
-  for (int i = 0; i < this->num_processed_keyframes; i++) {
+  auto add_candidate = [&](int i) {
     PointType pt;
-    pt.x = this->keyframes[i].first.first[0];
-    pt.y = this->keyframes[i].first.first[1];
-    pt.z = this->keyframes[i].first.first[2];
+    pt.getVector3fMap() = this->keyframe_index.position(i);
     cloud->push_back(pt);
+    candidates.push_back(i);
+  };
+
+  std::unique_lock<decltype(this->keyframes_mutex)> lock(this->keyframes_mutex);
+  bool changed = false;
+  if (this->keyframe_convex_planes.empty()) {
+    // no hull yet, or the last one was degenerate
+    for (int i = 0; i < this->num_processed_keyframes; i++) {
+      add_candidate(i);
+    }
+    changed = true;
+  } else {
+    for (auto k : this->keyframe_convex) {
+      add_candidate(k);
+    }
+    for (int i = this->num_convex_keyframes; i < this->num_processed_keyframes; i++) {
+      const Eigen::Vector3f& p = this->keyframe_index.position(i);
+      for (const auto& plane : this->keyframe_convex_planes) {
+        if (plane.head<3>().dot(p) + plane[3] > 1e-3) {
+          add_candidate(i);
+          changed = true;
+          break;
+        }
+      }
+    }
   }
+  this->num_convex_keyframes = this->num_processed_keyframes;
   lock.unlock();
 
-  // calculate the convex hull of the point cloud
+  if (!changed) {
+    return;
+  }
+
+  // keyframes of a planar trajectory are (close to) coplanar, take the 2d hull within their plane for them; a 3d
+  // hull of fewer than 4 facets is degenerate as well
+  Eigen::Vector3f mean = Eigen::Vector3f::Zero();
+  for (const auto& pt : cloud->points) {
+    mean += pt.getVector3fMap();
+  }
+  mean /= cloud->size();
+  Eigen::Matrix3f cov = Eigen::Matrix3f::Zero();
+  for (const auto& pt : cloud->points) {
+    const Eigen::Vector3f q = pt.getVector3fMap() - mean;
+    cov += q * q.transpose();
+  }
+  cov /= cloud->size();
+  bool planar = Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f>(cov, Eigen::EigenvaluesOnly).eigenvalues()[0] < 1e-6;
+
+  // calculate the convex hull of the candidates
   this->convex_hull.setInputCloud(cloud);
 
-  // get the indices of the keyframes on the convex hull
   pcl::PointCloud<PointType>::Ptr convex_points =
     pcl::PointCloud<PointType>::Ptr (boost::make_shared<pcl::PointCloud<PointType>>());
-  this->convex_hull.reconstruct(*convex_points);
+  std::vector<pcl::Vertices> convex_polygons;
+  if (!planar) {
+    this->convex_hull.reconstruct(*convex_points, convex_polygons);
+    planar = convex_polygons.size() < 4;
+  }
+  if (planar) {
+    this->convex_hull.setDimension(2);
+    this->convex_hull.reconstruct(*convex_points, convex_polygons);
+    this->convex_hull.setDimension(3);
+  }
 
+  // get the indices of the keyframes on the convex hull
   pcl::PointIndices::Ptr convex_hull_point_idx = pcl::PointIndices::Ptr (boost::make_shared<pcl::PointIndices>());
   this->convex_hull.getHullPointIndices(*convex_hull_point_idx);
 
   this->keyframe_convex.clear();
   for (int i=0; i<convex_hull_point_idx->indices.size(); ++i) {
-    this->keyframe_convex.push_back(convex_hull_point_idx->indices[i]);
+    this->keyframe_convex.push_back(candidates[convex_hull_point_idx->indices[i]]);
+  }
+
+  // outward facing planes bounding the hull, for the inside test of the next keyframes
+  this->keyframe_convex_planes.clear();
+  if (convex_polygons.empty()) {
+    // collinear keyframes, keep all of them and recompute the hull from scratch next time
+    this->keyframe_convex = candidates;
+    return;
+  }
+
+  Eigen::Vector3f centroid = Eigen::Vector3f::Zero();
+  for (const auto& pt : convex_points->points) {
+    centroid += pt.getVector3fMap();
+  }
+  centroid /= std::max<size_t>(convex_points->size(), 1);
+
+  auto add_plane = [&](Eigen::Vector3f normal, const Eigen::Vector3f& p) {
+    float d = -normal.dot(p);
+    if (normal.dot(centroid) + d > 0) {
+      normal = -normal;
+      d = -d;
+    }
+    this->keyframe_convex_planes.push_back(Eigen::Vector4f(normal[0], normal[1], normal[2], d));
+  };
+
+  for (const auto& polygon : convex_polygons) {
+    // Newell's method, also for facets that qhull merged into polygons
+    Eigen::Vector3f normal = Eigen::Vector3f::Zero();
+    for (int j = 0; j < polygon.vertices.size(); j++) {
+      const Eigen::Vector3f a = convex_points->points[polygon.vertices[j]].getVector3fMap();
+      const Eigen::Vector3f b = convex_points->points[polygon.vertices[(j + 1) % polygon.vertices.size()]].getVector3fMap();
+      normal += a.cross(b);
+    }
+    if (polygon.vertices.size() < 3 || normal.norm() < 1e-6) {
+      this->keyframe_convex_planes.clear();
+      break;
+    }
+    normal.normalize();
+
+    if (!planar) {
+      add_plane(normal, convex_points->points[polygon.vertices[0]].getVector3fMap());
+      continue;
+    }
+
+    // the centroid lies in the plane of a 2d hull, so the sign of its normal says nothing about inside; bound it by
+    // both sides of its plane and by the planes through its edges perpendicular to it
+    const Eigen::Vector3f p0 = convex_points->points[polygon.vertices[0]].getVector3fMap();
+    this->keyframe_convex_planes.push_back(Eigen::Vector4f(normal[0], normal[1], normal[2], -normal.dot(p0)));
+    this->keyframe_convex_planes.push_back(Eigen::Vector4f(-normal[0], -normal[1], -normal[2], normal.dot(p0)));
+    for (int j = 0; j < polygon.vertices.size(); j++) {
+      const Eigen::Vector3f a = convex_points->points[polygon.vertices[j]].getVector3fMap();
+      const Eigen::Vector3f b = convex_points->points[polygon.vertices[(j + 1) % polygon.vertices.size()]].getVector3fMap();
+      const Eigen::Vector3f edge_normal = (b - a).cross(normal);
+      if (edge_normal.norm() < 1e-6) {
+        continue;
+      }
+      add_plane(edge_normal.normalized(), a);
+    }
   }
 
 }
 
-void dlio::OdomNode::computeConcaveHull() {
+void dlio::OdomNode::computeConcaveHull(const Eigen::Vector3f& p) {
 
   // at least 5 keyframes for concave hull
   if (this->num_processed_keyframes < 5) {
     return;
   }
 
-  // create a pointcloud with points at keyframes
-  pcl::PointCloud<PointType>::Ptr cloud =
-    pcl::PointCloud<PointType>::Ptr (boost::make_shared<pcl::PointCloud<PointType>>());
+  // whether a keyframe is on the concave hull only depends on the keyframes within 2 alpha of it, so the hull is
+  // computed over the keyframes around p only. The radius grows until it holds the submap_kcc_ hull keyframes
+  // closest to p with a margin of 2 alpha.
+  const float alpha = this->concave_hull.getAlpha();
 
+  std::vector<int> nn_idx;
+  std::vector<float> nn_sq_ds;
   std::unique_lock<decltype(this->keyframes_mutex)> lock(this->keyframes_mutex);
-  for (int i = 0; i < this->num_processed_keyframes; i++) {
-    PointType pt;
-    pt.x = this->keyframes[i].first.first[0];
-    pt.y = this->keyframes[i].first.first[1];
-    pt.z = this->keyframes[i].first.first[2];
-    cloud->push_back(pt);
-  }
+  this->keyframe_index.nearestKSearch(p, this->submap_kcc_, this->num_processed_keyframes, nn_idx, nn_sq_ds);
   lock.unlock();
 
-  // calculate the concave hull of the point cloud
-  this->concave_hull.setInputCloud(cloud);
-
-  // get the indices of the keyframes on the concave hull
-  pcl::PointCloud<PointType>::Ptr concave_points =
-    pcl::PointCloud<PointType>::Ptr (boost::make_shared<pcl::PointCloud<PointType>>());
-  this->concave_hull.reconstruct(*concave_points);
+  float radius = 4 * alpha + (nn_sq_ds.empty() ? 0. : std::sqrt(nn_sq_ds.back()));
 
-  pcl::PointIndices::Ptr concave_hull_point_idx = pcl::PointIndices::Ptr (boost::make_shared<pcl::PointIndices>());
-  this->concave_hull.getHullPointIndices(*concave_hull_point_idx);
+  while (true) {
 
-  this->keyframe_concave.clear();
-  for (int i=0; i<concave_hull_point_idx->indices.size(); ++i) {
-    this->keyframe_concave.push_back(concave_hull_point_idx->indices[i]);
-  }
+    // create a pointcloud with points at the keyframes around p
+    pcl::PointCloud<PointType>::Ptr cloud =
+      pcl::PointCloud<PointType>::Ptr (boost::make_shared<pcl::PointCloud<PointType>>());
 
-}
+    lock.lock();
+    this->keyframe_index.radiusSearch(p, radius, this->num_processed_keyframes, nn_idx, nn_sq_ds);
+    for (auto k : nn_idx) {
+      PointType pt;
+      pt.getVector3fMap() = this->keyframe_index.position(k);
+      cloud->push_back(pt);
+    }
+    const bool all_keyframes = nn_idx.size() == this->num_processed_keyframes;
+    lock.unlock();
 
-void dlio::OdomNode::updateKeyframes() {
+    if (cloud->size() >= 5) {
 
-  // calculate difference in pose and rotation to all poses in trajectory
-  float closest_d = std::numeric_limits<float>::infinity();
-  int closest_idx = 0;
-  int keyframes_idx = 0;
+      // calculate the concave hull of the point cloud
+      this->concave_hull.setInputCloud(cloud);
 
-  int num_nearby = 0;
+      // get the indices of the keyframes on the concave hull
+      pcl::PointCloud<PointType>::Ptr concave_points =
+        pcl::PointCloud<PointType>::Ptr (boost::make_shared<pcl::PointCloud<PointType>>());
+      this->concave_hull.reconstruct(*concave_points);
 
-  for (const auto& k : this->keyframes) {
+      pcl::PointIndices::Ptr concave_hull_point_idx = pcl::PointIndices::Ptr (boost::make_shared<pcl::PointIndices>());
+      this->concave_hull.getHullPointIndices(*concave_hull_point_idx);
 
-    // calculate distance between current pose and pose in keyframes
-    float delta_d = sqrt( pow(this->state.p[0] - k.first.first[0], 2) +
-                          pow(this->state.p[1] - k.first.first[1], 2) +
-                          pow(this->state.p[2] - k.first.first[2], 2) );
+      // only the keyframes far enough inside of the radius are known to be on the hull of all keyframes
+      const float inner_radius = std::max(radius - 2 * alpha, 0.f);
+      this->keyframe_concave.clear();
+      for (int i=0; i<concave_hull_point_idx->indices.size(); ++i) {
+        const int j = concave_hull_point_idx->indices[i];
+        if (all_keyframes || nn_sq_ds[j] < inner_radius * inner_radius) {
+          this->keyframe_concave.push_back(nn_idx[j]);
+        }
+      }
 
-    // count the number nearby current pose
-    if (delta_d <= this->keyframe_thresh_dist_ * 1.5){
-      ++num_nearby;
+      if (all_keyframes || this->keyframe_concave.size() >= this->submap_kcc_) {
+        return;
+      }
     }
 
-    // store into variable
-    if (delta_d < closest_d) {
-      closest_d = delta_d;
-      closest_idx = keyframes_idx;
-    }
+    radius = 2 * std::max(radius, 1.f);
+  }
 
-    keyframes_idx++;
+}
 
-  }
+void dlio::OdomNode::updateKeyframes() {
+
+  // find the closest keyframe and count the keyframes nearby the current pose
+  std::vector<int> nn_idx;
+  std::vector<float> nn_sq_ds;
+  this->keyframe_index.nearestKSearch(this->state.p, 1, this->keyframe_index.size(), nn_idx, nn_sq_ds);
+  int closest_idx = nn_idx[0];
+
+  int num_nearby = this->keyframe_index.radiusSearch(this->state.p, this->keyframe_thresh_dist_ * 1.5,
+                                                     this->keyframe_index.size(), nn_idx, nn_sq_ds);
 
   // get closest pose and corresponding rotation
   Eigen::Vector3f closest_pose = this->keyframes[closest_idx].first.first;
@@ -1610,6 +1709,7 @@ void dlio::OdomNode::updateKeyframes() {
     // update keyframe vector
     std::unique_lock<decltype(this->keyframes_mutex)> lock(this->keyframes_mutex);
     this->keyframes.push_back(std::make_pair(std::make_pair(this->lidarPose.p, this->lidarPose.q), this->current_scan));
+    this->keyframe_index.add(this->lidarPose.p);
     this->keyframe_timestamps.push_back(this->scan_header_stamp);
     this->keyframe_normals.push_back(this->gicp.getSourceCovariances());
     this->keyframe_transformations.push_back(this->T_corr);
@@ -1678,20 +1778,18 @@ void dlio::OdomNode::buildSubmap(State vehicle_state) {
   // clear vector of keyframe indices to use for submap
   this->submap_kf_idx_curr.clear();
 
-  // calculate distance between current pose and poses in keyframe set
-  std::unique_lock<decltype(this->keyframes_mutex)> lock(this->keyframes_mutex);
-  std::vector<float> ds;
+  // get indices for top K nearest neighbor keyframe poses
   std::vector<int> keyframe_nn;
-  for (int i = 0; i < this->num_processed_keyframes; i++) {
-    float d = sqrt( pow(vehicle_state.p[0] - this->keyframes[i].first.first[0], 2) +
-                    pow(vehicle_state.p[1] - this->keyframes[i].first.first[1], 2) +
-                    pow(vehicle_state.p[2] - this->keyframes[i].first.first[2], 2) );
-    ds.push_back(d);
-    keyframe_nn.push_back(i);
-  }
+  std::vector<float> keyframe_nn_sq_ds;
+  std::unique_lock<decltype(this->keyframes_mutex)> lock(this->keyframes_mutex);
+  this->keyframe_index.nearestKSearch(vehicle_state.p, this->submap_knn_, this->num_processed_keyframes,
+                                      keyframe_nn, keyframe_nn_sq_ds);
   lock.unlock();
 
-  // get indices for top K nearest neighbor keyframe poses
+  std::vector<float> ds;
+  for (auto sq_d : keyframe_nn_sq_ds) {
+    ds.push_back(std::sqrt(sq_d));
+  }
   this->pushSubmapIndices(ds, this->submap_knn_, keyframe_nn);
 
   // get convex hull indices
@@ -1699,21 +1797,25 @@ void dlio::OdomNode::buildSubmap(State vehicle_state) {
 
   // get distances for each keyframe on convex hull
   std::vector<float> convex_ds;
+  lock.lock();
   for (const auto& c : this->keyframe_convex) {
-    convex_ds.push_back(ds[c]);
+    convex_ds.push_back((this->keyframe_index.position(c) - vehicle_state.p).norm());
   }
+  lock.unlock();
 
   // get indices for top kNN for convex hull
   this->pushSubmapIndices(convex_ds, this->submap_kcv_, this->keyframe_convex);
 
-  // get concave hull indices
-  this->computeConcaveHull();
+  // get concave hull indices around the current pose
+  this->computeConcaveHull(vehicle_state.p);
 
   // get distances for each keyframe on concave hull
   std::vector<float> concave_ds;
+  lock.lock();
   for (const auto& c : this->keyframe_concave) {
-    concave_ds.push_back(ds[c]);
+    concave_ds.push_back((this->keyframe_index.position(c) - vehicle_state.p).norm());
   }
+  lock.unlock();
 
   // get indices for top kNN for concave hull
   this->pushSubmapIndices(concave_ds, this->submap_kcc_, this->keyframe_concave);
@@ -1729,35 +1831,17 @@ void dlio::OdomNode::buildSubmap(State vehicle_state) {
   // check if submap has changed from previous iteration
   if (this->submap_kf_idx_curr != this->submap_kf_idx_prev){
 
-    this->submap_hasChanged = true;
-
-    // Pause to prevent stealing resources from the main loop if it is running.
-    this->pauseSubmapBuildIfNeeded();
-
-    // reinitialize submap cloud and normals
-    pcl::PointCloud<PointType>::Ptr submap_cloud_ (boost::make_shared<pcl::PointCloud<PointType>>());
-    std::shared_ptr<nano_gicp::CovarianceList> submap_normals_ (std::make_shared<nano_gicp::CovarianceList>());
-
+    // gather the submap keyframes and their normals
+    std::vector<nano_gicp::KeyframeSubmap<PointType>::Keyframe> submap_keyframes;
+    lock.lock();
     for (auto k : this->submap_kf_idx_curr) {
-
-      // create current submap cloud
-      lock.lock();
-      *submap_cloud_ += *this->keyframes[k].second;
-      lock.unlock();
-
-      // grab corresponding submap cloud's normals
-      submap_normals_->insert( std::end(*submap_normals_),
-          std::begin(*(this->keyframe_normals[k])), std::end(*(this->keyframe_normals[k])) );
+      submap_keyframes.push_back({k, this->keyframes[k].second, this->keyframe_normals[k]});
     }
+    lock.unlock();
 
-    this->submap_cloud = submap_cloud_;
-    this->submap_normals = submap_normals_;
-
-    // Pause to prevent stealing resources from the main loop if it is running.
-    this->pauseSubmapBuildIfNeeded();
-
-    this->gicp_temp.setInputTarget(this->submap_cloud);
-    this->submap_kdtree = this->gicp_temp.target_kdtree_;
+    // only the keyframes that joined the submap get a new kdtree, the submap in use by the main loop is left as is
+    this->submap = this->submap->update(submap_keyframes);
+    this->submap_hasChanged = true;
 
     this->submap_kf_idx_prev = this->submap_kf_idx_curr;
   }
@@ -1795,17 +1879,9 @@ void dlio::OdomNode::buildKeyframesAndSubmap(State vehicle_state) {
 
   lock.unlock();
 
-  // Pause to prevent stealing resources from the main loop if it is running.
-  this->pauseSubmapBuildIfNeeded();
-
   this->buildSubmap(vehicle_state);
 }
 
-void dlio::OdomNode::pauseSubmapBuildIfNeeded() {
-  std::unique_lock<decltype(this->main_loop_running_mutex)> lock(this->main_loop_running_mutex);
-  this->submap_build_cv.wait(lock, [this]{ return !this->main_loop_running; });
-}
-
 void dlio::OdomNode::debug() {
 
   // Total length traversed
@@ -0,0 +1,185 @@
+/***********************************************************
+ *                                                         *
+ * Copyright (c)                                           *
+ *                                                         *
+ * The Verifiable & Control-Theoretic Robotics (VECTR) Lab *
+ * University of California, Los Angeles                   *
+ *                                                         *
+ * Authors: Kenny J. Chen, Ryan Nemiroff, Brett T. Lopez   *
+ * Contact: {kennyjchen, ryguyn, btlopez}@ucla.edu         *
+ *                                                         *
+ ***********************************************************/
+
+#include "dlio/dlio.h"
+#include "nano_gicp/keyframe_submap.h"
+
+template class nano_gicp::KeyframeSubmap<PointType>;
+
+namespace nano_gicp {
+
+namespace {
+
+// nanoflann result set for the nearest point within a distance bound, skipping points of switched off keyframes
+class NearestResultSet {
+public:
+  NearestResultSet(float max_sq_dist, const int* point_keyframe, const char* active)
+    : dist_(max_sq_dist), index_(-1), point_keyframe_(point_keyframe), active_(active) {}
+
+  size_t size() const { return index_ >= 0 ? 1 : 0; }
+  bool full() const { return true; }
+  float worstDist() const { return dist_; }
+
+  bool addPoint(float dist, int index) {
+    if (dist < dist_ && (active_ == nullptr || active_[point_keyframe_[index]])) {
+      dist_ = dist;
+      index_ = index;
+    }
+    return true;
+  }
+
+  float dist() const { return dist_; }
+  int index() const { return index_; }
+
+private:
+  float dist_;
+  int index_;
+  const int* point_keyframe_;
+  const char* active_;        // nullptr if all keyframes are active
+};
+
+}  // namespace
+
+template <typename PointT>
+std::shared_ptr<const typename KeyframeSubmap<PointT>::BlockData>
+KeyframeSubmap<PointT>::build(const std::vector<Keyframe>& keyframes) {
+  std::shared_ptr<BlockData> data = std::make_shared<BlockData>();
+  typename pcl::PointCloud<PointT>::Ptr cloud (boost::make_shared<pcl::PointCloud<PointT>>());
+
+  for (const auto& kf : keyframes) {
+    data->point_keyframe.insert(data->point_keyframe.end(), kf.cloud->size(), data->keyframes.size());
+    data->keyframes.push_back(kf);
+    *cloud += *kf.cloud;
+    data->covariances.insert(data->covariances.end(), kf.covariances->begin(), kf.covariances->end());
+  }
+
+  data->cloud = cloud;
+  data->kdtree.setInputCloud(cloud);
+  return data;
+}
+
+template <typename PointT>
+typename KeyframeSubmap<PointT>::Block KeyframeSubmap<PointT>::activeBlock(const std::shared_ptr<const BlockData>& data) {
+  Block block;
+  block.data = data;
+  block.active.assign(data->keyframes.size(), true);
+  block.size = data->cloud->size();
+  block.offset = 0;
+  return block;
+}
+
+template <typename PointT>
+std::vector<typename KeyframeSubmap<PointT>::Keyframe> KeyframeSubmap<PointT>::activeKeyframes(const Block& block) {
+  std::vector<Keyframe> keyframes;
+  for (int k = 0; k < block.data->keyframes.size(); k++) {
+    if (block.active[k]) {
+      keyframes.push_back(block.data->keyframes[k]);
+    }
+  }
+  return keyframes;
+}
+
+template <typename PointT>
+std::shared_ptr<const KeyframeSubmap<PointT>> KeyframeSubmap<PointT>::update(const std::vector<Keyframe>& keyframes) const {
+  std::shared_ptr<KeyframeSubmap> submap = std::make_shared<KeyframeSubmap>();
+
+  for (const auto& kf : keyframes) {
+    submap->keyframes_.push_back(kf.id);
+  }
+  std::sort(submap->keyframes_.begin(), submap->keyframes_.end());
+  const std::vector<int>& ids = submap->keyframes_;
+
+  // switch off the keyframes that left the submap
+  std::vector<int> in_blocks;
+  for (const Block& old_block : this->blocks_) {
+    Block block = old_block;
+    block.size = 0;
+    for (int k = 0; k < block.data->keyframes.size(); k++) {
+      const Keyframe& kf = block.data->keyframes[k];
+      block.active[k] = std::binary_search(ids.begin(), ids.end(), kf.id);
+      if (block.active[k]) {
+        block.size += kf.cloud->size();
+        in_blocks.push_back(kf.id);
+      }
+    }
+
+    if (block.size == 0) {
+      continue;
+    }
+
+    // rebuild a block once most of it is switched off, so that searches do not wade through removed points
+    if (2 * block.size < block.data->cloud->size()) {
+      block = activeBlock(build(activeKeyframes(block)));
+    }
+
+    submap->blocks_.push_back(block);
+  }
+
+  // the keyframes that joined the submap go into a new block
+  std::sort(in_blocks.begin(), in_blocks.end());
+  std::vector<Keyframe> added;
+  for (const auto& kf : keyframes) {
+    if (!std::binary_search(in_blocks.begin(), in_blocks.end(), kf.id) && !kf.cloud->empty()) {
+      added.push_back(kf);
+    }
+  }
+  if (!added.empty()) {
+    submap->blocks_.push_back(activeBlock(build(added)));
+  }
+
+  // merge the smallest block into the next larger one while it is at least half its size or there are too many blocks
+  std::vector<Block>& blocks = submap->blocks_;
+  std::stable_sort(blocks.begin(), blocks.end(), [](const Block& a, const Block& b) { return a.size > b.size; });
+  while (blocks.size() > 1 && (2 * blocks.back().size >= blocks[blocks.size() - 2].size || blocks.size() > MAX_BLOCKS)) {
+    std::vector<Keyframe> merged = activeKeyframes(blocks[blocks.size() - 2]);
+    std::vector<Keyframe> smallest = activeKeyframes(blocks.back());
+    merged.insert(merged.end(), smallest.begin(), smallest.end());
+    blocks.pop_back();
+    blocks.back() = activeBlock(build(merged));
+    std::stable_sort(blocks.begin(), blocks.end(), [](const Block& a, const Block& b) { return a.size > b.size; });
+  }
+
+  int offset = 0;
+  for (Block& block : blocks) {
+    block.offset = offset;
+    offset += block.data->cloud->size();
+    submap->size_ += block.size;
+  }
+
+  return submap;
+}
+
+template <typename PointT>
+bool KeyframeSubmap<PointT>::nearest(const PointT& point, float max_sq_dist, Match& match) const {
+  match.index = -1;
+  match.sq_dist = max_sq_dist;
+  match.point = nullptr;
+  match.covariance = nullptr;
+
+  for (const Block& block : this->blocks_) {
+    const BlockData& data = *block.data;
+    const bool all_active = block.size == data.cloud->size();
+    NearestResultSet result(match.sq_dist, data.point_keyframe.data(), all_active ? nullptr : block.active.data());
+    data.kdtree.findNeighbors(result, point);
+
+    if (result.index() >= 0) {
+      match.index = block.offset + result.index();
+      match.sq_dist = result.dist();
+      match.point = &data.cloud->points[result.index()];
+      match.covariance = &data.covariances[result.index()];
+    }
+  }
+
+  return match.index >= 0;
+}
+
+}  // namespace nano_gicp
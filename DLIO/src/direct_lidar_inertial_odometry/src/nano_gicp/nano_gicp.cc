@@ -44,6 +44,7 @@
 
 #include "dlio/dlio.h"
 #include "nano_gicp/nano_gicp.h"
+#include "nano_gicp/keyframe_submap.h"
 
 template class nano_gicp::NanoGICP<PointType, PointType>;
 
@@ -60,6 +61,8 @@ NanoGICP<PointSource, PointTarget>::NanoGICP() {
   k_correspondences_ = 20;
   reg_name_ = "NanoGICP";
   corr_dist_threshold_ = std::numeric_limits<float>::max();
+  reuse_max_motion_ = 0.0;
+  correspondences_valid_ = false;
 
   regularization_method_ = RegularizationMethod::PLANE;
 }
@@ -88,6 +91,11 @@ void NanoGICP<PointSource, PointTarget>::setMaxCorrespondenceDistance(double cor
   corr_dist_threshold_ = corr;
 }
 
+template <typename PointSource, typename PointTarget>
+void NanoGICP<PointSource, PointTarget>::setCorrespondenceReuseThreshold(double max_motion) {
+  reuse_max_motion_ = max_motion;
+}
+
 template <typename PointSource, typename PointTarget>
 void NanoGICP<PointSource, PointTarget>::setRegularizationMethod(RegularizationMethod method) {
   regularization_method_ = method;
@@ -98,21 +106,26 @@ void NanoGICP<PointSource, PointTarget>::swapSourceAndTarget() {
   input_.swap(target_);
   source_kdtree_.swap(target_kdtree_);
   source_covs_.swap(target_covs_);
+  target_submap_.reset();
 
   correspondences_.clear();
   sq_distances_.clear();
+  invalidate_correspondences();
 }
 
 template <typename PointSource, typename PointTarget>
 void NanoGICP<PointSource, PointTarget>::clearSource() {
   input_.reset();
   source_covs_.reset();
+  invalidate_correspondences();
 }
 
 template <typename PointSource, typename PointTarget>
 void NanoGICP<PointSource, PointTarget>::clearTarget() {
   target_.reset();
   target_covs_.reset();
+  target_submap_.reset();
+  invalidate_correspondences();
 }
 
 template <typename PointSource, typename PointTarget>
@@ -121,10 +134,13 @@ void NanoGICP<PointSource, PointTarget>::registerInputSource(const PointCloudSou
     return;
   }
   pcl::Registration<PointSource, PointTarget, Scalar>::setInputSource(cloud);
+  invalidate_correspondences();
 }
 
 template <typename PointSource, typename PointTarget>
 void NanoGICP<PointSource, PointTarget>::registerInputTarget(const PointCloudTargetConstPtr& cloud) {
+  target_submap_.reset();
+  invalidate_correspondences();
   if (target_ == cloud) {
     return;
   }
@@ -144,10 +160,13 @@ void NanoGICP<PointSource, PointTarget>::setInputSource(const PointCloudSourceCo
   source_kdtree_ = source_kdtree;
 
   source_covs_.reset();
+  invalidate_correspondences();
 }
 
 template <typename PointSource, typename PointTarget>
 void NanoGICP<PointSource, PointTarget>::setInputTarget(const PointCloudTargetConstPtr& cloud) {
+  target_submap_.reset();
+  invalidate_correspondences();
   if (target_ == cloud) {
     return;
   }
@@ -163,11 +182,23 @@ void NanoGICP<PointSource, PointTarget>::setInputTarget(const PointCloudTargetCo
 template <typename PointSource, typename PointTarget>
 void NanoGICP<PointSource, PointTarget>::setSourceCovariances(const std::shared_ptr<const CovarianceList>& covs) {
   source_covs_ = covs;
+  invalidate_correspondences();
 }
 
 template <typename PointSource, typename PointTarget>
 void NanoGICP<PointSource, PointTarget>::setTargetCovariances(const std::shared_ptr<const CovarianceList>& covs) {
   target_covs_ = covs;
+  invalidate_correspondences();
+}
+
+template <typename PointSource, typename PointTarget>
+void NanoGICP<PointSource, PointTarget>::setTargetSubmap(const std::shared_ptr<const KeyframeSubmap<PointTarget>>& submap) {
+  // pcl::Registration::align() only checks that there is a target cloud, the points are looked up in the submap
+  if (submap->numBlocks() > 0) {
+    registerInputTarget(submap->blockCloud(0));
+  }
+  target_submap_ = submap;
+  invalidate_correspondences();
 }
 
 template <typename PointSource, typename PointTarget>
@@ -177,6 +208,7 @@ bool NanoGICP<PointSource, PointTarget>::calculateSourceCovariances() {
   bool ret = calculate_covariances(input_, *source_kdtree_, *source_covs, *source_density);
   source_covs_ = source_covs;
   source_density_ = *source_density;
+  invalidate_correspondences();
   return ret;
 }
 
@@ -187,6 +219,7 @@ bool NanoGICP<PointSource, PointTarget>::calculateTargetCovariances() {
   bool ret = calculate_covariances(target_, *target_kdtree_, *target_covs, *target_density);
   target_covs_ = target_covs;
   target_density_ = *target_density;
+  invalidate_correspondences();
   return ret;
 }
 
@@ -195,23 +228,37 @@ void NanoGICP<PointSource, PointTarget>::computeTransformation(PointCloudSource&
   if (source_covs_ == nullptr || source_covs_->size() != input_->size()) {
     calculateSourceCovariances();
   }
-  if (target_covs_ == nullptr || target_covs_->size() != target_->size()) {
+  if (target_submap_ == nullptr && (target_covs_ == nullptr || target_covs_->size() != target_->size())) {
     calculateTargetCovariances();
   }
 
   LsqRegistration<PointSource, PointTarget>::computeTransformation(output, guess);
 }
 
+template <typename PointSource, typename PointTarget>
+void NanoGICP<PointSource, PointTarget>::invalidate_correspondences() {
+  correspondences_valid_ = false;
+}
+
 template <typename PointSource, typename PointTarget>
 void NanoGICP<PointSource, PointTarget>::update_correspondences(const Eigen::Isometry3d& trans) {
   assert(source_covs_ != nullptr && source_covs_->size() == input_->size());
-  assert(target_covs_ != nullptr && target_covs_->size() == target_->size());
+  assert(target_submap_ != nullptr || (target_covs_ != nullptr && target_covs_->size() == target_->size()));
 
   Eigen::Isometry3f trans_f = trans.cast<float>();
+  const Eigen::Matrix3f R = trans_f.linear();
+  const float max_sq_dist = corr_dist_threshold_ * corr_dist_threshold_;
+  const float reuse_sq_motion = reuse_max_motion_ * reuse_max_motion_;
+  const bool reuse = reuse_max_motion_ > 0.0 && correspondences_valid_ && correspondences_.size() == input_->size();
 
   correspondences_.resize(input_->size());
   sq_distances_.resize(input_->size());
-  mahalanobis_.resize(input_->size());
+  target_points_.resize(input_->size());
+  search_points_.resize(input_->size());
+  target_covs_ptr_.resize(input_->size());
+  for (auto& m : mahalanobis_) {
+    m.resize(input_->size());
+  }
 
   std::vector<int> k_indices(1);
   std::vector<float> k_sq_dists(1);
@@ -221,29 +268,99 @@ void NanoGICP<PointSource, PointTarget>::update_correspondences(const Eigen::Iso
     PointTarget pt;
     pt.getVector4fMap() = trans_f * input_->at(i).getVector4fMap();
 
-    target_kdtree_->nearestKSearch(pt, 1, k_indices, k_sq_dists);
+    bool reused = false;
+    if (reuse && correspondences_[i] >= 0 && (pt.getVector3fMap() - search_points_[i]).squaredNorm() < reuse_sq_motion) {
+      const float sq_dist = (pt.getVector3fMap() - target_points_[i].template head<3>().template cast<float>()).squaredNorm();
+      if (sq_dist < max_sq_dist) {
+        sq_distances_[i] = sq_dist;
+        reused = true;
+      }
+    }
 
-    sq_distances_[i] = k_sq_dists[0];
-    correspondences_[i] = k_sq_dists[0] < corr_dist_threshold_ * corr_dist_threshold_ ? k_indices[0] : -1;
+    if (!reused) {
+      const PointTarget* point_B;
+      const Eigen::Matrix4d* cov_B;
+      if (target_submap_) {
+        typename KeyframeSubmap<PointTarget>::Match match;
+        target_submap_->nearest(pt, max_sq_dist, match);
+
+        sq_distances_[i] = match.sq_dist;
+        correspondences_[i] = match.index;
+        point_B = match.point;
+        cov_B = match.covariance;
+      } else {
+        target_kdtree_->nearestKSearch(pt, 1, k_indices, k_sq_dists);
+
+        sq_distances_[i] = k_sq_dists[0];
+        correspondences_[i] = k_sq_dists[0] < max_sq_dist ? k_indices[0] : -1;
+        point_B = correspondences_[i] < 0 ? nullptr : &target_->at(correspondences_[i]);
+        cov_B = correspondences_[i] < 0 ? nullptr : &(*target_covs_)[correspondences_[i]];
+      }
 
-    if (correspondences_[i] < 0) {
-      continue;
+      search_points_[i] = pt.getVector3fMap();
+      if (correspondences_[i] >= 0) {
+        target_points_[i] = point_B->getVector4fMap().template cast<double>();
+        target_covs_ptr_[i] = cov_B;
+      }
     }
 
-    const int target_index = correspondences_[i];
-    const auto& cov_A = (*source_covs_)[i];
-    const auto& cov_B = (*target_covs_)[target_index];
+    // the covariances have a zero last row and column, so only the 3x3 block of RCR has to be inverted
+    Eigen::Matrix3f RCR = Eigen::Matrix3f::Identity();
+    if (correspondences_[i] >= 0) {
+      const Eigen::Matrix3f cov_A = (*source_covs_)[i].template topLeftCorner<3, 3>().template cast<float>();
+      const Eigen::Matrix3f cov_B = target_covs_ptr_[i]->template topLeftCorner<3, 3>().template cast<float>();
+      RCR = cov_B + R * cov_A * R.transpose();
+    }
 
-    Eigen::Matrix4d RCR = cov_B + trans.matrix() * cov_A * trans.matrix().transpose();
-    RCR(3, 3) = 1.0;
+    mahalanobis_[0][i] = RCR(0, 0);
+    mahalanobis_[1][i] = RCR(0, 1);
+    mahalanobis_[2][i] = RCR(0, 2);
+    mahalanobis_[3][i] = RCR(1, 1);
+    mahalanobis_[4][i] = RCR(1, 2);
+    mahalanobis_[5][i] = RCR(2, 2);
+  }
 
-    mahalanobis_[i] = RCR.inverse();
-    mahalanobis_[i](3, 3) = 0.0f;
+  // invert the symmetric RCRs in place through their adjugates
+  float* xx = mahalanobis_[0].data();
+  float* xy = mahalanobis_[1].data();
+  float* xz = mahalanobis_[2].data();
+  float* yy = mahalanobis_[3].data();
+  float* yz = mahalanobis_[4].data();
+  float* zz = mahalanobis_[5].data();
+  const int n = input_->size();
+
+#pragma omp parallel for simd num_threads(num_threads_) schedule(static)
+  for (int i = 0; i < n; i++) {
+    const float a00 = yy[i] * zz[i] - yz[i] * yz[i];
+    const float a01 = xz[i] * yz[i] - xy[i] * zz[i];
+    const float a02 = xy[i] * yz[i] - xz[i] * yy[i];
+    const float a11 = xx[i] * zz[i] - xz[i] * xz[i];
+    const float a12 = xy[i] * xz[i] - xx[i] * yz[i];
+    const float a22 = xx[i] * yy[i] - xy[i] * xy[i];
+    const float inv_det = 1.0f / (xx[i] * a00 + xy[i] * a01 + xz[i] * a02);
+
+    xx[i] = a00 * inv_det;
+    xy[i] = a01 * inv_det;
+    xz[i] = a02 * inv_det;
+    yy[i] = a11 * inv_det;
+    yz[i] = a12 * inv_det;
+    zz[i] = a22 * inv_det;
   }
 
+  correspondences_valid_ = true;
+
   num_correspondences = std::count_if(correspondences_.begin(), correspondences_.end(), [](int c){return c > 0;});
 }
 
+template <typename PointSource, typename PointTarget>
+Eigen::Matrix3d NanoGICP<PointSource, PointTarget>::mahalanobis(int i) const {
+  Eigen::Matrix3d m;
+  m << mahalanobis_[0][i], mahalanobis_[1][i], mahalanobis_[2][i],
+       mahalanobis_[1][i], mahalanobis_[3][i], mahalanobis_[4][i],
+       mahalanobis_[2][i], mahalanobis_[4][i], mahalanobis_[5][i];
+  return m;
+}
+
 template <typename PointSource, typename PointTarget>
 double NanoGICP<PointSource, PointTarget>::linearize(const Eigen::Isometry3d& trans, Eigen::Matrix<double, 6, 6>* H, Eigen::Matrix<double, 6, 1>* b) {
   update_correspondences(trans);
@@ -265,25 +382,26 @@ double NanoGICP<PointSource, PointTarget>::linearize(const Eigen::Isometry3d& tr
 
     const Eigen::Vector4d mean_A = input_->at(i).getVector4fMap().template cast<double>();
 
-    const Eigen::Vector4d mean_B = target_->at(target_index).getVector4fMap().template cast<double>();
+    const Eigen::Vector4d& mean_B = target_points_[i];
 
     const Eigen::Vector4d transed_mean_A = trans * mean_A;
-    const Eigen::Vector4d error = mean_B - transed_mean_A;
+    const Eigen::Vector3d error = (mean_B - transed_mean_A).head<3>();
+    const Eigen::Matrix3d M = mahalanobis(i);
 
-    sum_errors += error.transpose() * mahalanobis_[i] * error;
+    sum_errors += error.transpose() * M * error;
 
     if (H == nullptr || b == nullptr) {
       continue;
     }
 
-    Eigen::Matrix<double, 4, 6> dtdx0 = Eigen::Matrix<double, 4, 6>::Zero();
+    Eigen::Matrix<double, 3, 6> dtdx0;
     dtdx0.block<3, 3>(0, 0) = skewd(transed_mean_A.head<3>());
     dtdx0.block<3, 3>(0, 3) = -Eigen::Matrix3d::Identity();
 
-    Eigen::Matrix<double, 4, 6> jlossexp = dtdx0;
+    Eigen::Matrix<double, 3, 6> jlossexp = dtdx0;
 
-    Eigen::Matrix<double, 6, 6> Hi = jlossexp.transpose() * mahalanobis_[i] * jlossexp;
-    Eigen::Matrix<double, 6, 1> bi = jlossexp.transpose() * mahalanobis_[i] * error;
+    Eigen::Matrix<double, 6, 6> Hi = jlossexp.transpose() * M * jlossexp;
+    Eigen::Matrix<double, 6, 1> bi = jlossexp.transpose() * M * error;
 
     Hs[omp_get_thread_num()] += Hi;
     bs[omp_get_thread_num()] += bi;
@@ -314,12 +432,12 @@ double NanoGICP<PointSource, PointTarget>::compute_error(const Eigen::Isometry3d
 
     const Eigen::Vector4d mean_A = input_->at(i).getVector4fMap().template cast<double>();
 
-    const Eigen::Vector4d mean_B = target_->at(target_index).getVector4fMap().template cast<double>();
+    const Eigen::Vector4d& mean_B = target_points_[i];
 
     const Eigen::Vector4d transed_mean_A = trans * mean_A;
-    const Eigen::Vector4d error = mean_B - transed_mean_A;
+    const Eigen::Vector3d error = (mean_B - transed_mean_A).head<3>();
 
-    sum_errors += error.transpose() * mahalanobis_[i] * error;
+    sum_errors += error.transpose() * mahalanobis(i) * error;
   }
 
   return sum_errors;
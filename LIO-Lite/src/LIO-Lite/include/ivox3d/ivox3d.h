@@ -71,6 +71,15 @@ class IVox {
 
     void Clear();
 
+    /**
+     * remove grids, keys that are not in the map are ignored
+     * @param keys
+     */
+    void RemoveGrids(const std::vector<KeyType>& keys);
+
+    /// position to grid
+    KeyType Pos2Grid(const PtType& pt) const;
+
     /// get nn
     bool GetClosestPoint(const PointType& pt, PointType& closest_pt);
 
@@ -93,9 +102,6 @@ class IVox {
     /// generate the nearby grids according to the given options
     void GenerateNearbyGrids();
 
-    /// position to grid
-    KeyType Pos2Grid(const PtType& pt) const;
-
     Options options_;
     std::unordered_map<KeyType, typename std::list<std::pair<KeyType, NodeType>>::iterator, hash_vec<dim>>
         grids_map_;                                        // voxel hash map
@@ -285,6 +291,17 @@ void IVox<dim, node_type, PointType>::Clear(){
     grids_cache_.clear();
 }
 
+template <int dim, IVoxNodeType node_type, typename PointType>
+void IVox<dim, node_type, PointType>::RemoveGrids(const std::vector<KeyType>& keys) {
+    for (const auto& key : keys) {
+        auto iter = grids_map_.find(key);
+        if (iter != grids_map_.end()) {
+            grids_cache_.erase(iter->second);
+            grids_map_.erase(iter);
+        }
+    }
+}
+
 template <int dim, IVoxNodeType node_type, typename PointType>
 Eigen::Matrix<int, dim, 1> IVox<dim, node_type, PointType>::Pos2Grid(const IVox::PtType& pt) const {
     return (pt * options_.inv_resolution_).array().round().template cast<int>();
@@ -20,8 +20,10 @@
 
 #include "imu_processing.hpp"
 #include "ivox3d/ivox3d.h"
+#include "map_tile_loader.h"
 #include "options.h"
 #include "pointcloud_preprocess.h"
+#include "register/global_localizer.hpp"
 #include "register/ndt.hpp"
 
 namespace lio_lite {
@@ -83,9 +85,12 @@ class LaserMapping {
     void Load_map();
     void Run_location();
   private:
+    void Load_split_map();
+    /// read the tiles around center into global_map_ for relocalization, does nothing if they are read already
+    void LoadRelocalizationMap(const Vec3d &center);
     void initialpose_callback(const geometry_msgs::PoseWithCovarianceStampedConstPtr& pose_msg);
     void initialpose();
-    void initialpose2();
+    void initialpose2();  // multi-resolution ndt search, see P2P::GlobalLocalizer
     void VisualMap(const ros::TimerEvent &e);
     ros::Subscriber sub_init_pose_;
     ros::Publisher pub_global_map_, pub_feature_map_;
@@ -103,6 +108,11 @@ class LaserMapping {
     std::mutex init_lock_;
     std::string str_g_map_, str_f_map_;
     double load_eaf_size_;
+    bool fast_relocalization_ = true;                  // initialpose2 instead of pcl ndt + icp
+    double reloc_search_radius_ = 10.0;
+    int reloc_yaw_steps_ = 36;
+    double reloc_min_score_ = 0.25;
+    std::shared_ptr<P2P::GlobalLocalizer> global_localizer_ = nullptr;
 
 
    private:
@@ -123,7 +133,13 @@ class LaserMapping {
     void PrintState(const state_ikfom &s);
     
     void SplitMap(CloudPtr map);
-    void DynamicLoadMap(Vec3d pose);
+    /// load the tiles around pose into ivox and unload the far ones, tiles ahead of vel are prefetched
+    /// if wait is false, tiles that are not loaded yet are skipped and added in a later call
+    void DynamicLoadMap(Vec3d pose, Vec3d vel = Vec3d::Zero(), bool wait = false);
+    /// key of the tile holding p
+    Vec2i TileKey(const Vec3d &p) const;
+    void AddMapTile(const Vec2i &key, CloudPtr cloud);
+    void RemoveMapTiles(const std::vector<Vec2i> &keys);
 
    private:
     /// modules
@@ -219,8 +235,17 @@ class LaserMapping {
     /////////////////////////  location  //////////////////////////////////////////////////////////////
     bool split_map_ = false;
     float sub_grid_resolution_ = 100;
+    double tile_prefetch_time_ = 3.0;                                   // prefetch the tiles we reach in this time
+    int tile_cache_size_ = 16;                                          // max prefetched tiles waiting in memory
+    std::shared_ptr<MapTileLoader> tile_loader_ = nullptr;
     std::set<Eigen::Vector2i, less_vec<2>> map_data_index_;
-    std::set<Eigen::Vector2i, less_vec<2>> hold_map_;
+    Vec2i reloc_map_key_ = Vec2i::Zero();                               // tile global_map_ was read around
+    struct HeldTile {
+        std::vector<Vec3i> grids;   // ivox grids with points of the tile
+        PointVector border_points;  // points of the tile in grids that may be shared with a neighbour tile
+    };
+    std::map<Eigen::Vector2i, HeldTile, less_vec<2>> hold_map_;          // loaded tiles
+    std::unordered_map<Vec3i, int, hash_vec<3>> grid_tile_cnt_;          // number of loaded tiles in each grid
 };
 
 }  // namespace lio_lite
@@ -0,0 +1,60 @@
+#ifndef LIO_LITE_MAP_TILE_LOADER_H
+#define LIO_LITE_MAP_TILE_LOADER_H
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+#include "common_lib.h"
+#include "ivox3d/eigen_types.h"
+#include "tile_map_file.h"
+
+namespace lio_lite {
+
+/**
+ * Background loader of the split map tiles
+ *
+ * Tiles are requested by their grid index and read on a worker thread, so that the localization loop never waits for
+ * the disk. They come from the packed tile file if one is given, otherwise from "<tile_dir>/<x>_<y>.pcd". Loaded tiles
+ * wait in a small cache until they are taken, the oldest ones are dropped if more than cache_size tiles are waiting.
+ */
+class MapTileLoader {
+   public:
+    MapTileLoader(const std::string &tile_dir, std::size_t cache_size = 16,
+                  std::shared_ptr<const TileMapFile> tile_file = nullptr);
+    ~MapTileLoader();
+
+    /// queue a tile for loading, does nothing if it is already queued or loaded
+    void Request(const Vec2i &key);
+
+    /// take a loaded tile out of the cache, nullptr if it is not ready yet
+    CloudPtr Take(const Vec2i &key);
+
+    /// take a tile, waiting for it to be loaded
+    CloudPtr TakeBlocking(const Vec2i &key);
+
+   private:
+    void WorkerLoop();
+
+    std::string tile_dir_;
+    std::size_t cache_size_ = 16;
+    std::shared_ptr<const TileMapFile> tile_file_ = nullptr;
+
+    std::mutex mtx_;
+    std::condition_variable cv_request_;
+    std::condition_variable cv_ready_;
+    std::deque<Vec2i> requests_;                       // tiles to load, in request order
+    std::set<Vec2i, less_vec<2>> pending_;             // tiles queued or being loaded
+    std::map<Vec2i, CloudPtr, less_vec<2>> ready_;     // loaded tiles waiting to be taken
+    std::deque<Vec2i> ready_order_;                    // load order of ready_, for dropping old tiles
+    bool stop_ = false;
+    std::thread worker_;
+};
+
+}  // namespace lio_lite
+
+#endif  // LIO_LITE_MAP_TILE_LOADER_H
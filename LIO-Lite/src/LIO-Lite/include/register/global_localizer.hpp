@@ -0,0 +1,147 @@
+#ifndef SLAM_ULTRA_GLOBAL_LOCALIZER_H_
+#define SLAM_ULTRA_GLOBAL_LOCALIZER_H_
+
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "register/ndt.hpp"
+
+
+namespace P2P{
+
+/**
+ * 由粗到精的全局重定位
+ *
+ * 目标地图按 voxel_sizes_ 建立多层 Ndt3d 栅格金字塔 (只建一次).
+ * 1. 在最粗一层, 以初值为中心的平移网格 x 全部yaw角构成假设, 并行计算ndt得分, 保留得分最高的若干个
+ * 2. 逐层用 Ndt3d::AlignNdt 精化候选位姿并重新打分, 每层淘汰一半
+ * 3. 最细一层得分最高的候选作为结果, 得分低于 min_score_ 认为失败
+ */
+class GlobalLocalizer {
+public:
+  struct Options {
+    std::vector<double> voxel_sizes_{4.0, 2.0, 1.0};  // 金字塔各层栅格大小, 由粗到细
+    double search_radius_ = 10.0;                     // 平移搜索半径, 步长为最粗一层的栅格大小
+    int yaw_steps_ = 36;                              // yaw假设个数, 覆盖360度
+    int num_candidates_ = 8;                          // 粗搜索保留的候选个数
+    double min_score_ = 0.25;                         // 最细一层的最小得分
+  };
+
+  GlobalLocalizer() = default;
+  GlobalLocalizer(Options options) : options_(options) {}
+
+  /// 设置地图, 建立栅格金字塔
+  void SetTarget(CloudPtr target) {
+    levels_.clear();
+    for (double voxel_size : options_.voxel_sizes_) {
+      Ndt3d::Options ndt_options;
+      ndt_options.voxel_size_ = voxel_size;
+      auto ndt = std::make_shared<Ndt3d>(ndt_options);
+      ndt->SetTarget(target);
+      levels_.emplace_back(ndt);
+    }
+  }
+
+  /**
+   * 重定位
+   * @param source  当前scan
+   * @param pose    输入为初值 (只使用平移和z, 滚转与俯仰), 输出为结果
+   * @return 是否成功
+   */
+  inline bool Localize(CloudPtr source, Eigen::Affine3d& pose);
+
+  double BestScore() const { return best_score_; }
+
+private:
+  struct Candidate {
+    Eigen::Affine3d pose_;
+    double score_ = 0;
+  };
+
+  /// 每个栅格只保留一个点
+  static CloudPtr Downsample(CloudPtr cloud, double leaf_size) {
+    std::unordered_map<Vec3i, size_t, hash_vec<3>> voxels;
+    CloudPtr output(new PointCloudT);
+    for (const auto& pt : cloud->points) {
+      Vec3i key = (pt.getVector3fMap() / leaf_size).array().floor().cast<int>();
+      if (voxels.emplace(key, output->size()).second) {
+        output->points.emplace_back(pt);
+      }
+    }
+    output->width = output->size();
+    output->height = 1;
+    return output;
+  }
+
+  /// 按得分从高到低排序并保留前num个
+  static void KeepBest(std::vector<Candidate>& candidates, size_t num) {
+    num = std::min(num, candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + num, candidates.end(),
+                      [](const Candidate& c1, const Candidate& c2) { return c1.score_ > c2.score_; });
+    candidates.resize(num);
+  }
+
+  Options options_;
+  std::vector<std::shared_ptr<Ndt3d>> levels_;  // 由粗到细
+  double best_score_ = 0;
+};
+
+inline bool GlobalLocalizer::Localize(CloudPtr source, Eigen::Affine3d& pose) {
+  assert(!levels_.empty());
+  best_score_ = 0;
+
+  // 粗搜索: 平移网格 x yaw
+  const double step = levels_.front()->VoxelSize();
+  const int half_steps = std::floor(options_.search_radius_ / step);
+  const Vec3d euler = pose.rotation().eulerAngles(2, 1, 0);  // yaw, pitch, roll
+  const Mat3d pitch_roll = (Eigen::AngleAxisd(euler[1], Vec3d::UnitY()) * Eigen::AngleAxisd(euler[2], Vec3d::UnitX()))
+                               .toRotationMatrix();
+
+  std::vector<Candidate> candidates;
+  for (int ix = -half_steps; ix <= half_steps; ++ix) {
+    for (int iy = -half_steps; iy <= half_steps; ++iy) {
+      if (Vec2d(ix, iy).norm() * step > options_.search_radius_ + 1e-3) {
+        continue;
+      }
+      for (int iyaw = 0; iyaw < options_.yaw_steps_; ++iyaw) {
+        Candidate c;
+        c.pose_ = Eigen::Affine3d::Identity();
+        c.pose_.linear() = Eigen::AngleAxisd(euler[0] + 2 * M_PI * iyaw / options_.yaw_steps_, Vec3d::UnitZ())
+                               .toRotationMatrix() * pitch_roll;
+        c.pose_.translation() = pose.translation() + Vec3d(ix * step, iy * step, 0);
+        candidates.emplace_back(c);
+      }
+    }
+  }
+
+  levels_.front()->SetSource(Downsample(source, step / 2));
+  std::for_each(std::execution::par, candidates.begin(), candidates.end(),
+                [this](Candidate& c) { c.score_ = levels_.front()->Score(c.pose_); });
+  KeepBest(candidates, options_.num_candidates_);
+  LOG(INFO) << "global localization, coarse best score: " << candidates.front().score_;
+
+  // 逐层精化
+  for (size_t level = 0; level < levels_.size(); ++level) {
+    auto& ndt = levels_[level];
+    ndt->SetSource(Downsample(source, ndt->VoxelSize() / 2));
+    for (auto& c : candidates) {
+      ndt->AlignNdt(c.pose_);
+      c.score_ = ndt->Score(c.pose_);
+    }
+    KeepBest(candidates, level + 1 == levels_.size() ? 1 : std::max<size_t>(1, candidates.size() / 2));
+  }
+
+  best_score_ = candidates.front().score_;
+  LOG(INFO) << "global localization, final score: " << best_score_;
+  if (best_score_ < options_.min_score_) {
+    return false;
+  }
+  pose = candidates.front().pose_;
+  return true;
+}
+
+}
+
+#endif
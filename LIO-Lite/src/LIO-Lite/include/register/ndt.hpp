@@ -3,6 +3,7 @@
 
 
 #include <cmath>
+#include <numeric>
 #include <vector>
 #include <execution>
 #include <unordered_map>
@@ -158,6 +159,11 @@ public:
   /// 使用gauss-newton方法进行ndt配准
   inline bool AlignNdt(Eigen::Affine3d& init_pose);
 
+  /// ndt得分: 变换后source点在所在栅格中 exp(-0.5 * e^T * info * e) 的均值, 范围[0, 1], 越大越好
+  inline double Score(const Eigen::Affine3d& pose) const;
+
+  double VoxelSize() const { return options_.voxel_size_; }
+
 private:
   inline void BuildVoxels();
 
@@ -329,7 +335,7 @@ inline bool Ndt3d::AlignNdt(Eigen::Affine3d& init_pose) {
     }
 
     Vec6d dx = H.inverse() * err;
-    pose.rotate(pose.rotation() * lio_lite::Exp<double>(dx.head<3>()));
+    pose.linear() = pose.rotation() * lio_lite::Exp<double>(dx.head<3>());
     pose.translation() += dx.tail<3>();
 
     // 更新
@@ -352,6 +358,25 @@ inline bool Ndt3d::AlignNdt(Eigen::Affine3d& init_pose) {
   return true;
 }
 
+inline double Ndt3d::Score(const Eigen::Affine3d& pose) const {
+  assert(source_ != nullptr && !source_->empty());
+  const Mat3d R = pose.rotation();
+  const Vec3d t = pose.translation();
+
+  double sum = std::transform_reduce(
+      std::execution::unseq, source_->points.begin(), source_->points.end(), 0.0, std::plus<double>(),
+      [&R, &t, this](const PointT& pt) {
+        Vec3d qs = R * ToVec3d(pt) + t;
+        auto it = grids_.find((qs * options_.inv_voxel_size_).cast<int>());
+        if (it == grids_.end()) {
+          return 0.0;
+        }
+        Vec3d e = qs - it->second.mu_;
+        double res = e.transpose() * it->second.info_ * e;
+        return std::isnan(res) ? 0.0 : std::exp(-0.5 * res);
+      });
+  return sum / source_->size();
+}
 
 // template<typename PointT>
 inline void Ndt3d::GenerateNearbyGrids() {
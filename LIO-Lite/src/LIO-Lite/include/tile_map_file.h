@@ -0,0 +1,78 @@
+#ifndef LIO_LITE_TILE_MAP_FILE_H
+#define LIO_LITE_TILE_MAP_FILE_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common_lib.h"
+#include "ivox3d/eigen_types.h"
+
+namespace lio_lite {
+
+/**
+ * Packed split map, all tiles in one file
+ *
+ * layout:
+ *   Header
+ *   TileEntry x num_tiles          sorted by tile key, used as the spatial index
+ *   tile blocks                    per tile: x[n] y[n] z[n] intensity[n] as float32, 64-byte aligned
+ *
+ * The file is mapped with mmap, a tile is read by copying its four arrays into points, no text parsing involved.
+ */
+class TileMapFile {
+   public:
+    static constexpr char kMagic[8] = {'L', 'I', 'O', 'T', 'I', 'L', 'E', '\0'};
+    static constexpr uint32_t kVersion = 1;
+
+    struct Header {
+        char magic[8];
+        uint32_t version = kVersion;
+        uint32_t num_tiles = 0;
+        float tile_resolution = 0;  // side length of a tile
+        uint32_t reserved[3] = {0, 0, 0};
+    };
+
+    struct TileEntry {
+        int32_t x = 0, y = 0;     // tile key
+        uint64_t offset = 0;      // offset of the tile block from the file begin
+        uint64_t num_points = 0;
+        float min_pt[3] = {0, 0, 0};  // bounding box of the tile points
+        float max_pt[3] = {0, 0, 0};
+    };
+
+    TileMapFile() = default;
+    ~TileMapFile();
+    TileMapFile(const TileMapFile &) = delete;
+    TileMapFile &operator=(const TileMapFile &) = delete;
+
+    /// write the tiles into one file
+    static bool Write(const std::string &path, const std::map<Vec2i, CloudPtr, less_vec<2>> &tiles,
+                      float tile_resolution);
+
+    /// map a file written by Write
+    bool Open(const std::string &path);
+
+    bool IsOpen() const { return data_ != nullptr; }
+
+    float TileResolution() const { return header_.tile_resolution; }
+
+    /// keys of all tiles in the file
+    std::vector<Vec2i> TileKeys() const;
+
+    /// copy the points of a tile into cloud, false if there is no such tile
+    bool ReadTile(const Vec2i &key, PointCloudType &cloud) const;
+
+   private:
+    const TileEntry *FindTile(const Vec2i &key) const;
+
+    const uint8_t *data_ = nullptr;
+    std::size_t size_ = 0;
+    Header header_;
+    const TileEntry *entries_ = nullptr;
+};
+
+}  // namespace lio_lite
+
+#endif  // LIO_LITE_TILE_MAP_FILE_H
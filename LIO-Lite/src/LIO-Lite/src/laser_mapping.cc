@@ -2,6 +2,7 @@
 #include <yaml-cpp/yaml.h>
 #include <execution>
 #include <fstream>
+#include <unordered_set>
 
 #include "laser_mapping.h"
 #include "utils.h"
@@ -112,9 +113,15 @@ bool LaserMapping::LoadParams(ros::NodeHandle &nh) {
     nh.param<std::string>("load_g_map", str_g_map_, "empty");
     nh.param<std::string>("load_f_map", str_f_map_, "empty");
     nh.param<double>("load_eaf_size", load_eaf_size_, 0.5);
+    nh.param<bool>("fast_relocalization", fast_relocalization_, true);
+    nh.param<double>("reloc_search_radius", reloc_search_radius_, 10.0);
+    nh.param<int>("reloc_yaw_steps", reloc_yaw_steps_, 36);
+    nh.param<double>("reloc_min_score", reloc_min_score_, 0.25);
 
     nh.param<bool>("split_map", split_map_, false);
     nh.param<float>("sub_grid_resolution", sub_grid_resolution_, 100);
+    nh.param<double>("tile_prefetch_time", tile_prefetch_time_, 3.0);
+    nh.param<int>("tile_cache_size", tile_cache_size_, 16);
 
     std::vector<double> _init_trans;
     std::vector<double> _init_rpy;
@@ -417,7 +424,11 @@ void LaserMapping::Run_location(){
     flg_EKF_inited_ = (measures_.lidar_bag_time_ - first_lidar_time_) >= options::INIT_TIME;
 
     if(!flg_location_inited_){
-        initialpose();
+        if (fast_relocalization_) {
+            initialpose2();
+        } else {
+            initialpose();
+        }
         return;
     }
     
@@ -455,7 +466,7 @@ void LaserMapping::Run_location(){
         "IEKF Solve and Update");
 
     if(split_map_){
-        DynamicLoadMap(state_point_.pos);
+        DynamicLoadMap(state_point_.pos, state_point_.vel);
     }
 
     {
@@ -478,46 +489,56 @@ void LaserMapping::Run_location(){
 }
 
 
-void LaserMapping::DynamicLoadMap(Vec3d pose){
-    static std::string split_map_path(std::string(ROOTDIR + "maps/split_map/"));
+void LaserMapping::DynamicLoadMap(Vec3d pose, Vec3d vel, bool wait){
     auto t1 = std::chrono::high_resolution_clock::now();
 
-    int gx = floor((pose[0] - sub_grid_resolution_/2)/sub_grid_resolution_);
-    int gy = floor((pose[1] - sub_grid_resolution_/2)/sub_grid_resolution_);
-    Vec2i key(gx, gy);
+    Vec2i key = TileKey(pose);
+    Vec2i predict_key = TileKey(pose + vel * tile_prefetch_time_);
 
-    std::set<Vec2i, less_vec<2>> surrounding_index{
-        key + Vec2i(0, 0), key + Vec2i(-1, 0), key + Vec2i(-1, -1), key + Vec2i(-1, 1), key + Vec2i(0, -1),
-        key + Vec2i(0, 1), key + Vec2i(1, 0),  key + Vec2i(1, -1),  key + Vec2i(1, 1),
-    };
+    // 预取前方区域
+    if (predict_key != key) {
+        for (int dx = -1; dx <= 1; ++dx) {
+            for (int dy = -1; dy <= 1; ++dy) {
+                Vec2i k = predict_key + Vec2i(dx, dy);
+                if (map_data_index_.count(k) && !hold_map_.count(k)) {
+                    tile_loader_->Request(k);
+                }
+            }
+        }
+    }
 
     // 加载必要区域
     bool map_data_changed = false;
     int cnt_new_loaded = 0, cnt_unload = 0;
-    for (auto& k : surrounding_index) {
-        if (map_data_index_.find(k) == map_data_index_.end()) {
-            continue;
-        }
-        if (hold_map_.find(k) == hold_map_.end()) {
-            PointCloudType::Ptr cloud(new PointCloudType);
-            pcl::io::loadPCDFile(split_map_path + std::to_string(k[0]) + "_" 
-                                 + std::to_string(k[1]) + ".pcd", *cloud);
-            hold_map_.emplace(k);
-            ivox_->AddPoints(cloud->points);
+    for (int dx = -1; dx <= 1; ++dx) {
+        for (int dy = -1; dy <= 1; ++dy) {
+            Vec2i k = key + Vec2i(dx, dy);
+            if (!map_data_index_.count(k) || hold_map_.count(k)) {
+                continue;
+            }
+            CloudPtr cloud = wait ? tile_loader_->TakeBlocking(k) : tile_loader_->Take(k);
+            if (cloud == nullptr) {
+                tile_loader_->Request(k);
+                continue;
+            }
+            AddMapTile(k, cloud);
             map_data_changed = true;
             cnt_new_loaded++;
         }
     }
 
-    for (auto iter = hold_map_.begin(); iter != hold_map_.end();) {
-        if ((*iter - key).cast<float>().norm() > 3.0) {
-            iter = hold_map_.erase(iter);
-            cnt_unload++;
-            map_data_changed = true;
-        } else {
-            iter++;
+    // 卸载离开3x3邻域的区域
+    std::vector<Vec2i> far_tiles;
+    for (const auto &tile : hold_map_) {
+        if ((tile.first - key).cwiseAbs().maxCoeff() > 1) {
+            far_tiles.emplace_back(tile.first);
         }
     }
+    if (!far_tiles.empty()) {
+        RemoveMapTiles(far_tiles);
+        cnt_unload = far_tiles.size();
+        map_data_changed = true;
+    }
 
     if (map_data_changed) {
         auto t2 = std::chrono::high_resolution_clock::now();
@@ -527,6 +548,76 @@ void LaserMapping::DynamicLoadMap(Vec3d pose){
     }
 }
 
+Vec2i LaserMapping::TileKey(const Vec3d &p) const {
+    return Vec2i(floor((p[0] - sub_grid_resolution_/2)/sub_grid_resolution_),
+                 floor((p[1] - sub_grid_resolution_/2)/sub_grid_resolution_));
+}
+
+void LaserMapping::AddMapTile(const Vec2i &key, CloudPtr cloud) {
+    // remember the grids of the tile, so that they can be removed from ivox when the tile is unloaded.
+    // grids reaching over the tile border may hold points of the neighbour tile too, the points of the tile in them
+    // are kept to rebuild such grids when the neighbour is unloaded
+    const Vec3d half_grid = Vec3d::Constant(ivox_options_.resolution_ / 2 + 1e-3);
+    std::unordered_map<Vec3i, bool, hash_vec<3>> grids;  // grid -> reaches over the tile border
+    auto &tile = hold_map_[key];
+    for (const auto &pt : cloud->points) {
+        Vec3i g = ivox_->Pos2Grid(pt.getVector3fMap());
+        auto iter = grids.find(g);
+        if (iter == grids.end()) {
+            Vec3d center = g.cast<double>() * ivox_options_.resolution_;
+            iter = grids.emplace(g, TileKey(center - half_grid) != key || TileKey(center + half_grid) != key).first;
+        }
+        if (iter->second) {
+            tile.border_points.emplace_back(pt);
+        }
+    }
+    tile.grids.reserve(grids.size());
+    for (const auto &g : grids) {
+        tile.grids.emplace_back(g.first);
+        grid_tile_cnt_[g.first]++;
+    }
+    ivox_->AddPoints(cloud->points);
+}
+
+void LaserMapping::RemoveMapTiles(const std::vector<Vec2i> &keys) {
+    // grids left without a tile are dropped. grids still shared with a loaded tile are dropped too and rebuilt from the
+    // border points of the loaded tiles, so that no points of the unloaded tiles stay behind
+    std::vector<Vec3i> grids_to_remove;
+    std::unordered_set<Vec3i, hash_vec<3>> grids_to_rebuild;
+    for (const auto &key : keys) {
+        auto iter = hold_map_.find(key);
+        if (iter == hold_map_.end()) {
+            continue;
+        }
+        for (const auto &g : iter->second.grids) {
+            auto cnt_iter = grid_tile_cnt_.find(g);
+            if (--cnt_iter->second == 0) {
+                grid_tile_cnt_.erase(cnt_iter);
+                grids_to_remove.emplace_back(g);
+                grids_to_rebuild.erase(g);
+            } else {
+                grids_to_rebuild.emplace(g);
+            }
+        }
+        hold_map_.erase(iter);
+    }
+    grids_to_remove.insert(grids_to_remove.end(), grids_to_rebuild.begin(), grids_to_rebuild.end());
+    ivox_->RemoveGrids(grids_to_remove);
+
+    if (grids_to_rebuild.empty()) {
+        return;
+    }
+    PointVector points_to_add;
+    for (const auto &tile : hold_map_) {
+        for (const auto &pt : tile.second.border_points) {
+            if (grids_to_rebuild.count(ivox_->Pos2Grid(pt.getVector3fMap()))) {
+                points_to_add.emplace_back(pt);
+            }
+        }
+    }
+    ivox_->AddPoints(points_to_add);
+}
+
 
 void LaserMapping::initialpose(){
     Eigen::Affine3d init_guess;
@@ -541,6 +632,10 @@ void LaserMapping::initialpose(){
         init_guess.rotate(yaml_init_rotation_);
     }
 
+    if(split_map_){
+        LoadRelocalizationMap(init_guess.translation());
+    }
+
     pcl::NormalDistributionsTransform<PointType, PointType> ndt;
     ndt.setTransformationEpsilon(1e-4);
     ndt.setEuclideanFitnessEpsilon(1e-4);
@@ -583,40 +678,47 @@ void LaserMapping::initialpose(){
         sub_init_pose_.shutdown();
         global_map_ = nullptr;
         pcl_feature_point_ = nullptr;
-        DynamicLoadMap(final_position);
+        DynamicLoadMap(final_position, Vec3d::Zero(), true);
     }
 }
 
 void LaserMapping::initialpose2(){
-    Eigen::Affine3d init_guess;
+    Eigen::Affine3d init_guess = Eigen::Affine3d::Identity();
     if(flg_get_init_guess_){
         init_lock_.lock();
         init_guess.translation() = init_translation_;
         init_guess.rotate(init_rotation_);
         init_lock_.unlock();
     }else{
-        init_guess = Eigen::Affine3d::Identity();
+        init_guess.translation() = yaml_init_translation_;
+        init_guess.rotate(yaml_init_rotation_);
     }
 
-    P2P::Ndt3d ndt;
-    ndt.SetTarget(global_map_);
-    ndt.SetSource(scan_undistort_);
-    ndt.AlignNdt(init_guess);
-
-    pcl::IterativeClosestPoint<PointType, PointType> icp;
-    icp.setMaxCorrespondenceDistance(40);
-    icp.setMaximumIterations(100);
-    icp.setTransformationEpsilon(1e-6);
-    icp.setEuclideanFitnessEpsilon(1e-6);
-    icp.setRANSACIterations(0);
-    icp.setInputSource(scan_undistort_);
-    icp.setInputTarget(global_map_);
-
-    pcl::PointCloud<PointType>::Ptr unused_result(new pcl::PointCloud<PointType>());
+    if(split_map_){
+        LoadRelocalizationMap(init_guess.translation());
+    }
+    if (global_localizer_ == nullptr) {
+        // the ndt pyramid is built on the first request over the map read for it, later requests only do the search
+        auto t0 = std::chrono::high_resolution_clock::now();
+        P2P::GlobalLocalizer::Options options;
+        options.search_radius_ = reloc_search_radius_;
+        options.yaw_steps_ = reloc_yaw_steps_;
+        options.min_score_ = reloc_min_score_;
+        global_localizer_ = std::make_shared<P2P::GlobalLocalizer>(options);
+        global_localizer_->SetTarget(global_map_);
+        LOG(INFO) << "global localization target built, time: "
+                  << std::chrono::duration_cast<std::chrono::duration<double>>(
+                         std::chrono::high_resolution_clock::now() - t0).count() * 1000
+                  << " ms";
+    }
 
-    icp.align(*unused_result, init_guess.matrix().cast<float>());
+    auto t1 = std::chrono::high_resolution_clock::now();
+    bool success = global_localizer_->Localize(scan_undistort_, init_guess);
+    auto t2 = std::chrono::high_resolution_clock::now();
+    LOG(INFO) << "global localization score: " << global_localizer_->BestScore() << "  time: "
+              << std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count() * 1000 << " ms";
 
-    if (icp.hasConverged() == false || icp.getFitnessScore() > 0.25)
+    if (!success)
     {
         ROS_ERROR("Global Initializing Fail! ");
         flg_location_inited_ = false;
@@ -625,7 +727,6 @@ void LaserMapping::initialpose2(){
         }
         return;
     } else{
-        init_guess = icp.getFinalTransformation().cast<double>();
         Eigen::Vector3d final_position = init_guess.translation();
         Eigen::Quaterniond final_rotation(init_guess.linear());
         ROS_INFO("\033[1;35m Initializing Succeed! \033[0m");
@@ -637,11 +738,20 @@ void LaserMapping::initialpose2(){
         sub_init_pose_.shutdown();
         global_map_ = nullptr;
         pcl_feature_point_ = nullptr;
+        global_localizer_ = nullptr;
+        if(split_map_){
+            DynamicLoadMap(final_position, Vec3d::Zero(), true);
+        }
     }
 }
 
 
 void LaserMapping::Load_map(){
+    if(split_map_){
+        Load_split_map();
+        return;
+    }
+
     LOG(INFO) << "\033[1;33m Load GlobalMap now, please wait...\033[0m";
     std::string all_points_dir(std::string(ROOTDIR + "maps/") + str_g_map_);
     pcl::io::loadPCDFile(all_points_dir, *global_map_);
@@ -667,18 +777,7 @@ void LaserMapping::Load_map(){
         points_to_add.push_back(temp_p);
     }
 
-    if(!split_map_){
-        ivox_->AddPoints(points_to_add);  // load whole map.
-    }else{
-        std::string index_path(std::string(ROOTDIR + "maps/split_map/map_index.txt"));
-        std::ifstream fin(index_path);
-        while (!fin.eof()) {
-            int x, y;
-            fin >> x >> y;
-            map_data_index_.emplace(Eigen::Vector2i(x, y));
-        }
-        fin.close();
-    }
+    ivox_->AddPoints(points_to_add);  // load whole map.
     
     pcl::toROSMsg(*map_ds, msg_feature_);
     msg_feature_.header.frame_id = "map";
@@ -706,6 +805,78 @@ void LaserMapping::Load_map(){
     LOG(INFO)<< "\033[1;32m Load GlobalMap done!\033[0m";
 }
 
+void LaserMapping::Load_split_map(){
+    LOG(INFO) << "\033[1;33m Load split map now, please wait...\033[0m";
+    std::string split_map_path(std::string(ROOTDIR + "maps/split_map/"));
+    auto tile_file = std::make_shared<TileMapFile>();
+    if (tile_file->Open(split_map_path + "map.tiles")) {
+        for (const auto &k : tile_file->TileKeys()) {
+            map_data_index_.emplace(k);
+        }
+        if (tile_file->TileResolution() != sub_grid_resolution_) {
+            LOG(WARNING) << "sub_grid_resolution " << sub_grid_resolution_ << " differs from the tile file, use "
+                         << tile_file->TileResolution();
+            sub_grid_resolution_ = tile_file->TileResolution();
+        }
+    } else {
+        // maps saved before the packed tile file: one pcd per tile and a text index
+        tile_file = nullptr;
+        std::ifstream fin(split_map_path + "map_index.txt");
+        while (!fin.eof()) {
+            int x, y;
+            fin >> x >> y;
+            map_data_index_.emplace(Eigen::Vector2i(x, y));
+        }
+        fin.close();
+    }
+    tile_loader_ = std::make_shared<MapTileLoader>(split_map_path, tile_cache_size_, tile_file);
+
+    // the whole map is never read, relocalization only needs the tiles around the initial guess and ivox gets the
+    // tiles around the pose once localized
+    LoadRelocalizationMap(yaml_init_translation_);
+
+    LOG(INFO)<< "\033[1;32m Load split map done, tiles: " << map_data_index_.size() << "\033[0m";
+}
+
+void LaserMapping::LoadRelocalizationMap(const Vec3d &center){
+    Vec2i key = TileKey(center);
+    if (global_map_ != nullptr && !global_map_->empty() && key == reloc_map_key_) {
+        return;
+    }
+    reloc_map_key_ = key;
+
+    // the tiles within the search radius, and one more ring for the scan around each hypothesis
+    const int radius = 1 + std::ceil(reloc_search_radius_ / sub_grid_resolution_);
+    std::vector<Vec2i> keys;
+    for (int dx = -radius; dx <= radius; ++dx) {
+        for (int dy = -radius; dy <= radius; ++dy) {
+            Vec2i k = key + Vec2i(dx, dy);
+            if (map_data_index_.count(k)) {
+                tile_loader_->Request(k);
+                keys.emplace_back(k);
+            }
+        }
+    }
+    global_map_.reset(new PointCloudType());
+    for (const auto &k : keys) {
+        *global_map_ += *tile_loader_->TakeBlocking(k);
+    }
+    LOG(INFO) << "\033[1;32m relocalization map around tile " << key.transpose() << ", tiles: " << keys.size()
+              << " point size: " << global_map_->size() << "\033[0m";
+
+    pcl::PointCloud<PointType>::Ptr map_ds(new pcl::PointCloud<PointType>());
+    pcl::VoxelGrid<PointType> VoxelGridFilter;
+    VoxelGridFilter.setLeafSize(load_eaf_size_, load_eaf_size_, load_eaf_size_);
+    VoxelGridFilter.setInputCloud(global_map_);
+    VoxelGridFilter.filter(*map_ds);
+    pcl::toROSMsg(*map_ds, msg_map_);
+    msg_map_.header.frame_id = "map";
+    msg_map_.header.stamp = ros::Time::now();
+    msg_feature_ = msg_map_;  // the tiles are the feature map
+
+    global_localizer_ = nullptr;  // built over the new tiles by the next relocalization
+}
+
 
 void LaserMapping::VisualMap(const ros::TimerEvent &e){
     if(pub_global_map_.getNumSubscribers() != 0){
@@ -1448,15 +1619,9 @@ void LaserMapping::SplitMap(CloudPtr map){
     std::string rm_rf = "rm -rf " + save_dir + "*";
     std::system(mkdir_dir.data());
     std::system(rm_rf.data());
-    std::ofstream fout(save_dir + "/map_index.txt");
-    for (auto& dp : map_data) {
-        fout << dp.first[0] << " " << dp.first[1] << std::endl;
-        dp.second->width = dp.second->size();
-        dp.second->height = 1;
-        std::string file_path = (save_dir + std::to_string(dp.first[0]) + "_" + std::to_string(dp.first[1]) + ".pcd");
-        pcl::io::savePCDFileBinary(file_path, *dp.second);
-    }
-    fout.close();
+    if (!TileMapFile::Write(save_dir + "map.tiles", map_data, sub_grid_resolution_)) {
+        LOG(ERROR) << "failed to save " << save_dir << "map.tiles";
+    }
 }
 
 
@@ -0,0 +1,108 @@
+#include <glog/logging.h>
+#include <pcl/io/pcd_io.h>
+#include <algorithm>
+
+#include "map_tile_loader.h"
+
+namespace lio_lite {
+
+MapTileLoader::MapTileLoader(const std::string &tile_dir, std::size_t cache_size,
+                             std::shared_ptr<const TileMapFile> tile_file)
+    : tile_dir_(tile_dir), cache_size_(cache_size), tile_file_(std::move(tile_file)) {
+    worker_ = std::thread([this]() { WorkerLoop(); });
+}
+
+MapTileLoader::~MapTileLoader() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        stop_ = true;
+    }
+    cv_request_.notify_all();
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+}
+
+void MapTileLoader::Request(const Vec2i &key) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (pending_.count(key) || ready_.count(key)) {
+            return;
+        }
+        pending_.emplace(key);
+        requests_.emplace_back(key);
+    }
+    cv_request_.notify_one();
+}
+
+CloudPtr MapTileLoader::Take(const Vec2i &key) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto iter = ready_.find(key);
+    if (iter == ready_.end()) {
+        return nullptr;
+    }
+    CloudPtr cloud = iter->second;
+    ready_.erase(iter);
+    ready_order_.erase(std::find(ready_order_.begin(), ready_order_.end(), key));
+    return cloud;
+}
+
+CloudPtr MapTileLoader::TakeBlocking(const Vec2i &key) {
+    std::unique_lock<std::mutex> lock(mtx_);
+    while (ready_.count(key) == 0) {
+        if (pending_.count(key) == 0) {
+            // not requested yet, or dropped from a full cache before we got it: load it first
+            pending_.emplace(key);
+            requests_.emplace_front(key);
+            cv_request_.notify_one();
+        }
+        cv_ready_.wait(lock);
+    }
+    CloudPtr cloud = ready_[key];
+    ready_.erase(key);
+    ready_order_.erase(std::find(ready_order_.begin(), ready_order_.end(), key));
+    return cloud;
+}
+
+void MapTileLoader::WorkerLoop() {
+    while (true) {
+        Vec2i key;
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            cv_request_.wait(lock, [this]() { return stop_ || !requests_.empty(); });
+            if (stop_) {
+                return;
+            }
+            key = requests_.front();
+            requests_.pop_front();
+        }
+
+        CloudPtr cloud(new PointCloudType);
+        if (tile_file_ != nullptr) {
+            if (!tile_file_->ReadTile(key, *cloud)) {
+                LOG(WARNING) << "no map tile " << key.transpose() << " in the tile file";
+                cloud->clear();
+            }
+        } else {
+            std::string file_path = tile_dir_ + std::to_string(key[0]) + "_" + std::to_string(key[1]) + ".pcd";
+            if (pcl::io::loadPCDFile(file_path, *cloud) != 0) {
+                LOG(WARNING) << "failed to load map tile " << file_path;
+                cloud->clear();
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            pending_.erase(key);
+            ready_.emplace(key, cloud);
+            ready_order_.emplace_back(key);
+            while (ready_order_.size() > cache_size_) {
+                ready_.erase(ready_order_.front());
+                ready_order_.pop_front();
+            }
+        }
+        cv_ready_.notify_all();
+    }
+}
+
+}  // namespace lio_lite
@@ -0,0 +1,174 @@
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include "tile_map_file.h"
+
+namespace lio_lite {
+
+constexpr char TileMapFile::kMagic[8];
+
+namespace {
+constexpr uint64_t kBlockAlign = 64;
+
+inline uint64_t AlignUp(uint64_t v) { return (v + kBlockAlign - 1) / kBlockAlign * kBlockAlign; }
+}  // namespace
+
+TileMapFile::~TileMapFile() {
+    if (data_ != nullptr) {
+        munmap(const_cast<uint8_t *>(data_), size_);
+    }
+}
+
+bool TileMapFile::Write(const std::string &path, const std::map<Vec2i, CloudPtr, less_vec<2>> &tiles,
+                        float tile_resolution) {
+    Header header;
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.num_tiles = tiles.size();
+    header.tile_resolution = tile_resolution;
+
+    // tiles are already sorted by key in the map, so is the index
+    std::vector<TileEntry> entries;
+    entries.reserve(tiles.size());
+    uint64_t offset = AlignUp(sizeof(Header) + sizeof(TileEntry) * tiles.size());
+    for (const auto &tile : tiles) {
+        TileEntry entry;
+        entry.x = tile.first[0];
+        entry.y = tile.first[1];
+        entry.offset = offset;
+        entry.num_points = tile.second->size();
+        if (!tile.second->empty()) {
+            Eigen::Vector3f min_pt = tile.second->points[0].getVector3fMap();
+            Eigen::Vector3f max_pt = min_pt;
+            for (const auto &pt : tile.second->points) {
+                min_pt = min_pt.cwiseMin(pt.getVector3fMap());
+                max_pt = max_pt.cwiseMax(pt.getVector3fMap());
+            }
+            std::copy(min_pt.data(), min_pt.data() + 3, entry.min_pt);
+            std::copy(max_pt.data(), max_pt.data() + 3, entry.max_pt);
+        }
+        entries.emplace_back(entry);
+        offset = AlignUp(offset + 4 * sizeof(float) * entry.num_points);
+    }
+
+    std::ofstream fout(path, std::ios::binary | std::ios::trunc);
+    if (!fout) {
+        LOG(ERROR) << "cannot open " << path << " for writing";
+        return false;
+    }
+    fout.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+    fout.write(reinterpret_cast<const char *>(entries.data()), sizeof(TileEntry) * entries.size());
+
+    std::vector<float> block;
+    int idx = 0;
+    for (const auto &tile : tiles) {
+        const auto &points = tile.second->points;
+        const std::size_t n = points.size();
+        block.resize(4 * n);
+        for (std::size_t i = 0; i < n; ++i) {
+            block[i] = points[i].x;
+            block[n + i] = points[i].y;
+            block[2 * n + i] = points[i].z;
+            block[3 * n + i] = points[i].intensity;
+        }
+        fout.seekp(entries[idx++].offset);
+        fout.write(reinterpret_cast<const char *>(block.data()), sizeof(float) * block.size());
+    }
+    // pad the last block so that every block can be read in full aligned chunks
+    if (static_cast<uint64_t>(fout.tellp()) < offset) {
+        fout.seekp(offset - 1);
+        fout.put(0);
+    }
+    return fout.good();
+}
+
+bool TileMapFile::Open(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(Header))) {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOG(ERROR) << "mmap " << path << " failed";
+        return false;
+    }
+
+    std::memcpy(&header_, data, sizeof(Header));
+    if (std::memcmp(header_.magic, kMagic, sizeof(kMagic)) != 0 || header_.version != kVersion ||
+        sizeof(Header) + sizeof(TileEntry) * header_.num_tiles > static_cast<std::size_t>(st.st_size)) {
+        LOG(ERROR) << path << " is not a valid tile map file";
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    data_ = static_cast<const uint8_t *>(data);
+    size_ = st.st_size;
+    entries_ = reinterpret_cast<const TileEntry *>(data_ + sizeof(Header));
+    return true;
+}
+
+std::vector<Vec2i> TileMapFile::TileKeys() const {
+    std::vector<Vec2i> keys;
+    keys.reserve(header_.num_tiles);
+    for (uint32_t i = 0; i < header_.num_tiles; ++i) {
+        keys.emplace_back(entries_[i].x, entries_[i].y);
+    }
+    return keys;
+}
+
+const TileMapFile::TileEntry *TileMapFile::FindTile(const Vec2i &key) const {
+    const TileEntry *end = entries_ + header_.num_tiles;
+    const TileEntry *iter = std::lower_bound(entries_, end, key, [](const TileEntry &e, const Vec2i &k) {
+        return e.x < k[0] || (e.x == k[0] && e.y < k[1]);
+    });
+    if (iter == end || iter->x != key[0] || iter->y != key[1]) {
+        return nullptr;
+    }
+    return iter;
+}
+
+bool TileMapFile::ReadTile(const Vec2i &key, PointCloudType &cloud) const {
+    const TileEntry *entry = data_ == nullptr ? nullptr : FindTile(key);
+    if (entry == nullptr) {
+        return false;
+    }
+    const std::size_t n = entry->num_points;
+    if (entry->offset + 4 * sizeof(float) * n > size_) {
+        LOG(ERROR) << "tile " << key.transpose() << " is out of the file range";
+        return false;
+    }
+
+    const float *block = reinterpret_cast<const float *>(data_ + entry->offset);
+    // ask the kernel to read ahead the whole block, madvise wants a page aligned start
+    const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    const uintptr_t block_begin = reinterpret_cast<uintptr_t>(block) & ~(page_size - 1);
+    const uintptr_t block_end = reinterpret_cast<uintptr_t>(block + 4 * n);
+    madvise(reinterpret_cast<void *>(block_begin), block_end - block_begin, MADV_WILLNEED);
+    const float *xs = block, *ys = block + n, *zs = block + 2 * n, *is = block + 3 * n;
+
+    cloud.resize(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        auto &pt = cloud.points[i];
+        pt.x = xs[i];
+        pt.y = ys[i];
+        pt.z = zs[i];
+        pt.intensity = is[i];
+    }
+    cloud.width = n;
+    cloud.height = 1;
+    cloud.is_dense = false;
+    return true;
+}
+
+}  // namespace lio_lite
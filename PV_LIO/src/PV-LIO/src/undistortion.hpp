@@ -0,0 +1,196 @@
+#ifndef UNDISTORTION_HPP
+#define UNDISTORTION_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <Eigen/Eigen>
+#include <common_lib.h>
+#ifdef MP_EN
+#include <omp.h>
+#endif
+
+/// *************Scan undistortion stage
+/// Shared by the IMU_Processing.hpp of FAST-LIO2, PV-LIO and LOG-LIO, keep the copies identical.
+
+/* Map the bits of a float to an unsigned key with the same ordering, -0 and +0 get the same key */
+inline uint32_t offset_time_key(float t)
+{
+  if (t == 0.0f) t = 0.0f;
+  uint32_t bits;
+  memcpy(&bits, &t, sizeof(bits));
+  return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+/* Copy pcl_in into pcl_out sorted by offset time (curvature).
+ * Most drivers already deliver points in time order, then it is a plain copy. Otherwise a stable LSD radix sort
+ * (3 passes of 11 bits) runs on (key, index) pairs and the points are gathered once at the end, so the sort is
+ * linear in the number of points and only moves 8 bytes per point and pass. Passes whose digit is the same for
+ * every point are skipped. */
+inline void sort_by_offset_time(const PointCloudXYZI &pcl_in, PointCloudXYZI &pcl_out)
+{
+  const size_t size = pcl_in.points.size();
+  bool monotonic = true;
+  for (size_t i = 1; i < size; i++)
+  {
+    if (pcl_in.points[i].curvature < pcl_in.points[i - 1].curvature)
+    {
+      monotonic = false;
+      break;
+    }
+  }
+  if (monotonic)
+  {
+    pcl_out = pcl_in;
+    return;
+  }
+
+  const int radix_bits = 11, radix = 1 << radix_bits, passes = 3;
+  vector<uint64_t> keys(size), keys_tmp(size);
+  vector<uint32_t> hist(passes * radix, 0);
+  for (size_t i = 0; i < size; i++)
+  {
+    const uint32_t key = offset_time_key(pcl_in.points[i].curvature);
+    keys[i] = (uint64_t(key) << 32) | i;
+    for (int p = 0; p < passes; p++)
+      hist[p * radix + ((key >> (p * radix_bits)) & (radix - 1))]++;
+  }
+
+  for (int p = 0; p < passes; p++)
+  {
+    uint32_t *count = hist.data() + p * radix;
+    const int shift = 32 + p * radix_bits;
+    if (count[(keys[0] >> shift) & (radix - 1)] == size) continue;
+
+    uint32_t sum = 0;
+    for (int d = 0; d < radix; d++)
+    {
+      const uint32_t c = count[d];
+      count[d] = sum;
+      sum += c;
+    }
+    for (size_t i = 0; i < size; i++)
+      keys_tmp[count[(keys[i] >> shift) & (radix - 1)]++] = keys[i];
+    keys.swap(keys_tmp);
+  }
+
+  pcl_out.header = pcl_in.header;
+  pcl_out.points.resize(size);
+  for (size_t i = 0; i < size; i++)
+    pcl_out.points[i] = pcl_in.points[uint32_t(keys[i])];
+  pcl_out.width = size;
+  pcl_out.height = 1;
+  pcl_out.is_dense = pcl_in.is_dense;
+}
+
+/* Transform of the points of one IMU segment into the scan-end lidar frame.
+ * For a point P at dt after the segment head
+ *   P_compensate = R_L_I^T * (R_end^T * (R_head * Exp(gyr * dt) * (R_L_I * P + T_L_I) + T_ei) - T_L_I),
+ *   T_ei = pos_head + vel_head * dt + 0.5 * acc * dt^2 - pos_end
+ * which is A(dt) * (R_L_I * P + T_L_I) + d0 + d1 * dt + d2 * dt^2 with A(dt) = S + sin(|gyr| dt) * SK + (1 - cos) * SK2.
+ * Everything except the two trigonometric terms is computed once per segment. */
+struct SegmentTransform
+{
+  double head_time;
+  double gyr_norm;
+  M3D S, SK, SK2;
+  V3D d0, d1, d2;
+};
+
+/* Undistort a scan sorted by offset time to the scan-end frame, in place.
+ * imu_poses are the IMU states from the scan begin on (IMUpose of ImuProcess), R_end/pos_end the IMU state at the
+ * scan end. A point belongs to the last segment whose head is before it, like in the original backward walk; points
+ * at or before the first pose are left as they are. With rotate_normal the normals are rotated as well. */
+inline void undistort_scan(const vector<Pose6D> &imu_poses, const M3D &R_end, const V3D &pos_end,
+                           const M3D &R_L_I, const V3D &T_L_I, PointCloudXYZI &pcl, bool rotate_normal = false)
+{
+  const int seg_num = int(imu_poses.size()) - 1;
+  if (seg_num < 1 || pcl.points.empty()) return;
+
+  /*** per segment transforms ***/
+  const M3D R_L_I_T = R_L_I.transpose();
+  const M3D R_LE = R_L_I_T * R_end.transpose();
+  vector<SegmentTransform, Eigen::aligned_allocator<SegmentTransform>> segs(seg_num);
+  for (int k = 0; k < seg_num; k++)
+  {
+    const Pose6D &head = imu_poses[k];
+    const Pose6D &tail = imu_poses[k + 1];
+    M3D R_head;
+    V3D vel_head, pos_head, acc, gyr;
+    R_head<<MAT_FROM_ARRAY(head.rot);
+    vel_head<<VEC_FROM_ARRAY(head.vel);
+    pos_head<<VEC_FROM_ARRAY(head.pos);
+    acc<<VEC_FROM_ARRAY(tail.acc);
+    gyr<<VEC_FROM_ARRAY(tail.gyr);
+
+    SegmentTransform &seg = segs[k];
+    seg.head_time = head.offset_time;
+    seg.gyr_norm = gyr.norm();
+    seg.S = R_LE * R_head;
+    if (seg.gyr_norm > 0.0000001)
+    {
+      const V3D r_axis = gyr / seg.gyr_norm;
+      M3D K;
+      K << SKEW_SYM_MATRX(r_axis);
+      seg.SK = seg.S * K;
+      seg.SK2 = seg.SK * K;
+    }
+    else
+    {
+      seg.gyr_norm = 0.0;
+      seg.SK.setZero();
+      seg.SK2.setZero();
+    }
+    seg.d0 = R_LE * (pos_head - pos_end) - R_L_I_T * T_L_I;
+    seg.d1 = R_LE * vel_head;
+    seg.d2 = 0.5 * R_LE * acc;
+  }
+
+  /*** assign the points to segments in one forward walk ***/
+  /* the largest k with head_time < t grows with t, it is found through the suffix minimum of the head times */
+  vector<double> head_min(seg_num);
+  head_min[seg_num - 1] = segs[seg_num - 1].head_time;
+  for (int k = seg_num - 2; k >= 0; k--) head_min[k] = min(segs[k].head_time, head_min[k + 1]);
+
+  const int size = pcl.points.size();
+  vector<int> seg_of_point(size);
+  int k = -1;
+  for (int i = 0; i < size; i++)
+  {
+    const double t = pcl.points[i].curvature / double(1000);
+    while (k + 1 < seg_num && head_min[k + 1] < t) k++;
+    seg_of_point[i] = k;
+  }
+
+  /*** compensate ***/
+  #ifdef MP_EN
+    omp_set_num_threads(MP_PROC_NUM);
+    #pragma omp parallel for
+  #endif
+  for (int i = 0; i < size; i++)
+  {
+    if (seg_of_point[i] < 0) continue;
+    const SegmentTransform &seg = segs[seg_of_point[i]];
+    PointType &pt = pcl.points[i];
+    const double dt = pt.curvature / double(1000) - seg.head_time;
+    const double ang = seg.gyr_norm * dt;
+    const M3D A = seg.S + std::sin(ang) * seg.SK + (1.0 - std::cos(ang)) * seg.SK2;
+
+    const V3D P_i(pt.x, pt.y, pt.z);
+    const V3D P_compensate = A * (R_L_I * P_i + T_L_I) + seg.d0 + (seg.d1 + seg.d2 * dt) * dt;
+    pt.x = P_compensate(0);
+    pt.y = P_compensate(1);
+    pt.z = P_compensate(2);
+
+    if (rotate_normal)
+    {
+      const V3D normal_i(pt.normal_x, pt.normal_y, pt.normal_z);
+      const V3D normal_compensate = A * (R_L_I * normal_i);
+      pt.normal_x = normal_compensate(0);
+      pt.normal_y = normal_compensate(1);
+      pt.normal_z = normal_compensate(2);
+    }
+  }
+}
+
+#endif
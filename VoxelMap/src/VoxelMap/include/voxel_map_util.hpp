@@ -19,6 +19,14 @@
 #define MAX_N 10000000000
 
 static int plane_id = 0;
+// set while planes are updated in parallel, ids are then given afterwards in a
+// fixed order so that they do not depend on thread scheduling
+static bool defer_plane_id = false;
+
+// once the normal of a plane is stable, stop recomputing its covariance from
+// the raw points and free them, the plane is then only updated incrementally
+static bool drop_converged_points = false;
+static double converged_normal_cos = 0.9999; // normal change below ~0.8 deg
 
 // a point to plane matching structure
 typedef struct ptpl {
@@ -53,7 +61,7 @@ typedef struct Plane {
 
   bool is_plane = false;
   bool is_init = false;
-  int id;
+  int id = -1;
   // is_update and last_update_points_size are only for publish plane
   bool is_update = false;
   int last_update_points_size = 0;
@@ -128,6 +136,16 @@ public:
     plane_ptr_ = new Plane;
   }
 
+  ~OctoTree() {
+    for (int i = 0; i < 8; i++) {
+      delete leaves_[i];
+    }
+    delete plane_ptr_;
+  }
+
+  OctoTree(const OctoTree &) = delete;
+  OctoTree &operator=(const OctoTree &) = delete;
+
   // check is plane , calc plane parameters including plane covariance
   void init_plane(const std::vector<pointWithCov> &points, Plane *plane) {
     plane->plane_cov = Eigen::Matrix<double, 6, 6>::Zero();
@@ -207,15 +225,19 @@ public:
       }
 
       if (!plane->is_init) {
-        plane->id = plane_id;
-        plane_id++;
+        if (!defer_plane_id) {
+          plane->id = plane_id;
+          plane_id++;
+        }
         plane->is_init = true;
       }
 
     } else {
       if (!plane->is_init) {
-        plane->id = plane_id;
-        plane_id++;
+        if (!defer_plane_id) {
+          plane->id = plane_id;
+          plane_id++;
+        }
         plane->is_init = true;
       }
       if (plane->last_update_points_size == 0) {
@@ -307,6 +329,16 @@ public:
     }
   }
 
+  // free the raw points if the plane normal did not change in the last
+  // covariance update, see drop_converged_points
+  void check_plane_converged(const Eigen::Vector3d &last_normal) {
+    if (drop_converged_points && update_cov_enable_ && plane_ptr_->is_plane &&
+        fabs(last_normal.dot(plane_ptr_->normal)) > converged_normal_cos) {
+      update_cov_enable_ = false;
+      std::vector<pointWithCov>().swap(temp_points_);
+    }
+  }
+
   void init_octo_tree() {
     if (temp_points_.size() > max_plane_update_threshold_) {
       init_plane(temp_points_, plane_ptr_);
@@ -318,6 +350,10 @@ public:
         if (temp_points_.size() > max_points_size_) {
           update_enable_ = false;
         }
+        if (!update_cov_enable_) {
+          // raw points are only needed to recompute the covariance
+          std::vector<pointWithCov>().swap(temp_points_);
+        }
       } else {
         octo_state_ = 1;
         cut_octo_tree();
@@ -398,7 +434,12 @@ public:
           }
           if (new_points_num_ > update_size_threshold_) {
             if (update_cov_enable_) {
+              Eigen::Vector3d last_normal = plane_ptr_->normal;
               init_plane(temp_points_, plane_ptr_);
+              check_plane_converged(last_normal);
+            } else if (drop_converged_points) {
+              update_plane(new_points_, plane_ptr_);
+              new_points_.clear();
             }
             new_points_num_ = 0;
           }
@@ -460,7 +501,9 @@ public:
             }
             if (new_points_num_ > update_size_threshold_) {
               if (update_cov_enable_) {
+                Eigen::Vector3d last_normal = plane_ptr_->normal;
                 init_plane(temp_points_, plane_ptr_);
+                check_plane_converged(last_normal);
               } else {
                 update_plane(new_points_, plane_ptr_);
                 new_points_.clear();
@@ -601,6 +644,149 @@ void updateVoxelMap(const std::vector<pointWithCov> &input_points,
   }
 }
 
+void assignDeferredPlaneId(OctoTree *octo) {
+  if (octo->plane_ptr_->is_init && octo->plane_ptr_->id < 0) {
+    octo->plane_ptr_->id = plane_id;
+    plane_id++;
+  }
+  for (int i = 0; i < 8; i++) {
+    if (octo->leaves_[i] != nullptr) {
+      assignDeferredPlaneId(octo->leaves_[i]);
+    }
+  }
+}
+
+// same planes as updateVoxelMap, but the points are first grouped by voxel
+// and the voxels are updated in parallel. each voxel still sees its points in
+// input order, so the map does not depend on the thread count. new plane ids
+// are numbered voxel by voxel, in the order of the first point of each voxel,
+// rather than in the order the planes are created
+void updateVoxelMapOMP(const std::vector<pointWithCov> &input_points,
+                       const float voxel_size, const int max_layer,
+                       const std::vector<int> &layer_point_size,
+                       const int max_points_size, const int max_cov_points_size,
+                       const float planer_threshold,
+                       std::unordered_map<VOXEL_LOC, OctoTree *> &feat_map) {
+  const int plsize = input_points.size();
+  int shard_num = 1;
+#ifdef MP_EN
+  shard_num = MP_PROC_NUM;
+#endif
+  std::vector<VOXEL_LOC> positions(plsize);
+  std::vector<int> shards(plsize);
+#ifdef MP_EN
+  omp_set_num_threads(MP_PROC_NUM);
+#pragma omp parallel for
+#endif
+  for (int i = 0; i < plsize; i++) {
+    float loc_xyz[3];
+    for (int j = 0; j < 3; j++) {
+      loc_xyz[j] = input_points[i].point[j] / voxel_size;
+      if (loc_xyz[j] < 0) {
+        loc_xyz[j] -= 1.0;
+      }
+    }
+    positions[i] = VOXEL_LOC((int64_t)loc_xyz[0], (int64_t)loc_xyz[1],
+                             (int64_t)loc_xyz[2]);
+    shards[i] = (size_t)std::hash<VOXEL_LOC>()(positions[i]) % shard_num;
+  }
+
+  // bucket the points by the hash shard of their voxel, in input order
+  std::vector<std::vector<int>> shard_points(shard_num);
+  for (int i = 0; i < plsize; i++) {
+    shard_points[shards[i]].push_back(i);
+  }
+
+  // group the points by voxel, each thread takes the points of one shard
+  std::vector<std::vector<VOXEL_LOC>> shard_voxels(shard_num);
+  std::vector<std::vector<std::vector<int>>> shard_groups(shard_num);
+#ifdef MP_EN
+#pragma omp parallel for
+#endif
+  for (int shard = 0; shard < shard_num; shard++) {
+    std::unordered_map<VOXEL_LOC, int> group_index;
+    for (int i : shard_points[shard]) {
+      auto iter = group_index.find(positions[i]);
+      if (iter == group_index.end()) {
+        group_index[positions[i]] = shard_groups[shard].size();
+        shard_voxels[shard].push_back(positions[i]);
+        shard_groups[shard].push_back({i});
+      } else {
+        shard_groups[shard][iter->second].push_back(i);
+      }
+    }
+  }
+
+  // look up or create the voxels serially
+  std::vector<OctoTree *> group_octo;
+  std::vector<const std::vector<int> *> group_points;
+  for (int shard = 0; shard < shard_num; shard++) {
+    for (size_t g = 0; g < shard_voxels[shard].size(); g++) {
+      const VOXEL_LOC &position = shard_voxels[shard][g];
+      auto iter = feat_map.find(position);
+      if (iter != feat_map.end()) {
+        group_octo.push_back(iter->second);
+      } else {
+        OctoTree *octo_tree =
+            new OctoTree(max_layer, 0, layer_point_size, max_points_size,
+                         max_cov_points_size, planer_threshold);
+        octo_tree->quater_length_ = voxel_size / 4;
+        octo_tree->voxel_center_[0] = (0.5 + position.x) * voxel_size;
+        octo_tree->voxel_center_[1] = (0.5 + position.y) * voxel_size;
+        octo_tree->voxel_center_[2] = (0.5 + position.z) * voxel_size;
+        feat_map[position] = octo_tree;
+        group_octo.push_back(octo_tree);
+      }
+      group_points.push_back(&shard_groups[shard][g]);
+    }
+  }
+
+  // voxels are disjoint, update them in parallel
+  defer_plane_id = true;
+#ifdef MP_EN
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for (int g = 0; g < (int)group_octo.size(); g++) {
+    for (int i : *group_points[g]) {
+      group_octo[g]->UpdateOctoTree(input_points[i]);
+    }
+  }
+  defer_plane_id = false;
+
+  // the groups come in shard order, number the planes in point order instead
+  std::vector<int> group_order(group_octo.size());
+  for (int g = 0; g < (int)group_order.size(); g++) {
+    group_order[g] = g;
+  }
+  std::sort(group_order.begin(), group_order.end(), [&](int a, int b) {
+    return group_points[a]->front() < group_points[b]->front();
+  });
+  for (int g : group_order) {
+    assignDeferredPlaneId(group_octo[g]);
+  }
+}
+
+// remove the voxels whose center is farther than radius from position,
+// returns the number of removed voxels
+int removeFarVoxels(std::unordered_map<VOXEL_LOC, OctoTree *> &feat_map,
+                    const Eigen::Vector3d &position, const double radius) {
+  int removed = 0;
+  const double radius_sq = radius * radius;
+  for (auto iter = feat_map.begin(); iter != feat_map.end();) {
+    Eigen::Vector3d center(iter->second->voxel_center_[0],
+                           iter->second->voxel_center_[1],
+                           iter->second->voxel_center_[2]);
+    if ((center - position).squaredNorm() > radius_sq) {
+      delete iter->second;
+      iter = feat_map.erase(iter);
+      removed++;
+    } else {
+      ++iter;
+    }
+  }
+  return removed;
+}
+
 void transformLidar(const StatesGroup &state,
                     const shared_ptr<ImuProcess> &p_imu,
                     const PointCloudXYZI::Ptr &input_cloud,
@@ -57,6 +57,8 @@ int max_cov_points_size = 50;
 int max_points_size = 50;
 double sigma_num = 2.0;
 double max_voxel_size = 1.0;
+double map_radius = 0.0; // voxels farther than this are removed, 0 keeps all
+V3D position_last_trim(Zero3d);
 std::vector<int> layer_size;
 // Eigen::Vector3d layer_size(20, 10, 10);
 // avia
@@ -542,6 +544,9 @@ int main(int argc, char **argv) {
   nh.param<double>("mapping/down_sample_size", filter_size_surf_min, 0.5);
   // std::cout << "filter_size_surf_min:" << filter_size_surf_min << std::endl;
   nh.param<double>("mapping/plannar_threshold", min_eigen_value, 0.01);
+  nh.param<double>("mapping/map_radius", map_radius, 0.0);
+  nh.param<bool>("mapping/drop_converged_points", drop_converged_points,
+                 false);
 
   // preprocess params
   nh.param<double>("preprocess/blind", p_pre->blind, 0.01);
@@ -1070,9 +1075,14 @@ int main(int argc, char **argv) {
         pv_list.push_back(pv);
       }
       std::sort(pv_list.begin(), pv_list.end(), var_contrast);
-      updateVoxelMap(pv_list, max_voxel_size, max_layer, layer_size,
-                     max_points_size, max_points_size, min_eigen_value,
-                     voxel_map);
+      updateVoxelMapOMP(pv_list, max_voxel_size, max_layer, layer_size,
+                        max_points_size, max_points_size, min_eigen_value,
+                        voxel_map);
+      if (map_radius > 0 &&
+          (state.pos_end - position_last_trim).norm() > max_voxel_size) {
+        removeFarVoxels(voxel_map, state.pos_end, map_radius);
+        position_last_trim = state.pos_end;
+      }
       auto map_incremental_end = std::chrono::high_resolution_clock::now();
       map_incremental_time =
           std::chrono::duration_cast<std::chrono::duration<double>>(
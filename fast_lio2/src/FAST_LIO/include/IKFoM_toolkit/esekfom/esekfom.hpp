@@ -38,6 +38,7 @@
 
 #include <vector>
 #include <cstdlib>
+#include <functional>
 
 #include <boost/bind.hpp>
 #include <Eigen/Core>
@@ -86,6 +87,10 @@ struct dyn_share_datastruct
 	Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> h_v;
 	Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> h_x;
 	Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> R;
+	//information form used by update_iterated_dyn_share_info instead of h_x and h: the measurement model sums
+	//h_x^T * h_x and h_x^T * h over its measurements, only the first 12 state dimensions are observed
+	Eigen::Matrix<T, 12, 12> HTH;
+	Eigen::Matrix<T, 12, 1> HTz;
 };
 
 //used for iterated error state EKF update
@@ -126,7 +131,8 @@ public:
 	typedef measurement measurementModel_share(state &, share_datastruct<state, measurement, measurement_noise_dof> &);
 	typedef Eigen::Matrix<scalar_type, Eigen::Dynamic, 1> measurementModel_dyn(state &, bool &);
 	//typedef Eigen::Matrix<scalar_type, Eigen::Dynamic, 1> measurementModel_dyn_share(state &,  dyn_share_datastruct<scalar_type> &);
-	typedef void measurementModel_dyn_share(state &,  dyn_share_datastruct<scalar_type> &);
+	/* a std::function so that the measurement model can be bound to a mapper instance */
+	typedef std::function<void(state &,  dyn_share_datastruct<scalar_type> &)> measurementModel_dyn_share;
 	typedef Eigen::Matrix<scalar_type ,l, n> measurementMatrix1(state &, bool&);
 	typedef Eigen::Matrix<scalar_type , Eigen::Dynamic, n> measurementMatrix1_dyn(state &, bool&);
 	typedef Eigen::Matrix<scalar_type ,l, measurement_noise_dof> measurementMatrix2(state &, bool&);
@@ -1931,6 +1937,164 @@ public:
 		}
 	}
 
+	//iterated error state EKF update modified for one specific system, in information form.
+	//the measurement model fills dyn_share.HTH and dyn_share.HTz instead of the dense h_x and h, so the update costs
+	//the same for any number of measurements and the filter never touches per-measurement data.
+	void update_iterated_dyn_share_info(double R, double &solve_time) {
+		
+		dyn_share_datastruct<scalar_type> dyn_share;
+		dyn_share.valid = true;
+		dyn_share.converge = true;
+		int t = 0;
+		state x_propagated = x_;
+		cov P_propagated = P_;
+		
+		Matrix<scalar_type, n, 1> K_h;
+		Matrix<scalar_type, n, n> K_x; 
+		
+		vectorized_state dx_new = vectorized_state::Zero();
+		for(int i=-1; i<maximum_iter; i++)
+		{
+			dyn_share.valid = true;	
+			dyn_share.HTH.setZero();
+			dyn_share.HTz.setZero();
+			h_dyn_share(x_, dyn_share);
+
+			if(! dyn_share.valid)
+			{
+				continue; 
+			}
+
+			double solve_start = omp_get_wtime();
+			vectorized_state dx;
+			x_.boxminus(dx, x_propagated);
+			dx_new = dx;
+			
+			P_ = P_propagated;
+			
+			Matrix<scalar_type, 3, 3> res_temp_SO3;
+			MTK::vect<3, scalar_type> seg_SO3;
+			for (std::vector<std::pair<int, int> >::iterator it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
+				int idx = (*it).first;
+				for(int i = 0; i < 3; i++){
+					seg_SO3(i) = dx(idx+i);
+				}
+
+				res_temp_SO3 = MTK::A_matrix(seg_SO3).transpose();
+				dx_new.template block<3, 1>(idx, 0) = res_temp_SO3 * dx_new.template block<3, 1>(idx, 0);
+				for(int i = 0; i < n; i++){
+					P_. template block<3, 1>(idx, i) = res_temp_SO3 * (P_. template block<3, 1>(idx, i));	
+				}
+				for(int i = 0; i < n; i++){
+					P_. template block<1, 3>(i, idx) =(P_. template block<1, 3>(i, idx)) *  res_temp_SO3.transpose();	
+				}
+			}
+
+			Matrix<scalar_type, 2, 2> res_temp_S2;
+			MTK::vect<2, scalar_type> seg_S2;
+			for (std::vector<std::pair<int, int> >::iterator it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
+				int idx = (*it).first;
+				for(int i = 0; i < 2; i++){
+					seg_S2(i) = dx(idx + i);
+				}
+
+				Eigen::Matrix<scalar_type, 2, 3> Nx;
+				Eigen::Matrix<scalar_type, 3, 2> Mx;
+				x_.S2_Nx_yy(Nx, idx);
+				x_propagated.S2_Mx(Mx, seg_S2, idx);
+				res_temp_S2 = Nx * Mx; 
+				dx_new.template block<2, 1>(idx, 0) = res_temp_S2 * dx_new.template block<2, 1>(idx, 0);
+				for(int i = 0; i < n; i++){
+					P_. template block<2, 1>(idx, i) = res_temp_S2 * (P_. template block<2, 1>(idx, i));	
+				}
+				for(int i = 0; i < n; i++){
+					P_. template block<1, 2>(i, idx) = (P_. template block<1, 2>(i, idx)) * res_temp_S2.transpose();
+				}
+			}
+
+			//K = (H^T H + (P/R)^-1)^-1 H^T, which equals the covariance form for any number of measurements
+			cov P_temp = (P_/R).inverse();
+			P_temp. template block<12, 12>(0, 0) += dyn_share.HTH;
+			cov P_inv = P_temp.inverse();
+			K_h = P_inv. template block<n, 12>(0, 0) * dyn_share.HTz;
+			K_x.setZero();
+			K_x. template block<n, 12>(0, 0) = P_inv. template block<n, 12>(0, 0) * dyn_share.HTH;
+
+			Matrix<scalar_type, n, 1> dx_ = K_h + (K_x - Matrix<scalar_type, n, n>::Identity()) * dx_new; 
+			x_.boxplus(dx_);
+			dyn_share.converge = true;
+			for(int i = 0; i < n ; i++)
+			{
+				if(std::fabs(dx_[i]) > limit[i])
+				{
+					dyn_share.converge = false;
+					break;
+				}
+			}
+			if(dyn_share.converge) t++;
+			
+			if(!t && i == maximum_iter - 2)
+			{
+				dyn_share.converge = true;
+			}
+
+			if(t > 1 || i == maximum_iter - 1)
+			{
+				L_ = P_;
+				Matrix<scalar_type, 3, 3> res_temp_SO3;
+				MTK::vect<3, scalar_type> seg_SO3;
+				for(typename std::vector<std::pair<int, int> >::iterator it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
+					int idx = (*it).first;
+					for(int i = 0; i < 3; i++){
+						seg_SO3(i) = dx_(i + idx);
+					}
+					res_temp_SO3 = MTK::A_matrix(seg_SO3).transpose();
+					for(int i = 0; i < n; i++){
+						L_. template block<3, 1>(idx, i) = res_temp_SO3 * (P_. template block<3, 1>(idx, i)); 
+					}
+					for(int i = 0; i < 12; i++){
+						K_x. template block<3, 1>(idx, i) = res_temp_SO3 * (K_x. template block<3, 1>(idx, i));
+					}
+					for(int i = 0; i < n; i++){
+						L_. template block<1, 3>(i, idx) = (L_. template block<1, 3>(i, idx)) * res_temp_SO3.transpose();
+						P_. template block<1, 3>(i, idx) = (P_. template block<1, 3>(i, idx)) * res_temp_SO3.transpose();
+					}
+				}
+
+				Matrix<scalar_type, 2, 2> res_temp_S2;
+				MTK::vect<2, scalar_type> seg_S2;
+				for(typename std::vector<std::pair<int, int> >::iterator it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
+					int idx = (*it).first;
+
+					for(int i = 0; i < 2; i++){
+						seg_S2(i) = dx_(i + idx);
+					}
+
+					Eigen::Matrix<scalar_type, 2, 3> Nx;
+					Eigen::Matrix<scalar_type, 3, 2> Mx;
+					x_.S2_Nx_yy(Nx, idx);
+					x_propagated.S2_Mx(Mx, seg_S2, idx);
+					res_temp_S2 = Nx * Mx; 
+					for(int i = 0; i < n; i++){
+						L_. template block<2, 1>(idx, i) = res_temp_S2 * (P_. template block<2, 1>(idx, i)); 
+					}
+					for(int i = 0; i < 12; i++){
+						K_x. template block<2, 1>(idx, i) = res_temp_S2 * (K_x. template block<2, 1>(idx, i));
+					}
+					for(int i = 0; i < n; i++){
+						L_. template block<1, 2>(i, idx) = (L_. template block<1, 2>(i, idx)) * res_temp_S2.transpose();
+						P_. template block<1, 2>(i, idx) = (P_. template block<1, 2>(i, idx)) * res_temp_S2.transpose();
+					}
+				}
+
+				P_ = L_ - K_x.template block<n, 12>(0, 0) * P_.template block<12, n>(0, 0);
+				solve_time += omp_get_wtime() - solve_start;
+				return;
+			}
+			solve_time += omp_get_wtime() - solve_start;
+		}
+	}
+
 	void change_x(state &input_state)
 	{
 		x_ = input_state;
@@ -1977,7 +2141,7 @@ private:
 	measurementMatrix2_dyn *h_v_dyn;
 
 	measurementModel_share *h_share;
-	measurementModel_dyn_share *h_dyn_share;
+	measurementModel_dyn_share h_dyn_share;
 
 	int maximum_iter = 0;
 	scalar_type limit[n];
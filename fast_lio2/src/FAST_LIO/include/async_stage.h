@@ -0,0 +1,92 @@
+#ifndef ASYNC_STAGE_H
+#define ASYNC_STAGE_H
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include "trace.h"
+
+/*
+ * One stage of the mapping pipeline: a worker thread running the pushed jobs in push order.
+ * push() blocks while `capacity` jobs are waiting, so a slow stage throttles the main loop instead of
+ * growing its queue. A disabled stage runs every job inside push(), which is the plain sequential loop.
+ * `name` is the name of the worker thread in the trace.
+ */
+class AsyncStage
+{
+public:
+    AsyncStage(bool enabled, size_t capacity = 1, const char *name = "stage")
+        : enabled_(enabled), capacity_(capacity > 0 ? capacity : 1), name_(name)
+    {
+        if (enabled_) worker_ = std::thread(&AsyncStage::run, this);
+    }
+
+    ~AsyncStage()
+    {
+        if (!enabled_) return;
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            stop_ = true;
+        }
+        cv_job_.notify_all();
+        worker_.join();
+    }
+
+    AsyncStage(const AsyncStage &) = delete;
+    AsyncStage &operator=(const AsyncStage &) = delete;
+
+    void push(std::function<void()> job)
+    {
+        if (!enabled_)
+        {
+            job();
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mtx_);
+        cv_done_.wait(lock, [this] { return jobs_.size() < capacity_; });
+        jobs_.push_back(std::move(job));
+        cv_job_.notify_one();
+    }
+
+    /* block until every pushed job has finished */
+    void wait()
+    {
+        if (!enabled_) return;
+        std::unique_lock<std::mutex> lock(mtx_);
+        cv_done_.wait(lock, [this] { return jobs_.empty() && !busy_; });
+    }
+
+private:
+    void run()
+    {
+        trace::set_thread_name(name_);
+        std::unique_lock<std::mutex> lock(mtx_);
+        while (true)
+        {
+            cv_job_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+            if (jobs_.empty()) return;  // stopped and drained
+
+            std::function<void()> job = std::move(jobs_.front());
+            jobs_.pop_front();
+            busy_ = true;
+            lock.unlock();
+            job();
+            lock.lock();
+            busy_ = false;
+            cv_done_.notify_all();
+        }
+    }
+
+    bool enabled_;
+    size_t capacity_;
+    const char *name_;
+    bool stop_ = false, busy_ = false;
+    std::deque<std::function<void()>> jobs_;
+    std::mutex mtx_;
+    std::condition_variable cv_job_, cv_done_;
+    std::thread worker_;
+};
+
+#endif
@@ -1,4 +1,7 @@
 #include "ikd_Tree.h"
+#ifdef MP_EN
+#include <omp.h>
+#endif
 
 /*
 Description: ikd-Tree: an incremental k-d tree for robotic applications 
@@ -6,6 +9,21 @@ Author: Yixi Cai
 email: yixicai@connect.hku.hk
 */
 
+// Node fields the rebuild thread rewrites while snapshot readers may read them
+template <typename T>
+static inline T load_relaxed(const T &value)
+{
+    T ret;
+    __atomic_load(&value, &ret, __ATOMIC_RELAXED);
+    return ret;
+}
+
+template <typename T>
+static inline void store_relaxed(T &value, T new_value)
+{
+    __atomic_store(&value, &new_value, __ATOMIC_RELAXED);
+}
+
 template <typename PointType>
 KD_TREE<PointType>::KD_TREE(float delete_param, float balance_param, float box_length)
 {
@@ -63,7 +81,6 @@ void KD_TREE<PointType>::InitTreeNode(KD_TREE_NODE *root)
     root->need_push_down_to_right = false;
     root->point_downsample_deleted = false;
     root->working_flag = false;
-    pthread_mutex_init(&(root->push_down_mutex_lock), NULL);
 }
 
 template <typename PointType>
@@ -136,6 +153,12 @@ BoxPointType KD_TREE<PointType>::tree_range()
     return range;
 }
 
+template <typename PointType>
+typename KD_TREE<PointType>::Node_Pool_Stats KD_TREE<PointType>::node_pool_stats()
+{
+    return Node_Pool.stats();
+}
+
 template <typename PointType>
 int KD_TREE<PointType>::validnum()
 {
@@ -256,25 +279,35 @@ void KD_TREE<PointType>::multi_thread_rebuild()
             KD_TREE_NODE *old_root_node = (*Rebuild_Ptr);
             father_ptr = (*Rebuild_Ptr)->father_ptr;
             PointVector().swap(Rebuild_PCL_Storage);
-            // Lock Search
-            pthread_mutex_lock(&search_flag_mutex);
-            while (search_mutex_counter != 0)
+            if (snapshot_search_en)
+            {
+                // Readers may still be inside this subtree, copy it out without pushing labels down
+                pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
+                flatten_snapshot(*Rebuild_Ptr, Lazy_Label(), Rebuild_PCL_Storage);
+                pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
+            }
+            else
             {
+                // Lock Search
+                pthread_mutex_lock(&search_flag_mutex);
+                while (search_mutex_counter != 0)
+                {
+                    pthread_mutex_unlock(&search_flag_mutex);
+                    usleep(1);
+                    pthread_mutex_lock(&search_flag_mutex);
+                }
+                search_mutex_counter = -1;
                 pthread_mutex_unlock(&search_flag_mutex);
-                usleep(1);
+                // Lock deleted points cache
+                pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
+                flatten(*Rebuild_Ptr, Rebuild_PCL_Storage, MULTI_THREAD_REC);
+                // Unlock deleted points cache
+                pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
+                // Unlock Search
                 pthread_mutex_lock(&search_flag_mutex);
+                search_mutex_counter = 0;
+                pthread_mutex_unlock(&search_flag_mutex);
             }
-            search_mutex_counter = -1;
-            pthread_mutex_unlock(&search_flag_mutex);
-            // Lock deleted points cache
-            pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
-            flatten(*Rebuild_Ptr, Rebuild_PCL_Storage, MULTI_THREAD_REC);
-            // Unlock deleted points cache
-            pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
-            // Unlock Search
-            pthread_mutex_lock(&search_flag_mutex);
-            search_mutex_counter = 0;
-            pthread_mutex_unlock(&search_flag_mutex);
             pthread_mutex_unlock(&working_flag_mutex);
             /* Rebuild and update missed operations*/
             Operation_Logger_Type Operation;
@@ -304,34 +337,38 @@ void KD_TREE<PointType>::multi_thread_rebuild()
             }
             /* Replace to original tree*/
             // pthread_mutex_lock(&working_flag_mutex);
-            pthread_mutex_lock(&search_flag_mutex);
-            while (search_mutex_counter != 0)
+            if (!snapshot_search_en)
             {
-                pthread_mutex_unlock(&search_flag_mutex);
-                usleep(1);
                 pthread_mutex_lock(&search_flag_mutex);
+                while (search_mutex_counter != 0)
+                {
+                    pthread_mutex_unlock(&search_flag_mutex);
+                    usleep(1);
+                    pthread_mutex_lock(&search_flag_mutex);
+                }
+                search_mutex_counter = -1;
+                pthread_mutex_unlock(&search_flag_mutex);
             }
-            search_mutex_counter = -1;
-            pthread_mutex_unlock(&search_flag_mutex);
+            // The new subtree is complete before it is published, snapshot readers see either the old or the new one
+            if (new_root_node != nullptr)
+                new_root_node->father_ptr = father_ptr;
             if (father_ptr->left_son_ptr == *Rebuild_Ptr)
             {
-                father_ptr->left_son_ptr = new_root_node;
+                __atomic_store_n(&father_ptr->left_son_ptr, new_root_node, __ATOMIC_RELEASE);
             }
             else if (father_ptr->right_son_ptr == *Rebuild_Ptr)
             {
-                father_ptr->right_son_ptr = new_root_node;
+                __atomic_store_n(&father_ptr->right_son_ptr, new_root_node, __ATOMIC_RELEASE);
             }
             else
             {
                 throw "Error: Father ptr incompatible with current node\n";
             }
-            if (new_root_node != nullptr)
-                new_root_node->father_ptr = father_ptr;
-            (*Rebuild_Ptr) = new_root_node;
+            __atomic_store_n(Rebuild_Ptr, new_root_node, __ATOMIC_RELEASE);
             int valid_old = old_root_node->TreeSize - old_root_node->invalid_point_num;
             int valid_new = new_root_node->TreeSize - new_root_node->invalid_point_num;
             if (father_ptr == STATIC_ROOT_NODE)
-                Root_Node = STATIC_ROOT_NODE->left_son_ptr;
+                __atomic_store_n(&Root_Node, STATIC_ROOT_NODE->left_son_ptr, __ATOMIC_RELEASE);
             KD_TREE_NODE *update_root = *Rebuild_Ptr;
             while (update_root != nullptr && update_root != Root_Node)
             {
@@ -342,15 +379,23 @@ void KD_TREE<PointType>::multi_thread_rebuild()
                     break;
                 if (update_root == update_root->father_ptr->right_son_ptr && update_root->father_ptr->need_push_down_to_right)
                     break;
-                Update(update_root);
+                if (snapshot_search_en)
+                    Update_Published(update_root);
+                else
+                    Update(update_root);
+            }
+            if (!snapshot_search_en)
+            {
+                pthread_mutex_lock(&search_flag_mutex);
+                search_mutex_counter = 0;
+                pthread_mutex_unlock(&search_flag_mutex);
             }
-            pthread_mutex_lock(&search_flag_mutex);
-            search_mutex_counter = 0;
-            pthread_mutex_unlock(&search_flag_mutex);
             Rebuild_Ptr = nullptr;
             pthread_mutex_unlock(&working_flag_mutex);
             rebuild_flag = false;
             /* Delete discarded tree nodes */
+            if (snapshot_search_en)
+                wait_for_readers();
             delete_tree_nodes(&old_root_node);
         }
         else
@@ -414,7 +459,9 @@ void KD_TREE<PointType>::Build(PointVector point_cloud)
     }
     if (point_cloud.size() == 0)
         return;
-    STATIC_ROOT_NODE = new KD_TREE_NODE;
+    if (STATIC_ROOT_NODE != nullptr)
+        Node_Pool.free(STATIC_ROOT_NODE);
+    STATIC_ROOT_NODE = Node_Pool.alloc();
     InitTreeNode(STATIC_ROOT_NODE);
     BuildTree(&STATIC_ROOT_NODE->left_son_ptr, 0, point_cloud.size() - 1, point_cloud);
     Update(STATIC_ROOT_NODE);
@@ -428,7 +475,13 @@ void KD_TREE<PointType>::Nearest_Search(PointType point, int k_nearest, PointVec
     MANUAL_HEAP q(2 * k_nearest);
     q.clear();
     vector<float>().swap(Point_Distance);
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    if (snapshot_search_en)
+    {
+        int epoch_idx = reader_enter();
+        Search_Snapshot(__atomic_load_n(&Root_Node, __ATOMIC_ACQUIRE), Lazy_Label(), k_nearest, point, q, max_dist);
+        reader_exit(epoch_idx);
+    }
+    else if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
     {
         Search(Root_Node, k_nearest, point, q, max_dist);
     }
@@ -460,6 +513,92 @@ void KD_TREE<PointType>::Nearest_Search(PointType point, int k_nearest, PointVec
     return;
 }
 
+template <typename PointType>
+void KD_TREE<PointType>::Nearest_Search_Batch(const PointVector &points, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, vector<int> &Found_Num, float max_dist)
+{
+    int query_num = points.size();
+    Nearest_Points.resize(query_num * k_nearest);
+    Point_Distance.assign(query_num * k_nearest, INFINITY);
+    Found_Num.assign(query_num, 0);
+    if (query_num == 0 || k_nearest <= 0)
+        return;
+    // Sort the queries along a Morton curve so that each group covers a compact region of the tree
+    float min_value[3] = {INFINITY, INFINITY, INFINITY};
+    float max_value[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int i = 0; i < query_num; i++)
+    {
+        min_value[0] = min(min_value[0], points[i].x);
+        min_value[1] = min(min_value[1], points[i].y);
+        min_value[2] = min(min_value[2], points[i].z);
+        max_value[0] = max(max_value[0], points[i].x);
+        max_value[1] = max(max_value[1], points[i].y);
+        max_value[2] = max(max_value[2], points[i].z);
+    }
+    float scale[3];
+    for (int i = 0; i < 3; i++)
+        scale[i] = (max_value[i] - min_value[i] > EPSS) ? 1023.0f / (max_value[i] - min_value[i]) : 0.0f;
+    vector<pair<uint32_t, int>> order(query_num);
+    for (int i = 0; i < query_num; i++)
+    {
+        uint32_t qx = uint32_t((points[i].x - min_value[0]) * scale[0]);
+        uint32_t qy = uint32_t((points[i].y - min_value[1]) * scale[1]);
+        uint32_t qz = uint32_t((points[i].z - min_value[2]) * scale[2]);
+        order[i] = make_pair(morton_code(qx, qy, qz), i);
+    }
+    sort(order.begin(), order.end());
+    float max_dist_sqr = max_dist * max_dist;
+    int group_num = (query_num + Batch_Search_Group_Size - 1) / Batch_Search_Group_Size;
+#ifdef MP_EN
+    omp_set_num_threads(MP_PROC_NUM);
+    #pragma omp parallel
+#endif
+    {
+        // One set of heaps per thread, reused by every group it processes
+        deque<MANUAL_HEAP> q;
+        for (int j = 0; j < Batch_Search_Group_Size; j++)
+            q.emplace_back(2 * k_nearest);
+        PointType group_points[Batch_Search_Group_Size];
+        int active[Batch_Search_Group_Size];
+#ifdef MP_EN
+        #pragma omp for schedule(dynamic)
+#endif
+        for (int g = 0; g < group_num; g++)
+        {
+            int group_start = g * Batch_Search_Group_Size;
+            int group_size = min(Batch_Search_Group_Size, query_num - group_start);
+            for (int j = 0; j < group_size; j++)
+            {
+                group_points[j] = points[order[group_start + j].second];
+                active[j] = j;
+                q[j].clear();
+            }
+            if (snapshot_search_en)
+            {
+                int epoch_idx = reader_enter();
+                Search_Batch(__atomic_load_n(&Root_Node, __ATOMIC_ACQUIRE), Lazy_Label(), k_nearest, group_points, active, group_size, q, max_dist_sqr);
+                reader_exit(epoch_idx);
+            }
+            else
+            {
+                Search_Batch_Child(Root_Node, Lazy_Label(), k_nearest, group_points, active, group_size, q, max_dist_sqr);
+            }
+            for (int j = 0; j < group_size; j++)
+            {
+                int query_id = order[group_start + j].second;
+                int k_found = min(k_nearest, int(q[j].size()));
+                Found_Num[query_id] = k_found;
+                for (int i = k_found - 1; i >= 0; i--)
+                {
+                    Nearest_Points[query_id * k_nearest + i] = q[j].top().point;
+                    Point_Distance[query_id * k_nearest + i] = q[j].top().dist;
+                    q[j].pop();
+                }
+            }
+        }
+    }
+    return;
+}
+
 template <typename PointType>
 void KD_TREE<PointType>::Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage)
 {
@@ -680,7 +819,7 @@ void KD_TREE<PointType>::BuildTree(KD_TREE_NODE **root, int l, int r, PointVecto
 {
     if (l > r)
         return;
-    *root = new KD_TREE_NODE;
+    *root = Node_Pool.alloc();
     InitTreeNode(*root);
     int mid = (l + r) >> 1;
     int div_axis = 0;
@@ -996,7 +1135,7 @@ void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE **root, PointType point, bool
 {
     if (*root == nullptr)
     {
-        *root = new KD_TREE_NODE;
+        *root = Node_Pool.alloc();
         InitTreeNode(*root);
         (*root)->point = point;
         (*root)->division_axis = (father_axis + 1) % 3;
@@ -1243,6 +1382,161 @@ void KD_TREE<PointType>::Search(KD_TREE_NODE *root, int k_nearest, PointType poi
     return;
 }
 
+template <typename PointType>
+void KD_TREE<PointType>::Search_Batch(KD_TREE_NODE *root, Lazy_Label label, int k_nearest, const PointType *points, const int *active, int active_num, deque<MANUAL_HEAP> &q, float max_dist_sqr)
+{
+    if (root == nullptr)
+        return;
+    int retval;
+    if (!snapshot_search_en && (root->need_push_down_to_left || root->need_push_down_to_right))
+    {
+        retval = pthread_mutex_trylock(&(root->push_down_mutex_lock));
+        if (retval == 0)
+        {
+            Push_Down(root);
+            pthread_mutex_unlock(&(root->push_down_mutex_lock));
+        }
+        else
+        {
+            pthread_mutex_lock(&(root->push_down_mutex_lock));
+            pthread_mutex_unlock(&(root->push_down_mutex_lock));
+        }
+    }
+    Lazy_Label left_label, right_label;
+    bool point_deleted;
+    if (Resolve_Lazy_Label(root, label, left_label, right_label, point_deleted))
+        return;
+    KD_TREE_NODE *left_son = __atomic_load_n(&root->left_son_ptr, __ATOMIC_ACQUIRE);
+    KD_TREE_NODE *right_son = __atomic_load_n(&root->right_son_ptr, __ATOMIC_ACQUIRE);
+    float dist_left_node[Batch_Search_Group_Size], dist_right_node[Batch_Search_Group_Size];
+    bool left_first[Batch_Search_Group_Size];
+    for (int j = 0; j < active_num; j++)
+    {
+        int id = active[j];
+        if (!point_deleted)
+        {
+            float dist = calc_dist(points[id], root->point);
+            if (dist <= max_dist_sqr && (q[id].size() < k_nearest || dist < q[id].top().dist))
+            {
+                if (q[id].size() >= k_nearest)
+                    q[id].pop();
+                PointType_CMP current_point{root->point, dist};
+                q[id].push(current_point);
+            }
+        }
+        dist_left_node[j] = calc_box_dist(left_son, points[id]);
+        dist_right_node[j] = calc_box_dist(right_son, points[id]);
+        left_first[j] = dist_left_node[j] <= dist_right_node[j];
+    }
+    /* Every query keeps the visiting order of Search: queries closer to the left son go left then right,
+       the others right then left. Queries sharing a step descend together. */
+    int next[Batch_Search_Group_Size];
+    for (int step = 0; step < 3; step++)
+    {
+        KD_TREE_NODE *child = (step == 1) ? right_son : left_son;
+        const Lazy_Label &child_label = (step == 1) ? right_label : left_label;
+        const float *child_dist = (step == 1) ? dist_right_node : dist_left_node;
+        if (child == nullptr)
+            continue;
+        int next_num = 0;
+        for (int j = 0; j < active_num; j++)
+        {
+            if ((step == 0 && !left_first[j]) || (step == 2 && left_first[j]))
+                continue;
+            int id = active[j];
+            if (child_dist[j] > max_dist_sqr)
+                continue;
+            if (q[id].size() >= k_nearest && child_dist[j] >= q[id].top().dist)
+                continue;
+            next[next_num++] = id;
+        }
+        if (next_num > 0)
+            Search_Batch_Child(child, child_label, k_nearest, points, next, next_num, q, max_dist_sqr);
+    }
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Search_Batch_Child(KD_TREE_NODE *child, Lazy_Label label, int k_nearest, const PointType *points, const int *active, int active_num, deque<MANUAL_HEAP> &q, float max_dist_sqr)
+{
+    if (child == nullptr)
+        return;
+    if (snapshot_search_en || Rebuild_Ptr == nullptr || *Rebuild_Ptr != child)
+    {
+        Search_Batch(child, label, k_nearest, points, active, active_num, q, max_dist_sqr);
+    }
+    else
+    {
+        pthread_mutex_lock(&search_flag_mutex);
+        while (search_mutex_counter == -1)
+        {
+            pthread_mutex_unlock(&search_flag_mutex);
+            usleep(1);
+            pthread_mutex_lock(&search_flag_mutex);
+        }
+        search_mutex_counter += 1;
+        pthread_mutex_unlock(&search_flag_mutex);
+        Search_Batch(child, label, k_nearest, points, active, active_num, q, max_dist_sqr);
+        pthread_mutex_lock(&search_flag_mutex);
+        search_mutex_counter -= 1;
+        pthread_mutex_unlock(&search_flag_mutex);
+    }
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Search_Snapshot(KD_TREE_NODE *root, Lazy_Label label, int k_nearest, PointType point, MANUAL_HEAP &q, float max_dist)
+{
+    if (root == nullptr)
+        return;
+    Lazy_Label left_label, right_label;
+    bool point_deleted;
+    if (Resolve_Lazy_Label(root, label, left_label, right_label, point_deleted))
+        return;
+    float cur_dist = calc_box_dist(root, point);
+    float max_dist_sqr = max_dist * max_dist;
+    if (cur_dist > max_dist_sqr)
+        return;
+    if (!point_deleted)
+    {
+        float dist = calc_dist(point, root->point);
+        if (dist <= max_dist_sqr && (q.size() < k_nearest || dist < q.top().dist))
+        {
+            if (q.size() >= k_nearest)
+                q.pop();
+            PointType_CMP current_point{root->point, dist};
+            q.push(current_point);
+        }
+    }
+    KD_TREE_NODE *left_son = __atomic_load_n(&root->left_son_ptr, __ATOMIC_ACQUIRE);
+    KD_TREE_NODE *right_son = __atomic_load_n(&root->right_son_ptr, __ATOMIC_ACQUIRE);
+    float dist_left_node = calc_box_dist(left_son, point);
+    float dist_right_node = calc_box_dist(right_son, point);
+    if (q.size() < k_nearest || dist_left_node < q.top().dist && dist_right_node < q.top().dist)
+    {
+        if (dist_left_node <= dist_right_node)
+        {
+            Search_Snapshot(left_son, left_label, k_nearest, point, q, max_dist);
+            if (q.size() < k_nearest || dist_right_node < q.top().dist)
+                Search_Snapshot(right_son, right_label, k_nearest, point, q, max_dist);
+        }
+        else
+        {
+            Search_Snapshot(right_son, right_label, k_nearest, point, q, max_dist);
+            if (q.size() < k_nearest || dist_left_node < q.top().dist)
+                Search_Snapshot(left_son, left_label, k_nearest, point, q, max_dist);
+        }
+    }
+    else
+    {
+        if (dist_left_node < q.top().dist)
+            Search_Snapshot(left_son, left_label, k_nearest, point, q, max_dist);
+        if (dist_right_node < q.top().dist)
+            Search_Snapshot(right_son, right_label, k_nearest, point, q, max_dist);
+    }
+    return;
+}
+
 template <typename PointType>
 void KD_TREE<PointType>::Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector &Storage)
 {
@@ -1454,6 +1748,32 @@ void KD_TREE<PointType>::Push_Down(KD_TREE_NODE *root)
     return;
 }
 
+template <typename PointType>
+bool KD_TREE<PointType>::Resolve_Lazy_Label(KD_TREE_NODE *root, const Lazy_Label &label, Lazy_Label &left_label, Lazy_Label &right_label, bool &point_deleted)
+{
+    // Same result as Push_Down from the ancestors, but without writing to the node
+    bool tree_deleted, tree_downsample_deleted;
+    if (label.pending)
+    {
+        tree_downsample_deleted = load_relaxed(root->tree_downsample_deleted) || label.tree_downsample_deleted;
+        tree_deleted = label.tree_deleted || tree_downsample_deleted;
+        point_deleted = tree_deleted || root->point_downsample_deleted || label.tree_downsample_deleted;
+    }
+    else
+    {
+        tree_downsample_deleted = load_relaxed(root->tree_downsample_deleted);
+        tree_deleted = load_relaxed(root->tree_deleted);
+        point_deleted = root->point_deleted;
+    }
+    left_label.pending = label.pending || root->need_push_down_to_left;
+    left_label.tree_deleted = tree_deleted;
+    left_label.tree_downsample_deleted = tree_downsample_deleted;
+    right_label.pending = label.pending || root->need_push_down_to_right;
+    right_label.tree_deleted = tree_deleted;
+    right_label.tree_downsample_deleted = tree_downsample_deleted;
+    return tree_deleted;
+}
+
 template <typename PointType>
 void KD_TREE<PointType>::Update(KD_TREE_NODE *root)
 {
@@ -1657,6 +1977,96 @@ void KD_TREE<PointType>::flatten(KD_TREE_NODE *root, PointVector &Storage, delet
     return;
 }
 
+template <typename PointType>
+void KD_TREE<PointType>::flatten_snapshot(KD_TREE_NODE *root, Lazy_Label label, PointVector &Storage)
+{
+    if (root == nullptr)
+        return;
+    Lazy_Label left_label, right_label;
+    bool point_deleted;
+    Resolve_Lazy_Label(root, label, left_label, right_label, point_deleted);
+    if (!point_deleted)
+    {
+        Storage.push_back(root->point);
+    }
+    flatten_snapshot(root->left_son_ptr, left_label, Storage);
+    flatten_snapshot(root->right_son_ptr, right_label, Storage);
+    bool point_downsample_deleted = root->point_downsample_deleted || (label.pending && label.tree_downsample_deleted);
+    if (point_deleted && !point_downsample_deleted)
+    {
+        Multithread_Points_deleted.push_back(root->point);
+    }
+    return;
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::reader_enter()
+{
+    int epoch_idx = __atomic_load_n(&reader_epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_fetch_add(&reader_counter[epoch_idx], 1, __ATOMIC_SEQ_CST);
+    return epoch_idx;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::reader_exit(int epoch_idx)
+{
+    __atomic_fetch_sub(&reader_counter[epoch_idx], 1, __ATOMIC_RELEASE);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::wait_for_readers()
+{
+    // Flip the epoch twice so that readers registered under either index before the swap have left
+    for (int i = 0; i < 2; i++)
+    {
+        int epoch_idx = __atomic_fetch_add(&reader_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        while (__atomic_load_n(&reader_counter[epoch_idx], __ATOMIC_ACQUIRE) != 0)
+            usleep(1);
+    }
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Update_Published(KD_TREE_NODE *root)
+{
+    // The node is visible to snapshot readers: compute the update on copies and store it field by field, so a reader
+    // loads every field either before or after the update and never a torn value. Update links the sons to their
+    // father, the son copies take that write instead of the published sons. The copies are never locked.
+    KD_TREE_NODE updated = *root, left_son, right_son;
+    if (root->left_son_ptr != nullptr)
+    {
+        left_son = *root->left_son_ptr;
+        updated.left_son_ptr = &left_son;
+    }
+    if (root->right_son_ptr != nullptr)
+    {
+        right_son = *root->right_son_ptr;
+        updated.right_son_ptr = &right_son;
+    }
+    Update(&updated);
+    store_relaxed(root->TreeSize, updated.TreeSize);
+    store_relaxed(root->invalid_point_num, updated.invalid_point_num);
+    store_relaxed(root->down_del_num, updated.down_del_num);
+    store_relaxed(root->tree_downsample_deleted, updated.tree_downsample_deleted);
+    store_relaxed(root->tree_deleted, updated.tree_deleted);
+    for (int i = 0; i < 2; i++)
+    {
+        store_relaxed(root->node_range_x[i], updated.node_range_x[i]);
+        store_relaxed(root->node_range_y[i], updated.node_range_y[i]);
+        store_relaxed(root->node_range_z[i], updated.node_range_z[i]);
+    }
+    store_relaxed(root->radius_sq, updated.radius_sq);
+    // Update only keeps the balance of the root, which the copy is not
+    if (root == Root_Node && updated.TreeSize > 3)
+    {
+        KD_TREE_NODE *son_ptr = updated.left_son_ptr;
+        if (son_ptr == nullptr)
+            son_ptr = updated.right_son_ptr;
+        float tmp_bal = float(son_ptr->TreeSize) / (updated.TreeSize - 1);
+        root->alpha_del = float(updated.invalid_point_num) / updated.TreeSize;
+        root->alpha_bal = (tmp_bal >= 0.5 - EPSS) ? tmp_bal : 1 - tmp_bal;
+    }
+}
+
 template <typename PointType>
 void KD_TREE<PointType>::delete_tree_nodes(KD_TREE_NODE **root)
 {
@@ -1666,8 +2076,7 @@ void KD_TREE<PointType>::delete_tree_nodes(KD_TREE_NODE **root)
     delete_tree_nodes(&(*root)->left_son_ptr);
     delete_tree_nodes(&(*root)->right_son_ptr);
 
-    pthread_mutex_destroy(&(*root)->push_down_mutex_lock);
-    delete *root;
+    Node_Pool.free(*root);
     *root = nullptr;
 
     return;
@@ -1692,19 +2101,23 @@ float KD_TREE<PointType>::calc_box_dist(KD_TREE_NODE *node, PointType point)
 {
     if (node == nullptr)
         return INFINITY;
+    // Every bound, old or new, holds all valid points below the node, so a mix of them is a valid box too
+    const float range_x[2] = {load_relaxed(node->node_range_x[0]), load_relaxed(node->node_range_x[1])};
+    const float range_y[2] = {load_relaxed(node->node_range_y[0]), load_relaxed(node->node_range_y[1])};
+    const float range_z[2] = {load_relaxed(node->node_range_z[0]), load_relaxed(node->node_range_z[1])};
     float min_dist = 0.0;
-    if (point.x < node->node_range_x[0])
-        min_dist += (point.x - node->node_range_x[0]) * (point.x - node->node_range_x[0]);
-    if (point.x > node->node_range_x[1])
-        min_dist += (point.x - node->node_range_x[1]) * (point.x - node->node_range_x[1]);
-    if (point.y < node->node_range_y[0])
-        min_dist += (point.y - node->node_range_y[0]) * (point.y - node->node_range_y[0]);
-    if (point.y > node->node_range_y[1])
-        min_dist += (point.y - node->node_range_y[1]) * (point.y - node->node_range_y[1]);
-    if (point.z < node->node_range_z[0])
-        min_dist += (point.z - node->node_range_z[0]) * (point.z - node->node_range_z[0]);
-    if (point.z > node->node_range_z[1])
-        min_dist += (point.z - node->node_range_z[1]) * (point.z - node->node_range_z[1]);
+    if (point.x < range_x[0])
+        min_dist += (point.x - range_x[0]) * (point.x - range_x[0]);
+    if (point.x > range_x[1])
+        min_dist += (point.x - range_x[1]) * (point.x - range_x[1]);
+    if (point.y < range_y[0])
+        min_dist += (point.y - range_y[0]) * (point.y - range_y[0]);
+    if (point.y > range_y[1])
+        min_dist += (point.y - range_y[1]) * (point.y - range_y[1]);
+    if (point.z < range_z[0])
+        min_dist += (point.z - range_z[0]) * (point.z - range_z[0]);
+    if (point.z > range_z[1])
+        min_dist += (point.z - range_z[1]) * (point.z - range_z[1]);
     return min_dist;
 }
 template <typename PointType>
@@ -1714,6 +2127,21 @@ bool KD_TREE<PointType>::point_cmp_y(PointType a, PointType b) { return a.y < b.
 template <typename PointType>
 bool KD_TREE<PointType>::point_cmp_z(PointType a, PointType b) { return a.z < b.z; }
 
+template <typename PointType>
+uint32_t KD_TREE<PointType>::morton_code(uint32_t x, uint32_t y, uint32_t z)
+{
+    // Interleave the lower 10 bits of each coordinate
+    auto spread = [](uint32_t v) {
+        v &= 0x3ff;
+        v = (v | (v << 16)) & 0x030000ff;
+        v = (v | (v << 8)) & 0x0300f00f;
+        v = (v | (v << 4)) & 0x030c30c3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1) | (spread(z) << 2);
+}
+
 // Manual heap
 
 
@@ -7,6 +7,9 @@
 #include <unistd.h>
 #include <math.h>
 #include <algorithm>
+#include <vector>
+#include <deque>
+#include <stdint.h>
 #include <memory.h>
 #include <pcl/point_types.h>
 
@@ -16,6 +19,8 @@
 #define DOWNSAMPLE_SWITCH true
 #define ForceRebuildPercentage 0.2
 #define Q_LEN 1000000
+#define Batch_Search_Group_Size 8
+#define Node_Pool_Slab_Size 8192
 
 using namespace std;
 
@@ -108,6 +113,102 @@ public:
         }
     };
 
+    // Deletion state a reader inherits from ancestors whose lazy labels have not been pushed down yet
+    struct Lazy_Label
+    {
+        bool pending = false;
+        bool tree_deleted = false;
+        bool tree_downsample_deleted = false;
+    };
+
+    struct Node_Pool_Stats
+    {
+        int slab_num = 0;
+        int node_capacity = 0;
+        int node_in_use = 0;
+        int node_reusable = 0;
+        size_t memory_bytes = 0;
+    };
+
+    class NODE_POOL
+    {
+    public:
+        NODE_POOL()
+        {
+            pthread_mutex_init(&pool_mutex_lock, NULL);
+        }
+
+        ~NODE_POOL()
+        {
+            for (size_t i = 0; i < slabs.size(); i++)
+            {
+                for (int j = 0; j < Node_Pool_Slab_Size; j++)
+                    pthread_mutex_destroy(&(slabs[i][j].push_down_mutex_lock));
+                delete[] slabs[i];
+            }
+            pthread_mutex_destroy(&pool_mutex_lock);
+        }
+        NODE_POOL(const NODE_POOL &) = delete;
+        NODE_POOL &operator=(const NODE_POOL &) = delete;
+
+        // Freed nodes are reused first, otherwise nodes are handed out contiguously in allocation (build) order
+        KD_TREE_NODE *alloc()
+        {
+            KD_TREE_NODE *node;
+            pthread_mutex_lock(&pool_mutex_lock);
+            if (free_head != nullptr)
+            {
+                node = free_head;
+                free_head = node->left_son_ptr;
+                free_num--;
+            }
+            else
+            {
+                if (slabs.empty() || slab_used == Node_Pool_Slab_Size)
+                {
+                    KD_TREE_NODE *slab = new KD_TREE_NODE[Node_Pool_Slab_Size];
+                    for (int j = 0; j < Node_Pool_Slab_Size; j++)
+                        pthread_mutex_init(&(slab[j].push_down_mutex_lock), NULL);
+                    slabs.push_back(slab);
+                    slab_used = 0;
+                }
+                node = &slabs.back()[slab_used++];
+            }
+            in_use_num++;
+            pthread_mutex_unlock(&pool_mutex_lock);
+            return node;
+        }
+        void free(KD_TREE_NODE *node)
+        {
+            pthread_mutex_lock(&pool_mutex_lock);
+            node->left_son_ptr = free_head;
+            free_head = node;
+            free_num++;
+            in_use_num--;
+            pthread_mutex_unlock(&pool_mutex_lock);
+        }
+        Node_Pool_Stats stats()
+        {
+            Node_Pool_Stats pool_stats;
+            pthread_mutex_lock(&pool_mutex_lock);
+            pool_stats.slab_num = slabs.size();
+            pool_stats.node_capacity = slabs.size() * Node_Pool_Slab_Size;
+            pool_stats.node_in_use = in_use_num;
+            pool_stats.node_reusable = free_num + (slabs.empty() ? 0 : Node_Pool_Slab_Size - slab_used);
+            pool_stats.memory_bytes = slabs.size() * Node_Pool_Slab_Size * sizeof(KD_TREE_NODE);
+            pthread_mutex_unlock(&pool_mutex_lock);
+            return pool_stats;
+        }
+
+    private:
+        pthread_mutex_t pool_mutex_lock;
+        vector<KD_TREE_NODE *> slabs;
+        int slab_used = 0;
+        KD_TREE_NODE *free_head = nullptr;
+        int free_num = 0;
+        int in_use_num = 0;
+    };
+
     class MANUAL_HEAP
     {
 
@@ -266,6 +367,13 @@ private:
     PointVector Rebuild_PCL_Storage;
     KD_TREE_NODE **Rebuild_Ptr = nullptr;
     int search_mutex_counter = 0;
+    // Snapshot (RCU-style) search: readers never lock, replaced subtrees are reclaimed after a grace period
+    bool snapshot_search_en = false;
+    int reader_epoch = 0;
+    int reader_counter[2] = {0, 0};
+    int reader_enter();
+    void reader_exit(int epoch_idx);
+    void wait_for_readers();
     static void *multi_thread_ptr(void *arg);
     void multi_thread_rebuild();
     void start_thread();
@@ -279,6 +387,7 @@ private:
     float downsample_size = 0.2f;
     bool Delete_Storage_Disabled = false;
     KD_TREE_NODE *STATIC_ROOT_NODE = nullptr;
+    NODE_POOL Node_Pool;
     PointVector Points_deleted;
     PointVector Downsample_Storage;
     PointVector Multithread_Points_deleted;
@@ -291,11 +400,17 @@ private:
     void Add_by_point(KD_TREE_NODE **root, PointType point, bool allow_rebuild, int father_axis);
     void Add_by_range(KD_TREE_NODE **root, BoxPointType boxpoint, bool allow_rebuild);
     void Search(KD_TREE_NODE *root, int k_nearest, PointType point, MANUAL_HEAP &q, float max_dist); //priority_queue<PointType_CMP>
+    void Search_Batch(KD_TREE_NODE *root, Lazy_Label label, int k_nearest, const PointType *points, const int *active, int active_num, deque<MANUAL_HEAP> &q, float max_dist_sqr);
+    void Search_Batch_Child(KD_TREE_NODE *child, Lazy_Label label, int k_nearest, const PointType *points, const int *active, int active_num, deque<MANUAL_HEAP> &q, float max_dist_sqr);
+    void Search_Snapshot(KD_TREE_NODE *root, Lazy_Label label, int k_nearest, PointType point, MANUAL_HEAP &q, float max_dist);
     void Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector &Storage);
     void Search_by_radius(KD_TREE_NODE *root, PointType point, float radius, PointVector &Storage);
     bool Criterion_Check(KD_TREE_NODE *root);
     void Push_Down(KD_TREE_NODE *root);
+    bool Resolve_Lazy_Label(KD_TREE_NODE *root, const Lazy_Label &label, Lazy_Label &left_label, Lazy_Label &right_label, bool &point_deleted);
+    void flatten_snapshot(KD_TREE_NODE *root, Lazy_Label label, PointVector &Storage);
     void Update(KD_TREE_NODE *root);
+    void Update_Published(KD_TREE_NODE *root);
     void delete_tree_nodes(KD_TREE_NODE **root);
     void downsample(KD_TREE_NODE **root);
     bool same_point(PointType a, PointType b);
@@ -304,6 +419,7 @@ private:
     static bool point_cmp_x(PointType a, PointType b);
     static bool point_cmp_y(PointType a, PointType b);
     static bool point_cmp_z(PointType a, PointType b);
+    static uint32_t morton_code(uint32_t x, uint32_t y, uint32_t z);
 
 public:
     KD_TREE(float delete_param = 0.5, float balance_param = 0.6, float box_length = 0.2);
@@ -320,12 +436,19 @@ public:
     {
         downsample_size = downsample_param;
     }
+    // Must be chosen before the tree is built, it cannot be switched while searches or rebuilds are running
+    void Set_snapshot_search(bool snapshot_en)
+    {
+        snapshot_search_en = snapshot_en;
+    }
     void InitializeKDTree(float delete_param = 0.5, float balance_param = 0.7, float box_length = 0.2);
     int size();
     int validnum();
     void root_alpha(float &alpha_bal, float &alpha_del);
     void Build(PointVector point_cloud);
     void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist = INFINITY);
+    // Results are flat: query i owns slots [i * k_nearest, (i + 1) * k_nearest), the first Found_Num[i] of them valid and sorted by distance.
+    void Nearest_Search_Batch(const PointVector &points, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, vector<int> &Found_Num, float max_dist = INFINITY);
     void Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage);
     void Radius_Search(PointType point, const float radius, PointVector &Storage);
     int Add_Points(PointVector &PointToAdd, bool downsample_on);
@@ -335,6 +458,7 @@ public:
     void flatten(KD_TREE_NODE *root, PointVector &Storage, delete_point_storage_set storage_type);
     void acquire_removed_points(PointVector &removed_points);
     BoxPointType tree_range();
+    Node_Pool_Stats node_pool_stats();
     PointVector PCL_Storage;
     KD_TREE_NODE *Root_Node = nullptr;
     int max_queue_size = 0;
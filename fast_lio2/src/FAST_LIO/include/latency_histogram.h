@@ -0,0 +1,61 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+/*
+ * Latency histogram of one stage of the mapping loop.
+ * Buckets are log spaced, 8 per octave from 1 us up to ~2 min, so every bucket is ~9% wide and the
+ * percentiles are good to that much no matter if a stage takes microseconds or seconds.
+ */
+class LatencyHistogram
+{
+public:
+    static const int SUB_BUCKETS = 8;
+    static const int BUCKETS = 27 * SUB_BUCKETS;
+
+    LatencyHistogram() : buckets_(BUCKETS, 0) {}
+
+    void add(double ms)
+    {
+        const double us = ms * 1000.0;
+        int b = us < 1.0 ? 0 : int(std::log2(us) * SUB_BUCKETS);
+        b = std::min(b, BUCKETS - 1);
+        buckets_[b]++;
+        count_++;
+        sum_ += ms;
+        max_ = std::max(max_, ms);
+    }
+
+    uint64_t count() const { return count_; }
+    double mean() const { return count_ > 0 ? sum_ / count_ : 0.0; }
+    double max() const { return max_; }
+    uint64_t bucket(int b) const { return buckets_[b]; }
+
+    /* upper edge of bucket b in ms */
+    static double bucket_upper(int b) { return std::exp2(double(b + 1) / SUB_BUCKETS) / 1000.0; }
+
+    /* upper edge of the bucket holding the p-quantile (p in [0, 1]), never more than the largest sample */
+    double percentile(double p) const
+    {
+        if (count_ == 0) return 0.0;
+        const uint64_t rank = std::max<uint64_t>(1, uint64_t(std::ceil(p * count_)));
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; b++)
+        {
+            seen += buckets_[b];
+            if (seen >= rank) return std::min(bucket_upper(b), max_);
+        }
+        return max_;
+    }
+
+private:
+    std::vector<uint64_t> buckets_;
+    uint64_t count_ = 0;
+    double sum_ = 0.0, max_ = 0.0;
+};
+
+#endif
@@ -0,0 +1,281 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE (1 << 16)   // events kept per thread, a power of two
+#endif
+
+/*
+ * Always-on tracing of the mapping loop.
+ * Every thread records into its own ring holding its last TRACE_RING_SIZE events. Recording is a clock read and a
+ * few stores without any lock, and the memory stays bounded however long the node runs. An export copies the rings
+ * while they are written (every slot is a seqlock, a slot overwritten during the copy is left out), so it can run at
+ * any time, not only at shutdown.
+ *     TRACE_SCOPE("match");                          span until the end of the scope
+ *     trace::complete("solve", start_ns, end_ns);   span with known ends, from trace::now_ns()
+ *     trace::counter("tree_size", ikdtree.size());
+ * Names are stored as pointers, they have to be string literals.
+ *
+ * write_chrome_json() writes the Chrome trace format (chrome://tracing, ui.perfetto.dev).
+ * write_binary() writes the same events compact, all little endian:
+ *     "FLTR" u32 version=1  u32 name_count  {u16 length, chars}*name_count
+ *     u32 thread_count  {u32 tid, u16 length, chars, u64 event_count, {u16 name, u8 type, u64 ts_ns, u64 payload}*}*
+ * payload is the duration in ns for a span and the bits of the double value for a counter.
+ */
+namespace trace
+{
+
+enum EventType : uint8_t {SPAN = 0, COUNTER = 1};
+
+struct Event
+{
+    const char *name;
+    uint8_t  type;
+    uint64_t ts_ns;
+    uint64_t payload;
+};
+
+inline uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* single writer (the owning thread), any number of readers */
+class Ring
+{
+public:
+    Ring(uint32_t tid) : tid_(tid), name_("thread"), slots_(new Slot[TRACE_RING_SIZE]) {}
+
+    void push(const char *name, uint8_t type, uint64_t ts_ns, uint64_t payload)
+    {
+        const uint64_t n = head_.load(std::memory_order_relaxed);
+        Slot &s = slots_[n & (TRACE_RING_SIZE - 1)];
+        s.seq.store(2 * n + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        s.name.store(name, std::memory_order_relaxed);
+        s.type.store(type, std::memory_order_relaxed);
+        s.ts_ns.store(ts_ns, std::memory_order_relaxed);
+        s.payload.store(payload, std::memory_order_relaxed);
+        s.seq.store(2 * n + 2, std::memory_order_release);
+        head_.store(n + 1, std::memory_order_release);
+    }
+
+    /* the events still in the ring, oldest first */
+    void snapshot(std::vector<Event> &events) const
+    {
+        events.clear();
+        const uint64_t head = head_.load(std::memory_order_acquire);
+        const uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        events.reserve(head - first);
+        for (uint64_t n = first; n < head; n++)
+        {
+            const Slot &s = slots_[n & (TRACE_RING_SIZE - 1)];
+            const uint64_t seq = s.seq.load(std::memory_order_acquire);
+            if (seq != 2 * n + 2) continue;
+            Event e;
+            e.name = s.name.load(std::memory_order_relaxed);
+            e.type = s.type.load(std::memory_order_relaxed);
+            e.ts_ns = s.ts_ns.load(std::memory_order_relaxed);
+            e.payload = s.payload.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (s.seq.load(std::memory_order_relaxed) != seq) continue;
+            events.push_back(e);
+        }
+    }
+
+    uint32_t tid() const { return tid_; }
+    const char *name() const { return name_.load(std::memory_order_relaxed); }
+    void set_name(const char *name) { name_.store(name, std::memory_order_relaxed); }
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> seq{0};
+        std::atomic<const char *> name{nullptr};
+        std::atomic<uint8_t> type{0};
+        std::atomic<uint64_t> ts_ns{0};
+        std::atomic<uint64_t> payload{0};
+    };
+
+    const uint32_t tid_;
+    std::atomic<const char *> name_;
+    std::unique_ptr<Slot[]> slots_;
+    std::atomic<uint64_t> head_{0};
+};
+
+/* all rings ever created, a ring stays here after its thread is gone so it can still be exported */
+class Registry
+{
+public:
+    static Registry &get()
+    {
+        static Registry registry;
+        return registry;
+    }
+
+    Ring &local()
+    {
+        static thread_local std::shared_ptr<Ring> ring = add();
+        return *ring;
+    }
+
+    std::vector<std::shared_ptr<Ring>> rings()
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return rings_;
+    }
+
+    std::atomic<bool> enabled{true};
+
+private:
+    std::shared_ptr<Ring> add()
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        rings_.emplace_back(new Ring(rings_.size()));
+        return rings_.back();
+    }
+
+    std::mutex mtx_;
+    std::vector<std::shared_ptr<Ring>> rings_;
+};
+
+inline void set_enabled(bool enabled) { Registry::get().enabled.store(enabled, std::memory_order_relaxed); }
+inline bool enabled() { return Registry::get().enabled.load(std::memory_order_relaxed); }
+
+/* name of the calling thread in the exported trace */
+inline void set_thread_name(const char *name) { Registry::get().local().set_name(name); }
+
+inline void complete(const char *name, uint64_t start_ns, uint64_t end_ns)
+{
+    if (!enabled()) return;
+    Registry::get().local().push(name, SPAN, start_ns, end_ns - start_ns);
+}
+
+inline void counter(const char *name, double value)
+{
+    if (!enabled()) return;
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    Registry::get().local().push(name, COUNTER, now_ns(), bits);
+}
+
+class Scope
+{
+public:
+    explicit Scope(const char *name) : name_(name), start_ns_(now_ns()) {}
+    ~Scope() { complete(name_, start_ns_, now_ns()); }
+
+private:
+    const char *name_;
+    uint64_t start_ns_;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+struct ThreadEvents
+{
+    uint32_t tid;
+    const char *name;
+    std::vector<Event> events;
+};
+
+inline std::vector<ThreadEvents> snapshot_all()
+{
+    std::vector<ThreadEvents> threads;
+    for (const auto &ring : Registry::get().rings())
+    {
+        threads.push_back(ThreadEvents{ring->tid(), ring->name(), {}});
+        ring->snapshot(threads.back().events);
+    }
+    return threads;
+}
+
+inline bool write_chrome_json(const std::string &file)
+{
+    FILE *fp = fopen(file.c_str(), "w");
+    if (!fp) return false;
+    const std::vector<ThreadEvents> threads = snapshot_all();
+    /* spans are recorded when they end, so the ring is not in start order, an enclosing span starts before the
+     * spans recorded ahead of it */
+    uint64_t t_origin = UINT64_MAX;
+    for (const auto &t : threads)
+        for (const Event &e : t.events) t_origin = std::min(t_origin, e.ts_ns);
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    for (const auto &t : threads)
+    {
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", t.tid, t.name);
+        first = false;
+        for (const Event &e : t.events)
+        {
+            const double ts_us = (e.ts_ns - t_origin) * 1e-3;
+            if (e.type == SPAN)
+            {
+                fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", e.name, t.tid, ts_us, e.payload * 1e-3);
+            }
+            else
+            {
+                double value;
+                memcpy(&value, &e.payload, sizeof(value));
+                fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"value\":%.17g}}", e.name, t.tid, ts_us, value);
+            }
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    return fclose(fp) == 0;
+}
+
+inline bool write_binary(const std::string &file)
+{
+    const std::vector<ThreadEvents> threads = snapshot_all();
+    std::map<std::string, uint16_t> name_ids;
+    std::vector<std::string> names;
+    for (const auto &t : threads)
+        for (const Event &e : t.events)
+            if (name_ids.emplace(e.name, names.size()).second) names.push_back(e.name);
+
+    FILE *fp = fopen(file.c_str(), "wb");
+    if (!fp) return false;
+    /* byte by byte, so the file is little endian whatever the host is */
+    auto put = [fp](uint64_t value, int size) { for (int i = 0; i < size; i++) fputc((value >> (8 * i)) & 0xff, fp); };
+    auto put_string = [fp, &put](const std::string &s) { put(s.size(), 2); fwrite(s.data(), 1, s.size(), fp); };
+
+    fwrite("FLTR", 1, 4, fp);
+    put(1, 4);
+    put(names.size(), 4);
+    for (const auto &name : names) put_string(name);
+    put(threads.size(), 4);
+    for (const auto &t : threads)
+    {
+        put(t.tid, 4);
+        put_string(t.name);
+        put(t.events.size(), 8);
+        for (const Event &e : t.events)
+        {
+            put(name_ids[e.name], 2);
+            put(e.type, 1);
+            put(e.ts_ns, 8);
+            put(e.payload, 8);
+        }
+    }
+    return fclose(fp) == 0;
+}
+
+}  // namespace trace
+
+#endif
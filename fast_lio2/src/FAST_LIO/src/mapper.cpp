@@ -0,0 +1,547 @@
+#include "mapper.h"
+#include "IMU_Processing.hpp"
+#include "trace.h"
+
+const float MOV_THRESHOLD = 1.5f;
+
+LaserMapper::LaserMapper()
+    : p_pre(new Preprocess()), p_imu(new ImuProcess()),
+      feats_undistort(new PointCloudXYZI()), feats_down_body(new PointCloudXYZI()),
+      feats_down_world(new PointCloudXYZI()), normvec(new PointCloudXYZI(100000, 1)),
+      featsFromMap(new PointCloudXYZI())
+{
+    memset(point_selected_surf, true, sizeof(point_selected_surf));
+    memset(res_last, -1000.0f, sizeof(res_last));
+}
+
+void LaserMapper::init()
+{
+    FOV_DEG = (fov_deg + 10.0) > 179.9 ? 179.9 : (fov_deg + 10.0);
+    HALF_FOV_COS = cos((FOV_DEG) * 0.5 * PI_M / 180.0);
+
+    downSizeFilterSurf.setLeafSize(filter_size_surf_min, filter_size_surf_min, filter_size_surf_min);
+
+    V3D Lidar_T_wrt_IMU(Zero3d);
+    M3D Lidar_R_wrt_IMU(Eye3d);
+    Lidar_T_wrt_IMU<<VEC_FROM_ARRAY(extrinT);
+    Lidar_R_wrt_IMU<<MAT_FROM_ARRAY(extrinR);
+    p_imu->set_extrinsic(Lidar_T_wrt_IMU, Lidar_R_wrt_IMU);
+    p_imu->set_gyr_cov(V3D(gyr_cov, gyr_cov, gyr_cov));
+    p_imu->set_acc_cov(V3D(acc_cov, acc_cov, acc_cov));
+    p_imu->set_gyr_bias_cov(V3D(b_gyr_cov, b_gyr_cov, b_gyr_cov));
+    p_imu->set_acc_bias_cov(V3D(b_acc_cov, b_acc_cov, b_acc_cov));
+
+    double epsi[23] = {0.001};
+    fill(epsi, epsi+23, 0.001);
+    kf.init_dyn_share(get_f, df_dx, df_dw, \
+        [this](state_ikfom &s, esekfom::dyn_share_datastruct<double> &ekfom_data) { h_share_model(s, ekfom_data); }, \
+        NUM_MAX_ITERATIONS, epsi);
+}
+
+void LaserMapper::pointBodyToWorld(PointType const * const pi, PointType * const po) const
+{
+    V3D p_body(pi->x, pi->y, pi->z);
+    V3D p_global(state_point.rot * (state_point.offset_R_L_I*p_body + state_point.offset_T_L_I) + state_point.pos);
+
+    po->x = p_global(0);
+    po->y = p_global(1);
+    po->z = p_global(2);
+    po->intensity = pi->intensity;
+}
+
+void LaserMapper::points_cache_collect()
+{
+    PointVector points_history;
+    ikdtree.acquire_removed_points(points_history);
+}
+
+void LaserMapper::lasermap_fov_segment()
+{
+    cub_needrm.clear();
+    kdtree_delete_counter = 0;
+    kdtree_delete_time = 0.0;
+    pointBodyToWorld(XAxisPoint_body, XAxisPoint_world);
+    V3D pos_LiD = pos_lid;
+    if (!Localmap_Initialized){
+        for (int i = 0; i < 3; i++){
+            LocalMap_Points.vertex_min[i] = pos_LiD(i) - cube_len / 2.0;
+            LocalMap_Points.vertex_max[i] = pos_LiD(i) + cube_len / 2.0;
+        }
+        Localmap_Initialized = true;
+        return;
+    }
+    float dist_to_map_edge[3][2];
+    bool need_move = false;
+    for (int i = 0; i < 3; i++){
+        dist_to_map_edge[i][0] = fabs(pos_LiD(i) - LocalMap_Points.vertex_min[i]);
+        dist_to_map_edge[i][1] = fabs(pos_LiD(i) - LocalMap_Points.vertex_max[i]);
+        if (dist_to_map_edge[i][0] <= MOV_THRESHOLD * DET_RANGE || dist_to_map_edge[i][1] <= MOV_THRESHOLD * DET_RANGE) need_move = true;
+    }
+    if (!need_move) return;
+    BoxPointType New_LocalMap_Points, tmp_boxpoints;
+    New_LocalMap_Points = LocalMap_Points;
+    float mov_dist = max((cube_len - 2.0 * MOV_THRESHOLD * DET_RANGE) * 0.5 * 0.9, double(DET_RANGE * (MOV_THRESHOLD -1)));
+    for (int i = 0; i < 3; i++){
+        tmp_boxpoints = LocalMap_Points;
+        if (dist_to_map_edge[i][0] <= MOV_THRESHOLD * DET_RANGE){
+            New_LocalMap_Points.vertex_max[i] -= mov_dist;
+            New_LocalMap_Points.vertex_min[i] -= mov_dist;
+            tmp_boxpoints.vertex_min[i] = LocalMap_Points.vertex_max[i] - mov_dist;
+            cub_needrm.push_back(tmp_boxpoints);
+        } else if (dist_to_map_edge[i][1] <= MOV_THRESHOLD * DET_RANGE){
+            New_LocalMap_Points.vertex_max[i] += mov_dist;
+            New_LocalMap_Points.vertex_min[i] += mov_dist;
+            tmp_boxpoints.vertex_max[i] = LocalMap_Points.vertex_min[i] + mov_dist;
+            cub_needrm.push_back(tmp_boxpoints);
+        }
+    }
+    LocalMap_Points = New_LocalMap_Points;
+
+    points_cache_collect();
+    double delete_begin = omp_get_wtime();
+    {
+        TRACE_SCOPE("delete");
+        if(cub_needrm.size() > 0) kdtree_delete_counter = ikdtree.Delete_Point_Boxes(cub_needrm);
+    }
+    kdtree_delete_time = omp_get_wtime() - delete_begin;
+    trace::counter("deleted_points", kdtree_delete_counter);
+}
+
+void LaserMapper::standard_pcl_cbk(const sensor_msgs::PointCloud2::ConstPtr &msg)
+{
+    TRACE_SCOPE("preprocess");
+    mtx_buffer.lock();
+    scan_count ++;
+    double preprocess_start_time = omp_get_wtime();
+    if (msg->header.stamp.toSec() < last_timestamp_lidar)
+    {
+        ROS_ERROR("lidar loop back, clear buffer");
+        lidar_buffer.clear();
+    }
+
+    PointCloudXYZI::Ptr  ptr(new PointCloudXYZI());
+    p_pre->process(msg, ptr);
+    lidar_buffer.push_back(ptr);
+    time_buffer.push_back(msg->header.stamp.toSec());
+    last_timestamp_lidar = msg->header.stamp.toSec();
+    preprocess_time = omp_get_wtime() - preprocess_start_time;
+    mtx_buffer.unlock();
+    sig_buffer.notify_all();
+}
+
+void LaserMapper::livox_pcl_cbk(const livox_ros_driver::CustomMsg::ConstPtr &msg)
+{
+    TRACE_SCOPE("preprocess");
+    mtx_buffer.lock();
+    double preprocess_start_time = omp_get_wtime();
+    scan_count ++;
+    if (msg->header.stamp.toSec() < last_timestamp_lidar)
+    {
+        ROS_ERROR("lidar loop back, clear buffer");
+        lidar_buffer.clear();
+    }
+    last_timestamp_lidar = msg->header.stamp.toSec();
+
+    if (!time_sync_en && abs(last_timestamp_imu - last_timestamp_lidar) > 10.0 && !imu_buffer.empty() && !lidar_buffer.empty() )
+    {
+        printf("IMU and LiDAR not Synced, IMU time: %lf, lidar header time: %lf \n",last_timestamp_imu, last_timestamp_lidar);
+    }
+
+    if (time_sync_en && !timediff_set_flg && abs(last_timestamp_lidar - last_timestamp_imu) > 1 && !imu_buffer.empty())
+    {
+        timediff_set_flg = true;
+        timediff_lidar_wrt_imu = last_timestamp_lidar + 0.1 - last_timestamp_imu;
+        printf("Self sync IMU and LiDAR, time diff is %.10lf \n", timediff_lidar_wrt_imu);
+    }
+
+    PointCloudXYZI::Ptr  ptr(new PointCloudXYZI());
+    p_pre->process(msg, ptr);
+    lidar_buffer.push_back(ptr);
+    time_buffer.push_back(last_timestamp_lidar);
+
+    preprocess_time = omp_get_wtime() - preprocess_start_time;
+    mtx_buffer.unlock();
+    sig_buffer.notify_all();
+}
+
+void LaserMapper::imu_cbk(const sensor_msgs::Imu::ConstPtr &msg_in)
+{
+    sensor_msgs::Imu::Ptr msg(new sensor_msgs::Imu(*msg_in));
+
+    msg->header.stamp = ros::Time().fromSec(msg_in->header.stamp.toSec() - time_diff_lidar_to_imu);
+    if (abs(timediff_lidar_wrt_imu) > 0.1 && time_sync_en)
+    {
+        msg->header.stamp = \
+        ros::Time().fromSec(timediff_lidar_wrt_imu + msg_in->header.stamp.toSec());
+    }
+
+    double timestamp = msg->header.stamp.toSec();
+
+    mtx_buffer.lock();
+
+    if (timestamp < last_timestamp_imu)
+    {
+        ROS_WARN("imu loop back, clear buffer");
+        imu_buffer.clear();
+    }
+
+    last_timestamp_imu = timestamp;
+
+    imu_buffer.push_back(msg);
+    mtx_buffer.unlock();
+    sig_buffer.notify_all();
+}
+
+bool LaserMapper::sync_packages()
+{
+    lock_guard<mutex> lock(mtx_buffer);
+    MeasureGroup &meas = Measures;
+    if (lidar_buffer.empty() || imu_buffer.empty()) {
+        return false;
+    }
+
+    /*** push a lidar scan ***/
+    if(!lidar_pushed)
+    {
+        meas.lidar = lidar_buffer.front();
+        meas.lidar_beg_time = time_buffer.front();
+        if (meas.lidar->points.size() <= 1) // time too little
+        {
+            lidar_end_time = meas.lidar_beg_time + lidar_mean_scantime;
+            ROS_WARN("Too few input point cloud!\n");
+        }
+        else if (meas.lidar->points.back().curvature / double(1000) < 0.5 * lidar_mean_scantime)
+        {
+            lidar_end_time = meas.lidar_beg_time + lidar_mean_scantime;
+        }
+        else
+        {
+            scan_num ++;
+            lidar_end_time = meas.lidar_beg_time + meas.lidar->points.back().curvature / double(1000);
+            lidar_mean_scantime += (meas.lidar->points.back().curvature / double(1000) - lidar_mean_scantime) / scan_num;
+        }
+
+        meas.lidar_end_time = lidar_end_time;
+
+        lidar_pushed = true;
+    }
+
+    if (last_timestamp_imu < lidar_end_time)
+    {
+        return false;
+    }
+
+    /*** push imu data, and pop from imu buffer ***/
+    double imu_time = imu_buffer.front()->header.stamp.toSec();
+    meas.imu.clear();
+    while ((!imu_buffer.empty()) && (imu_time < lidar_end_time))
+    {
+        imu_time = imu_buffer.front()->header.stamp.toSec();
+        if(imu_time > lidar_end_time) break;
+        meas.imu.push_back(imu_buffer.front());
+        imu_buffer.pop_front();
+    }
+
+    lidar_buffer.pop_front();
+    time_buffer.pop_front();
+    lidar_pushed = false;
+    return true;
+}
+
+bool LaserMapper::process_imu(PointCloudXYZI::Ptr &undistort, PointCloudXYZI::Ptr &down_body)
+{
+    if (flg_first_scan)
+    {
+        first_lidar_time = Measures.lidar_beg_time;
+        p_imu->first_lidar_time = first_lidar_time;
+        flg_first_scan = false;
+        return false;
+    }
+
+    {
+        TRACE_SCOPE("imu_process");
+        p_imu->Process(Measures, kf, undistort);
+    }
+
+    /*** downsample the feature points in a scan ***/
+    if (!undistort->empty())
+    {
+        TRACE_SCOPE("downsample");
+        downSizeFilterSurf.setInputCloud(undistort);
+        downSizeFilterSurf.filter(*down_body);
+    }
+    return true;
+}
+
+bool LaserMapper::prepare_update(const PointCloudXYZI::Ptr &undistort, const PointCloudXYZI::Ptr &down_body)
+{
+    feats_undistort = undistort;
+    feats_down_body = down_body;
+    state_point = kf.get_x();
+    pos_lid = state_point.pos + state_point.rot * state_point.offset_T_L_I;
+
+    if (feats_undistort->empty() || (feats_undistort == NULL))
+    {
+        ROS_WARN("No point, skip this scan!\n");
+        return false;
+    }
+
+    flg_EKF_inited = (Measures.lidar_beg_time - first_lidar_time) < INIT_TIME ? \
+                    false : true;
+    /*** Segment the map in lidar FOV ***/
+    lasermap_fov_segment();
+    feats_down_size = feats_down_body->points.size();
+    /*** initialize the map kdtree ***/
+    if(ikdtree.Root_Node == nullptr)
+    {
+        if(feats_down_size > 5)
+        {
+            TRACE_SCOPE("map_build");
+            ikdtree.set_downsample_param(filter_size_map_min);
+            ikdtree.Set_snapshot_search(ikdtree_snapshot_en);
+            feats_down_world->resize(feats_down_size);
+            for(int i = 0; i < feats_down_size; i++)
+            {
+                pointBodyToWorld(&(feats_down_body->points[i]), &(feats_down_world->points[i]));
+            }
+            ikdtree.Build(feats_down_world->points);
+        }
+        return false;
+    }
+    kdtree_size_st = ikdtree.size();
+
+    /*** ICP and iterated Kalman filter update ***/
+    if (feats_down_size < 5)
+    {
+        ROS_WARN("No point, skip this scan!\n");
+        return false;
+    }
+
+    normvec->resize(feats_down_size);
+    feats_down_world->resize(feats_down_size);
+    Nearest_Points.resize(feats_down_size);
+    return true;
+}
+
+void LaserMapper::update()
+{
+    TRACE_SCOPE("update");
+    match_time = 0;
+    kdtree_search_time = 0.0;
+    solve_time = 0;
+    solve_const_H_time = 0;
+    solve_H_time = 0;
+
+    /*** iterated state estimation ***/
+    solve_start_ns = 0;
+    kf.update_iterated_dyn_share_info(LASER_POINT_COV, solve_H_time);
+    if (solve_start_ns > 0) trace::complete("solve", solve_start_ns, trace::now_ns());
+    trace::counter("effective_points", effct_feat_num);
+    state_point = kf.get_x();
+    euler_cur = SO3ToEuler(state_point.rot);
+    pos_lid = state_point.pos + state_point.rot * state_point.offset_T_L_I;
+}
+
+void LaserMapper::map_incremental()
+{
+    TRACE_SCOPE("incremental");
+    PointVector PointToAdd;
+    PointVector PointNoNeedDownsample;
+    PointToAdd.reserve(feats_down_size);
+    PointNoNeedDownsample.reserve(feats_down_size);
+    for (int i = 0; i < feats_down_size; i++)
+    {
+        /* transform to world frame */
+        pointBodyToWorld(&(feats_down_body->points[i]), &(feats_down_world->points[i]));
+        /* decide if need add to map */
+        if (!Nearest_Points[i].empty() && flg_EKF_inited)
+        {
+            const PointVector &points_near = Nearest_Points[i];
+            bool need_add = true;
+            BoxPointType Box_of_Point;
+            PointType downsample_result, mid_point;
+            mid_point.x = floor(feats_down_world->points[i].x/filter_size_map_min)*filter_size_map_min + 0.5 * filter_size_map_min;
+            mid_point.y = floor(feats_down_world->points[i].y/filter_size_map_min)*filter_size_map_min + 0.5 * filter_size_map_min;
+            mid_point.z = floor(feats_down_world->points[i].z/filter_size_map_min)*filter_size_map_min + 0.5 * filter_size_map_min;
+            float dist  = calc_dist(feats_down_world->points[i],mid_point);
+            if (fabs(points_near[0].x - mid_point.x) > 0.5 * filter_size_map_min && fabs(points_near[0].y - mid_point.y) > 0.5 * filter_size_map_min && fabs(points_near[0].z - mid_point.z) > 0.5 * filter_size_map_min){
+                PointNoNeedDownsample.push_back(feats_down_world->points[i]);
+                continue;
+            }
+            for (int readd_i = 0; readd_i < NUM_MATCH_POINTS; readd_i ++)
+            {
+                if (points_near.size() < NUM_MATCH_POINTS) break;
+                if (calc_dist(points_near[readd_i], mid_point) < dist)
+                {
+                    need_add = false;
+                    break;
+                }
+            }
+            if (need_add) PointToAdd.push_back(feats_down_world->points[i]);
+        }
+        else
+        {
+            PointToAdd.push_back(feats_down_world->points[i]);
+        }
+    }
+
+    double st_time = omp_get_wtime();
+    add_point_size = ikdtree.Add_Points(PointToAdd, true);
+    ikdtree.Add_Points(PointNoNeedDownsample, false);
+    add_point_size = PointToAdd.size() + PointNoNeedDownsample.size();
+    kdtree_incremental_time = omp_get_wtime() - st_time;
+    trace::counter("tree_size", ikdtree.size());
+}
+
+void LaserMapper::h_share_model(state_ikfom &s, esekfom::dyn_share_datastruct<double> &ekfom_data)
+{
+    /* the filter solves between two calls, so the solve spans are the gaps between the match spans */
+    const uint64_t match_start_ns = trace::now_ns();
+    if (solve_start_ns > 0) trace::complete("solve", solve_start_ns, match_start_ns);
+    solve_start_ns = 0;
+    double match_start = omp_get_wtime();
+    total_residual = 0.0; 
+
+    /** transform to world frame **/
+    #ifdef MP_EN
+        omp_set_num_threads(MP_PROC_NUM);
+        #pragma omp parallel for
+    #endif
+    for (int i = 0; i < feats_down_size; i++)
+    {
+        PointType &point_body  = feats_down_body->points[i]; 
+        PointType &point_world = feats_down_world->points[i]; 
+
+        V3D p_body(point_body.x, point_body.y, point_body.z);
+        V3D p_global(s.rot * (s.offset_R_L_I*p_body + s.offset_T_L_I) + s.pos);
+        point_world.x = p_global(0);
+        point_world.y = p_global(1);
+        point_world.z = p_global(2);
+        point_world.intensity = point_body.intensity;
+    }
+
+    /** Find the closest surfaces in the map for the whole scan at once **/
+    if (ekfom_data.converge)
+    {
+        ikdtree.Nearest_Search_Batch(feats_down_world->points, NUM_MATCH_POINTS, batch_nearest_points, batch_nearest_dis, batch_nearest_num);
+    }
+
+    /** closest surface search, residual and measurement information **/
+    /* the points are cut into MP_PROC_NUM fixed blocks, H^T H and H^T z are summed per block and the filter only gets
+       the 12x12 totals. The blocks are added up in block order, so replaying the same data gives the same state bit
+       for bit, also when OpenMP runs the region with fewer threads */
+    vector<Matrix<double, 12, 12>, Eigen::aligned_allocator<Matrix<double, 12, 12>>> HTH_part(MP_PROC_NUM, Matrix<double, 12, 12>::Zero());
+    vector<Matrix<double, 12, 1>, Eigen::aligned_allocator<Matrix<double, 12, 1>>> HTz_part(MP_PROC_NUM, Matrix<double, 12, 1>::Zero());
+    vector<int>    effct_num_part(MP_PROC_NUM, 0);
+    vector<double> residual_part(MP_PROC_NUM, 0.0);
+    #ifdef MP_EN
+        omp_set_num_threads(MP_PROC_NUM);
+        #pragma omp parallel for schedule(static, 1)
+    #endif
+    for (int block = 0; block < MP_PROC_NUM; block++)
+    {
+    Matrix<double, 12, 12> HTH_local = Matrix<double, 12, 12>::Zero();
+    Matrix<double, 12, 1> HTz_local = Matrix<double, 12, 1>::Zero();
+    int effct_num_local = 0;
+    double residual_local = 0.0;
+
+    const int block_end = (long)feats_down_size * (block + 1) / MP_PROC_NUM;
+    for (int i = (long)feats_down_size * block / MP_PROC_NUM; i < block_end; i++)
+    {
+        PointType &point_body  = feats_down_body->points[i]; 
+        PointType &point_world = feats_down_world->points[i]; 
+        V3D p_body(point_body.x, point_body.y, point_body.z);
+
+        auto &points_near = Nearest_Points[i];
+
+        if (ekfom_data.converge)
+        {
+            const int found_num = batch_nearest_num[i];
+            const auto near_begin = batch_nearest_points.begin() + i * NUM_MATCH_POINTS;
+            points_near.assign(near_begin, near_begin + found_num);
+            point_selected_surf[i] = found_num < NUM_MATCH_POINTS ? false : batch_nearest_dis[i * NUM_MATCH_POINTS + NUM_MATCH_POINTS - 1] > 5 ? false : true;
+        }
+
+        if (!point_selected_surf[i]) continue;
+
+        VF(4) pabcd;
+        point_selected_surf[i] = false;
+        if (esti_plane(pabcd, points_near, 0.1f))
+        {
+            float pd2 = pabcd(0) * point_world.x + pabcd(1) * point_world.y + pabcd(2) * point_world.z + pabcd(3);
+            float s = 1 - 0.9 * fabs(pd2) / sqrt(p_body.norm());
+
+            if (s > 0.9)
+            {
+                point_selected_surf[i] = true;
+                normvec->points[i].x = pabcd(0);
+                normvec->points[i].y = pabcd(1);
+                normvec->points[i].z = pabcd(2);
+                normvec->points[i].intensity = pd2;
+                res_last[i] = abs(pd2);
+            }
+        }
+
+        if (!point_selected_surf[i]) continue;
+
+        /*** Computation of Measuremnt Jacobian matrix H and measurents vector ***/
+        M3D point_be_crossmat;
+        point_be_crossmat << SKEW_SYM_MATRX(p_body);
+        V3D point_this = s.offset_R_L_I * p_body + s.offset_T_L_I;
+        M3D point_crossmat;
+        point_crossmat<<SKEW_SYM_MATRX(point_this);
+
+        /*** get the normal vector of closest surface/corner ***/
+        const PointType &norm_p = normvec->points[i];
+        V3D norm_vec(norm_p.x, norm_p.y, norm_p.z);
+
+        /*** calculate the Measuremnt Jacobian matrix H ***/
+        V3D C(s.rot.conjugate() *norm_vec);
+        V3D A(point_crossmat * C);
+        Matrix<double, 12, 1> h_x;
+        if (extrinsic_est_en)
+        {
+            V3D B(point_be_crossmat * s.offset_R_L_I.conjugate() * C); //s.rot.conjugate()*norm_vec);
+            h_x << norm_p.x, norm_p.y, norm_p.z, VEC_FROM_ARRAY(A), VEC_FROM_ARRAY(B), VEC_FROM_ARRAY(C);
+            HTH_local.noalias() += h_x * h_x.transpose();
+        }
+        else
+        {
+            h_x << norm_p.x, norm_p.y, norm_p.z, VEC_FROM_ARRAY(A), 0.0, 0.0, 0.0, 0.0, 0.0, 0.0;
+            HTH_local.topLeftCorner<6, 6>().noalias() += h_x.head<6>() * h_x.head<6>().transpose();
+        }
+
+        /*** Measuremnt: distance to the closest surface/corner ***/
+        HTz_local.noalias() += h_x * (-norm_p.intensity);
+        residual_local += res_last[i];
+        effct_num_local ++;
+    }
+
+    HTH_part[block] = HTH_local;
+    HTz_part[block] = HTz_local;
+    effct_num_part[block] = effct_num_local;
+    residual_part[block] = residual_local;
+    }
+
+    effct_feat_num = 0;
+    for (int block = 0; block < MP_PROC_NUM; block++)
+    {
+        ekfom_data.HTH += HTH_part[block];
+        ekfom_data.HTz += HTz_part[block];
+        effct_feat_num += effct_num_part[block];
+        total_residual += residual_part[block];
+    }
+
+    solve_start_ns = trace::now_ns();
+    trace::complete("match", match_start_ns, solve_start_ns);
+    if (effct_feat_num < 1)
+    {
+        solve_start_ns = 0;
+        ekfom_data.valid = false;
+        ROS_WARN("No Effective Points! \n");
+        return;
+    }
+
+    res_mean_last = total_residual / effct_feat_num;
+    match_time  += omp_get_wtime() - match_start;
+}
@@ -0,0 +1,185 @@
+#ifndef MAPPER_H
+#define MAPPER_H
+
+#include <omp.h>
+#include <mutex>
+#include <deque>
+#include <string>
+#include <vector>
+#include <memory>
+#include <condition_variable>
+#include <so3_math.h>
+#include <Eigen/Core>
+#include <common_lib.h>
+#include <use-ikfom.hpp>
+#include <pcl/filters/voxel_grid.h>
+#include <sensor_msgs/Imu.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <livox_ros_driver/CustomMsg.h>
+#include "preprocess.h"
+#include <ikd-Tree/ikd_Tree.h>
+
+#define INIT_TIME           (0.1)
+#define LASER_POINT_COV     (0.001)
+
+class ImuProcess;
+
+/*** The mapping core of FAST-LIO2: scan buffers, filter and map of one mapping session
+     Nothing in here talks to ROS, so the node (laserMapping.cpp) and the offline runner (run_mapping_offline.cpp)
+     drive it the same way: the callbacks fill the buffers, then every synced scan goes through
+         sync_packages -> process_imu -> prepare_update -> update -> map_incremental
+     The stages are separate calls so the caller can time them or overlap map_incremental with the next scan. ***/
+class LaserMapper
+{
+public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    LaserMapper();
+
+    /* Reads the mapping parameters from anything with the NodeHandle::param interface:
+       the node passes its NodeHandle, the offline runner a yaml file. Call init() afterwards. */
+    template<typename ParamSource>
+    void read_params(const ParamSource &nh);
+    void init();
+
+    /*** buffer the sensor data, thread safe ***/
+    void standard_pcl_cbk(const sensor_msgs::PointCloud2::ConstPtr &msg);
+    void livox_pcl_cbk(const livox_ros_driver::CustomMsg::ConstPtr &msg);
+    void imu_cbk(const sensor_msgs::Imu::ConstPtr &msg_in);
+
+    /* moves the next scan and its IMU data from the buffers into Measures, false if they are not complete yet */
+    bool sync_packages();
+    /* IMU propagation, undistortion and downsampling of Measures into the given clouds, false for the first scan.
+       Does not touch the map or the current scan, so it may run while map_incremental of the last scan is going on */
+    bool process_imu(PointCloudXYZI::Ptr &undistort, PointCloudXYZI::Ptr &down_body);
+    /* makes the clouds the current scan, moves the local map and builds the first map, false if the scan is not matched */
+    bool prepare_update(const PointCloudXYZI::Ptr &undistort, const PointCloudXYZI::Ptr &down_body);
+    /* iterated EKF update of the current scan against the map */
+    void update();
+    /* adds the current scan to the map */
+    void map_incremental();
+
+    void pointBodyToWorld(PointType const * const pi, PointType * const po) const;
+    template<typename T>
+    void pointBodyToWorld(const Matrix<T, 3, 1> &pi, Matrix<T, 3, 1> &po) const;
+
+    /*** parameters ***/
+    string lid_topic, imu_topic;
+    bool   time_sync_en = false, extrinsic_est_en = true, ikdtree_snapshot_en = false;
+    double time_diff_lidar_to_imu = 0.0;
+    double gyr_cov = 0.1, acc_cov = 0.1, b_gyr_cov = 0.0001, b_acc_cov = 0.0001;
+    double filter_size_corner_min = 0, filter_size_surf_min = 0, filter_size_map_min = 0, fov_deg = 0;
+    double cube_len = 0, HALF_FOV_COS = 0, FOV_DEG = 0;
+    float  DET_RANGE = 300.0f;
+    int    NUM_MAX_ITERATIONS = 0;
+    vector<double> extrinT = vector<double>(3, 0.0);
+    vector<double> extrinR = vector<double>(9, 0.0);
+
+    shared_ptr<Preprocess> p_pre;
+    shared_ptr<ImuProcess> p_imu;
+
+    /*** sensor buffers ***/
+    mutex mtx_buffer;
+    condition_variable sig_buffer;
+    deque<double>                     time_buffer;
+    deque<PointCloudXYZI::Ptr>        lidar_buffer;
+    deque<sensor_msgs::Imu::ConstPtr> imu_buffer;
+    double last_timestamp_lidar = 0, last_timestamp_imu = -1.0;
+    double timediff_lidar_wrt_imu = 0.0;
+    bool   timediff_set_flg = false;
+    int    scan_count = 0;
+    double preprocess_time = 0.0;       // of the last scan callback
+
+    /*** EKF inputs and output ***/
+    MeasureGroup Measures;
+    esekfom::esekf<state_ikfom, 12, input_ikfom> kf;
+    state_ikfom state_point;
+    vect3 pos_lid;
+    V3D euler_cur;
+    double lidar_end_time = 0, first_lidar_time = 0.0;
+    bool   flg_first_scan = true, flg_EKF_inited = false;
+
+    /*** current scan ***/
+    PointCloudXYZI::Ptr feats_undistort;
+    PointCloudXYZI::Ptr feats_down_body;
+    PointCloudXYZI::Ptr feats_down_world;
+    PointCloudXYZI::Ptr normvec;
+    PointCloudXYZI::Ptr featsFromMap;
+    int    feats_down_size = 0, effct_feat_num = 0;
+    double res_mean_last = 0.05, total_residual = 0.0;
+    vector<PointVector>  Nearest_Points;
+    PointVector          batch_nearest_points;
+    vector<float>        batch_nearest_dis;
+    vector<int>          batch_nearest_num;
+    bool   point_selected_surf[100000];
+    float  res_last[100000];
+
+    /*** map ***/
+    KD_TREE<PointType> ikdtree;
+    pcl::VoxelGrid<PointType> downSizeFilterSurf;
+
+    /*** time log of the last scan ***/
+    double kdtree_incremental_time = 0.0, kdtree_search_time = 0.0, kdtree_delete_time = 0.0;
+    double match_time = 0, solve_time = 0, solve_const_H_time = 0, solve_H_time = 0;
+    int    kdtree_size_st = 0, add_point_size = 0, kdtree_delete_counter = 0;
+
+private:
+    void h_share_model(state_ikfom &s, esekfom::dyn_share_datastruct<double> &ekfom_data);
+    void lasermap_fov_segment();
+    void points_cache_collect();
+
+    double lidar_mean_scantime = 0.0;
+    int    scan_num = 0;
+    bool   lidar_pushed = false;
+    uint64_t solve_start_ns = 0;        // end of the last match span, 0 outside the filter iterations
+
+    vector<BoxPointType> cub_needrm;
+    BoxPointType LocalMap_Points;
+    bool Localmap_Initialized = false;
+    V3F XAxisPoint_body = V3F(LIDAR_SP_LEN, 0.0, 0.0);
+    V3F XAxisPoint_world = V3F(LIDAR_SP_LEN, 0.0, 0.0);
+};
+
+template<typename ParamSource>
+void LaserMapper::read_params(const ParamSource &nh)
+{
+    nh.template param<int>("max_iteration",NUM_MAX_ITERATIONS,4);
+    nh.template param<string>("common/lid_topic",lid_topic,"/livox/lidar");
+    nh.template param<string>("common/imu_topic", imu_topic,"/livox/imu");
+    nh.template param<bool>("common/time_sync_en", time_sync_en, false);
+    nh.template param<double>("common/time_offset_lidar_to_imu", time_diff_lidar_to_imu, 0.0);
+    nh.template param<double>("filter_size_corner",filter_size_corner_min,0.5);
+    nh.template param<double>("filter_size_surf",filter_size_surf_min,0.5);
+    nh.template param<double>("filter_size_map",filter_size_map_min,0.5);
+    nh.template param<double>("cube_side_length",cube_len,200);
+    nh.template param<float>("mapping/det_range",DET_RANGE,300.f);
+    nh.template param<double>("mapping/fov_degree",fov_deg,180);
+    nh.template param<double>("mapping/gyr_cov",gyr_cov,0.1);
+    nh.template param<double>("mapping/acc_cov",acc_cov,0.1);
+    nh.template param<double>("mapping/b_gyr_cov",b_gyr_cov,0.0001);
+    nh.template param<double>("mapping/b_acc_cov",b_acc_cov,0.0001);
+    nh.template param<double>("preprocess/blind", p_pre->blind, 0.01);
+    nh.template param<int>("preprocess/lidar_type", p_pre->lidar_type, AVIA);
+    nh.template param<int>("preprocess/scan_line", p_pre->N_SCANS, 16);
+    nh.template param<int>("preprocess/timestamp_unit", p_pre->time_unit, US);
+    nh.template param<int>("preprocess/scan_rate", p_pre->SCAN_RATE, 10);
+    nh.template param<int>("point_filter_num", p_pre->point_filter_num, 2);
+    nh.template param<bool>("feature_extract_enable", p_pre->feature_enabled, false);
+    nh.template param<bool>("mapping/extrinsic_est_en", extrinsic_est_en, true);
+    nh.template param<bool>("mapping/ikdtree_snapshot_search", ikdtree_snapshot_en, false);
+    nh.template param<vector<double>>("mapping/extrinsic_T", extrinT, vector<double>());
+    nh.template param<vector<double>>("mapping/extrinsic_R", extrinR, vector<double>());
+}
+
+template<typename T>
+void LaserMapper::pointBodyToWorld(const Matrix<T, 3, 1> &pi, Matrix<T, 3, 1> &po) const
+{
+    V3D p_body(pi[0], pi[1], pi[2]);
+    V3D p_global(state_point.rot * (state_point.offset_R_L_I*p_body + state_point.offset_T_L_I) + state_point.pos);
+
+    po[0] = p_global(0);
+    po[1] = p_global(1);
+    po[2] = p_global(2);
+}
+
+#endif
@@ -191,9 +191,14 @@ void Preprocess::oust64_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
   pl_surf.clear();
   pl_corn.clear();
   pl_full.clear();
-  pcl::PointCloud<ouster_ros::Point> pl_orig;
-  pcl::fromROSMsg(*msg, pl_orig);
-  int plsize = pl_orig.size();
+  CloudReader<OUST64> cloud;
+  if (!cloud.reset(*msg))
+  {
+    ROS_WARN("Unexpected point fields in the Ouster point cloud");
+    return;
+  }
+  CloudReader<OUST64>::RawPoint pt;
+  int plsize = cloud.size();
   pl_corn.reserve(plsize);
   pl_surf.reserve(plsize);
   if (feature_enabled)
@@ -206,14 +211,15 @@ void Preprocess::oust64_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
 
     for (uint i = 0; i < plsize; i++)
     {
-      double range = pl_orig.points[i].x * pl_orig.points[i].x + pl_orig.points[i].y * pl_orig.points[i].y + pl_orig.points[i].z * pl_orig.points[i].z;
+      cloud.read(i, pt);
+      double range = pt.x * pt.x + pt.y * pt.y + pt.z * pt.z;
       if (range < (blind * blind)) continue;
       Eigen::Vector3d pt_vec;
       PointType added_pt;
-      added_pt.x = pl_orig.points[i].x;
-      added_pt.y = pl_orig.points[i].y;
-      added_pt.z = pl_orig.points[i].z;
-      added_pt.intensity = pl_orig.points[i].intensity;
+      added_pt.x = pt.x;
+      added_pt.y = pt.y;
+      added_pt.z = pt.z;
+      added_pt.intensity = pt.intensity;
       added_pt.normal_x = 0;
       added_pt.normal_y = 0;
       added_pt.normal_z = 0;
@@ -223,10 +229,10 @@ void Preprocess::oust64_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
       if (yaw_angle <= -180.0)
         yaw_angle += 360.0;
 
-      added_pt.curvature = pl_orig.points[i].t * time_unit_scale;
-      if(pl_orig.points[i].ring < N_SCANS)
+      added_pt.curvature = pt.time * time_unit_scale;
+      if(pt.ring < N_SCANS)
       {
-        pl_buff[pl_orig.points[i].ring].push_back(added_pt);
+        pl_buff[pt.ring].push_back(added_pt);
       }
     }
 
@@ -255,24 +261,23 @@ void Preprocess::oust64_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
     double time_stamp = msg->header.stamp.toSec();
     // cout << "===================================" << endl;
     // printf("Pt size = %d, N_SCANS = %d\r\n", plsize, N_SCANS);
-    for (int i = 0; i < pl_orig.points.size(); i++)
+    for (int i = 0; i < plsize; i += point_filter_num)
     {
-      if (i % point_filter_num != 0) continue;
-
-      double range = pl_orig.points[i].x * pl_orig.points[i].x + pl_orig.points[i].y * pl_orig.points[i].y + pl_orig.points[i].z * pl_orig.points[i].z;
+      cloud.read(i, pt);
+      double range = pt.x * pt.x + pt.y * pt.y + pt.z * pt.z;
       
       if (range < (blind * blind)) continue;
       
       Eigen::Vector3d pt_vec;
       PointType added_pt;
-      added_pt.x = pl_orig.points[i].x;
-      added_pt.y = pl_orig.points[i].y;
-      added_pt.z = pl_orig.points[i].z;
-      added_pt.intensity = pl_orig.points[i].intensity;
+      added_pt.x = pt.x;
+      added_pt.y = pt.y;
+      added_pt.z = pt.z;
+      added_pt.intensity = pt.intensity;
       added_pt.normal_x = 0;
       added_pt.normal_y = 0;
       added_pt.normal_z = 0;
-      added_pt.curvature = pl_orig.points[i].t * time_unit_scale; // curvature unit: ms
+      added_pt.curvature = pt.time * time_unit_scale; // curvature unit: ms
 
       pl_surf.points.push_back(added_pt);
     }
@@ -287,10 +292,17 @@ void Preprocess::velodyne_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
     pl_corn.clear();
     pl_full.clear();
 
-    pcl::PointCloud<velodyne_ros::Point> pl_orig;
-    pcl::fromROSMsg(*msg, pl_orig);
-    int plsize = pl_orig.points.size();
+    CloudReader<VELO16> cloud;
+    if (!cloud.reset(*msg))
+    {
+      ROS_WARN("Unexpected point fields in the Velodyne point cloud");
+      return;
+    }
+    CloudReader<VELO16>::RawPoint pt, pt_first, pt_last;
+    int plsize = cloud.size();
     if (plsize == 0) return;
+    cloud.read(0, pt_first);
+    cloud.read(plsize - 1, pt_last);
     pl_surf.reserve(plsize);
 
     /*** These variables only works when no point timestamps given ***/
@@ -301,21 +313,22 @@ void Preprocess::velodyne_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
     std::vector<float> time_last(N_SCANS, 0.0);  // last offset time
     /*****************************************************************/
 
-    if (pl_orig.points[plsize - 1].time > 0)
+    if (pt_last.time > 0)
     {
       given_offset_time = true;
     }
     else
     {
       given_offset_time = false;
-      double yaw_first = atan2(pl_orig.points[0].y, pl_orig.points[0].x) * 57.29578;
+      double yaw_first = atan2(pt_first.y, pt_first.x) * 57.29578;
       double yaw_end  = yaw_first;
-      int layer_first = pl_orig.points[0].ring;
+      int layer_first = pt_first.ring;
       for (uint i = plsize - 1; i > 0; i--)
       {
-        if (pl_orig.points[i].ring == layer_first)
+        cloud.read(i, pt);
+        if (pt.ring == layer_first)
         {
-          yaw_end = atan2(pl_orig.points[i].y, pl_orig.points[i].x) * 57.29578;
+          yaw_end = atan2(pt.y, pt.x) * 57.29578;
           break;
         }
       }
@@ -331,17 +344,18 @@ void Preprocess::velodyne_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
       
       for (int i = 0; i < plsize; i++)
       {
+        cloud.read(i, pt);
         PointType added_pt;
         added_pt.normal_x = 0;
         added_pt.normal_y = 0;
         added_pt.normal_z = 0;
-        int layer  = pl_orig.points[i].ring;
+        int layer  = pt.ring;
         if (layer >= N_SCANS) continue;
-        added_pt.x = pl_orig.points[i].x;
-        added_pt.y = pl_orig.points[i].y;
-        added_pt.z = pl_orig.points[i].z;
-        added_pt.intensity = pl_orig.points[i].intensity;
-        added_pt.curvature = pl_orig.points[i].time * time_unit_scale; // units: ms
+        added_pt.x = pt.x;
+        added_pt.y = pt.y;
+        added_pt.z = pt.z;
+        added_pt.intensity = pt.intensity;
+        added_pt.curvature = pt.time * time_unit_scale; // units: ms
 
         if (!given_offset_time)
         {
@@ -400,21 +414,23 @@ void Preprocess::velodyne_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
     {
       for (int i = 0; i < plsize; i++)
       {
+        if (given_offset_time && i % point_filter_num != 0) continue;
+        cloud.read(i, pt);
         PointType added_pt;
         // cout<<"!!!!!!"<<i<<" "<<plsize<<endl;
         
         added_pt.normal_x = 0;
         added_pt.normal_y = 0;
         added_pt.normal_z = 0;
-        added_pt.x = pl_orig.points[i].x;
-        added_pt.y = pl_orig.points[i].y;
-        added_pt.z = pl_orig.points[i].z;
-        added_pt.intensity = pl_orig.points[i].intensity;
-        added_pt.curvature = pl_orig.points[i].time * time_unit_scale;  // curvature unit: ms // cout<<added_pt.curvature<<endl;
+        added_pt.x = pt.x;
+        added_pt.y = pt.y;
+        added_pt.z = pt.z;
+        added_pt.intensity = pt.intensity;
+        added_pt.curvature = pt.time * time_unit_scale;  // curvature unit: ms // cout<<added_pt.curvature<<endl;
 
         if (!given_offset_time)
         {
-          int layer = pl_orig.points[i].ring;
+          int layer = pt.ring;
           double yaw_angle = atan2(added_pt.y, added_pt.x) * 57.2957;
 
           if (is_first[layer])
@@ -463,10 +479,17 @@ void Preprocess::hesai_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
     pl_corn.clear();
     pl_full.clear();
 
-    pcl::PointCloud<hesai_ros::Point> pl_orig;
-    pcl::fromROSMsg(*msg, pl_orig);
-    int plsize = pl_orig.points.size();
+    CloudReader<HESAI> cloud;
+    if (!cloud.reset(*msg))
+    {
+      ROS_WARN("Unexpected point fields in the Hesai point cloud");
+      return;
+    }
+    CloudReader<HESAI>::RawPoint pt, pt_first, pt_last;
+    int plsize = cloud.size();
     if (plsize == 0) return;
+    cloud.read(0, pt_first);
+    cloud.read(plsize - 1, pt_last);
     pl_surf.reserve(plsize);
 
     /*** These variables only works when no point timestamps given ***/
@@ -477,46 +500,49 @@ void Preprocess::hesai_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
     std::vector<float> time_last(N_SCANS, 0.0);  // last offset time
     /*****************************************************************/
 
-    if (pl_orig.points[plsize - 1].timestamp > 0)
+    if (pt_last.time > 0)
     {
       given_offset_time = true;
     }
     else
     {
       given_offset_time = false;
-      double yaw_first = atan2(pl_orig.points[0].y, pl_orig.points[0].x) * 57.29578;
+      double yaw_first = atan2(pt_first.y, pt_first.x) * 57.29578;
       double yaw_end  = yaw_first;
-      int layer_first = pl_orig.points[0].ring;
+      int layer_first = pt_first.ring;
       for (uint i = plsize - 1; i > 0; i--)
       {
-        if (pl_orig.points[i].ring == layer_first)
+        cloud.read(i, pt);
+        if (pt.ring == layer_first)
         {
-          yaw_end = atan2(pl_orig.points[i].y, pl_orig.points[i].x) * 57.29578;
+          yaw_end = atan2(pt.y, pt.x) * 57.29578;
           break;
         }
       }
     }
 
 
-    const double time_begin = pl_orig.points[0].timestamp;
+    const double time_begin = pt_first.time;
 
     for (int i = 0; i < plsize; i++)
     {
+      if (given_offset_time && i % point_filter_num != 0) continue;
+      cloud.read(i, pt);
       PointType added_pt;
       // cout<<"!!!!!!"<<i<<" "<<plsize<<endl;
       
       added_pt.normal_x = 0;
       added_pt.normal_y = 0;
       added_pt.normal_z = 0;
-      added_pt.x = -  pl_orig.points[i].y;
-      added_pt.y = pl_orig.points[i].x;
-      added_pt.z = pl_orig.points[i].z;
-      added_pt.intensity = pl_orig.points[i].intensity;
-      added_pt.curvature = (pl_orig.points[i].timestamp - time_begin) * time_unit_scale;  // curvature unit: ms // cout<<added_pt.curvature<<endl;
+      added_pt.x = -  pt.y;
+      added_pt.y = pt.x;
+      added_pt.z = pt.z;
+      added_pt.intensity = pt.intensity;
+      added_pt.curvature = (pt.time - time_begin) * time_unit_scale;  // curvature unit: ms // cout<<added_pt.curvature<<endl;
 
       if (!given_offset_time)
       {
-        int layer = pl_orig.points[i].ring;
+        int layer = pt.ring;
         double yaw_angle = atan2(added_pt.y, added_pt.x) * 57.2957;
 
         if (is_first[layer])
@@ -1,3 +1,4 @@
+#pragma once
 #include <ros/ros.h>
 #include <pcl_conversions/pcl_conversions.h>
 #include <sensor_msgs/PointCloud2.h>
@@ -101,6 +102,112 @@ POINT_CLOUD_REGISTER_POINT_STRUCT(ouster_ros::Point,
     (std::uint16_t, ambient, ambient)
     (std::uint32_t, range, range)
 )
+// clang-format on
+
+/*** Point layout of each lidar driver, only the fields used by Preprocess ***/
+template <int LidarType> struct LidarFields;
+
+template <> struct LidarFields<VELO16>
+{
+  typedef float    TimeT;
+  typedef uint16_t RingT;
+  static const char *time_name() { return "time"; }
+};
+
+template <> struct LidarFields<OUST64>
+{
+  typedef uint32_t TimeT;
+  typedef uint8_t  RingT;
+  static const char *time_name() { return "t"; }
+};
+
+template <> struct LidarFields<HESAI>
+{
+  typedef double   TimeT;
+  typedef uint16_t RingT;
+  static const char *time_name() { return "timestamp"; }
+};
+
+template <typename T> struct PointFieldType;
+template <> struct PointFieldType<uint8_t>  { static const uint8_t value = sensor_msgs::PointField::UINT8; };
+template <> struct PointFieldType<uint16_t> { static const uint8_t value = sensor_msgs::PointField::UINT16; };
+template <> struct PointFieldType<uint32_t> { static const uint8_t value = sensor_msgs::PointField::UINT32; };
+template <> struct PointFieldType<float>    { static const uint8_t value = sensor_msgs::PointField::FLOAT32; };
+template <> struct PointFieldType<double>   { static const uint8_t value = sensor_msgs::PointField::FLOAT64; };
+
+/*** Reads the points of a PointCloud2 in place
+     The field offsets are looked up once per message, every point is then read straight from the message buffer
+     instead of going through pcl::fromROSMsg and an intermediate cloud. Like the pcl conversion, a field that is
+     missing or has another type than the driver point reads as 0. ***/
+template <int LidarType>
+class CloudReader
+{
+  public:
+  typedef typename LidarFields<LidarType>::TimeT TimeT;
+  typedef typename LidarFields<LidarType>::RingT RingT;
+
+  struct RawPoint
+  {
+    float x, y, z, intensity;
+    TimeT time;
+    RingT ring;
+  };
+
+  /* false if x, y or z is not there as float */
+  bool reset(const sensor_msgs::PointCloud2 &msg)
+  {
+    data = msg.data.data();
+    width = msg.width;
+    height = msg.height;
+    point_step = msg.point_step;
+    row_step = msg.row_step;
+    if (msg.data.size() < size_t(row_step) * height) return false;
+
+    off_x = off_y = off_z = off_intensity = off_time = off_ring = -1;
+    for (const auto &f : msg.fields)
+    {
+      if      (f.name == "x")         off_x = field_offset<float>(f);
+      else if (f.name == "y")         off_y = field_offset<float>(f);
+      else if (f.name == "z")         off_z = field_offset<float>(f);
+      else if (f.name == "intensity") off_intensity = field_offset<float>(f);
+      else if (f.name == LidarFields<LidarType>::time_name()) off_time = field_offset<TimeT>(f);
+      else if (f.name == "ring")      off_ring = field_offset<RingT>(f);
+    }
+    return off_x >= 0 && off_y >= 0 && off_z >= 0;
+  }
+
+  size_t size() const { return size_t(width) * height; }
+
+  inline void read(size_t i, RawPoint &pt) const
+  {
+    const uint8_t *p = data + (i / width) * row_step + (i % width) * point_step;
+    memcpy(&pt.x, p + off_x, sizeof(float));
+    memcpy(&pt.y, p + off_y, sizeof(float));
+    memcpy(&pt.z, p + off_z, sizeof(float));
+    get(p, off_intensity, pt.intensity);
+    get(p, off_time, pt.time);
+    get(p, off_ring, pt.ring);
+  }
+
+  private:
+  template <typename T>
+  int field_offset(const sensor_msgs::PointField &f) const
+  {
+    if (f.datatype != PointFieldType<T>::value || f.offset + sizeof(T) > point_step) return -1;
+    return f.offset;
+  }
+
+  template <typename T>
+  static inline void get(const uint8_t *p, int offset, T &value)
+  {
+    if (offset < 0) value = T(0);
+    else memcpy(&value, p + offset, sizeof(T));
+  }
+
+  const uint8_t *data = nullptr;
+  uint32_t width = 0, height = 0, point_step = 0, row_step = 0;
+  int off_x = -1, off_y = -1, off_z = -1, off_intensity = -1, off_time = -1, off_ring = -1;
+};
 
 class Preprocess
 {
@@ -0,0 +1,235 @@
+/*** Offline runner of FAST-LIO2
+ *
+ * Reads a bag straight from disk and feeds it to a LaserMapper as fast as the mapping goes, no roscore needed.
+ *     fastlio_offline <config.yaml> <input.bag> [output_prefix] [name:=value ...]
+ * The parameters are read from the yaml file like rosparam would load it. Parameters the launch files set with
+ * <param> (point_filter_num, max_iteration, filter_size_surf, ...) can be put at the top level of the yaml or given
+ * as name:=value, e.g. point_filter_num:=4 mapping/extrinsic_est_en:=false.
+ *
+ * Every scan runs all stages in order on this thread, so two runs over the same bag give the same trajectory.
+ * Output, output_prefix defaults to Log/<bag name>:
+ *     <prefix>_traj.txt       pose at every scan end, TUM format (time x y z qx qy qz qw)
+ *     <prefix>_latency.csv    count, mean and percentiles of every stage
+ *     <prefix>_histogram.csv  the non-empty histogram buckets of every stage
+ *     <prefix>_trace.json     spans and counters of the last scans, see trace.h ***/
+#include <omp.h>
+#include <cstdio>
+#include <csignal>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <yaml-cpp/yaml.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include "mapper.h"
+#include "latency_histogram.h"
+#include "trace.h"
+
+/*** NodeHandle::param on top of a yaml file, "mapping/det_range" is the key det_range in the map mapping ***/
+class YamlParams
+{
+public:
+    explicit YamlParams(const string &file) : root(YAML::LoadFile(file)) {}
+
+    /* value is parsed as yaml, like the right hand side of the config file */
+    void set(const string &name, const string &value) { overrides[name] = value; }
+
+    template<typename T>
+    bool param(const string &name, T &value, const T &default_value) const
+    {
+        auto it = overrides.find(name);
+        const YAML::Node node = it != overrides.end() ? YAML::Load(it->second) : find(root, name);
+        if (!node.IsDefined() || node.IsNull())
+        {
+            value = default_value;
+            return false;
+        }
+        value = node.as<T>();
+        return true;
+    }
+
+private:
+    static YAML::Node find(const YAML::Node &node, const string &name)
+    {
+        if (!node.IsDefined() || !node.IsMap()) return YAML::Node(YAML::NodeType::Undefined);
+        const size_t slash = name.find('/');
+        if (slash == string::npos) return node[name];
+        return find(node[name.substr(0, slash)], name.substr(slash + 1));
+    }
+
+    YAML::Node root;
+    map<string, string> overrides;
+};
+
+enum Stage {PREPROCESS = 0, IMU_PROCESS, PREPARE_UPDATE, UPDATE, MATCH, MAP_INCREMENTAL, SCAN_TOTAL, STAGE_NUM};
+const char *stage_names[STAGE_NUM] = {"preprocess", "imu_undistort_downsample", "prepare_update", "update", "update/match", "map_incremental", "scan_total"};
+
+bool flg_exit = false;
+void SigHandle(int sig)
+{
+    flg_exit = true;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        printf("usage: %s <config.yaml> <input.bag> [output_prefix] [name:=value ...]\n", argv[0]);
+        return 1;
+    }
+    const string config_file = argv[1], bag_file = argv[2];
+    string bag_name = bag_file.substr(bag_file.find_last_of('/') + 1);
+    bag_name = bag_name.substr(0, bag_name.rfind(".bag"));
+    string out_prefix = string(ROOT_DIR) + "Log/" + bag_name;
+
+    shared_ptr<LaserMapper> p_mapper(new LaserMapper());
+    LaserMapper &mapper = *p_mapper;
+    try
+    {
+        YamlParams params(config_file);
+        for (int i = 3; i < argc; i++)
+        {
+            const string arg = argv[i];
+            const size_t assign = arg.find(":=");
+            if (assign != string::npos) params.set(arg.substr(0, assign), arg.substr(assign + 2));
+            else out_prefix = arg;
+        }
+        mapper.read_params(params);
+    }
+    catch (const YAML::Exception &e)
+    {
+        printf("failed to read the parameters: %s\n", e.what());
+        return 1;
+    }
+    mapper.init();
+
+    rosbag::Bag bag;
+    try
+    {
+        bag.open(bag_file, rosbag::bagmode::Read);
+    }
+    catch (const rosbag::BagException &e)
+    {
+        printf("failed to open %s: %s\n", bag_file.c_str(), e.what());
+        return 1;
+    }
+
+    ofstream fout_traj(out_prefix + "_traj.txt", ios::out);
+    if (!fout_traj)
+    {
+        printf("can not write to %s\n", (out_prefix + "_traj.txt").c_str());
+        return 1;
+    }
+    fout_traj << fixed;
+
+    signal(SIGINT, SigHandle);
+    trace::set_thread_name("offline");
+
+    LatencyHistogram hist[STAGE_NUM];
+    int scan_processed = 0;
+    const double wall_start = omp_get_wtime();
+
+    /* runs every scan that is complete in the buffers through the whole loop */
+    auto run_scans = [&]()
+    {
+        while (mapper.sync_packages())
+        {
+            double t0 = omp_get_wtime();
+            PointCloudXYZI::Ptr feats_undistort(new PointCloudXYZI());
+            PointCloudXYZI::Ptr feats_down_body(new PointCloudXYZI());
+            if (!mapper.process_imu(feats_undistort, feats_down_body)) continue;
+            double t1 = omp_get_wtime();
+            hist[IMU_PROCESS].add((t1 - t0) * 1000);
+
+            bool matched = mapper.prepare_update(feats_undistort, feats_down_body);
+            double t2 = omp_get_wtime();
+            hist[PREPARE_UPDATE].add((t2 - t1) * 1000);
+            if (!matched) continue;
+
+            mapper.update();
+            double t3 = omp_get_wtime();
+            hist[UPDATE].add((t3 - t2) * 1000);
+            hist[MATCH].add(mapper.match_time * 1000);
+
+            mapper.map_incremental();
+            double t4 = omp_get_wtime();
+            hist[MAP_INCREMENTAL].add((t4 - t3) * 1000);
+            hist[SCAN_TOTAL].add((t4 - t0) * 1000);
+
+            const state_ikfom &s = mapper.state_point;
+            fout_traj << setprecision(9) << mapper.lidar_end_time << " " << setprecision(6)
+                      << s.pos(0) << " " << s.pos(1) << " " << s.pos(2) << " "
+                      << s.rot.coeffs()[0] << " " << s.rot.coeffs()[1] << " " << s.rot.coeffs()[2] << " " << s.rot.coeffs()[3] << "\n";
+            scan_processed ++;
+        }
+    };
+
+    const bool livox = mapper.p_pre->lidar_type == AVIA;
+    rosbag::View view(bag, rosbag::TopicQuery(vector<string>{mapper.lid_topic, mapper.imu_topic}));
+    printf("replaying %u messages of %s\n", view.size(), bag_file.c_str());
+    for (const rosbag::MessageInstance &m : view)
+    {
+        if (flg_exit) break;
+        if (m.getTopic() == mapper.imu_topic)
+        {
+            sensor_msgs::Imu::ConstPtr imu_msg = m.instantiate<sensor_msgs::Imu>();
+            if (imu_msg) mapper.imu_cbk(imu_msg);
+        }
+        else if (livox)
+        {
+            livox_ros_driver::CustomMsg::ConstPtr livox_msg = m.instantiate<livox_ros_driver::CustomMsg>();
+            if (!livox_msg) continue;
+            mapper.livox_pcl_cbk(livox_msg);
+            hist[PREPROCESS].add(mapper.preprocess_time * 1000);
+        }
+        else
+        {
+            sensor_msgs::PointCloud2::ConstPtr cloud_msg = m.instantiate<sensor_msgs::PointCloud2>();
+            if (!cloud_msg) continue;
+            mapper.standard_pcl_cbk(cloud_msg);
+            hist[PREPROCESS].add(mapper.preprocess_time * 1000);
+        }
+        run_scans();
+    }
+    const double wall_time = omp_get_wtime() - wall_start;
+    bag.close();
+    fout_traj.close();
+
+    /*** report ***/
+    printf("%d scans in %.3f s, %.1f scans/s\n", scan_processed, wall_time, scan_processed / max(wall_time, 1e-9));
+    printf("%-26s %8s %10s %10s %10s %10s %10s\n", "stage [ms]", "count", "mean", "p50", "p90", "p99", "max");
+    for (int i = 0; i < STAGE_NUM; i++)
+    {
+        const LatencyHistogram &h = hist[i];
+        printf("%-26s %8lu %10.3f %10.3f %10.3f %10.3f %10.3f\n", stage_names[i], (unsigned long)h.count(), h.mean(),
+               h.percentile(0.5), h.percentile(0.9), h.percentile(0.99), h.max());
+    }
+
+    FILE *fp = fopen((out_prefix + "_latency.csv").c_str(), "w");
+    if (fp)
+    {
+        fprintf(fp, "stage, count, mean ms, p50 ms, p90 ms, p99 ms, max ms\n");
+        for (int i = 0; i < STAGE_NUM; i++)
+        {
+            const LatencyHistogram &h = hist[i];
+            fprintf(fp, "%s,%lu,%0.6f,%0.6f,%0.6f,%0.6f,%0.6f\n", stage_names[i], (unsigned long)h.count(), h.mean(),
+                    h.percentile(0.5), h.percentile(0.9), h.percentile(0.99), h.max());
+        }
+        fclose(fp);
+    }
+
+    fp = fopen((out_prefix + "_histogram.csv").c_str(), "w");
+    if (fp)
+    {
+        fprintf(fp, "stage, bucket upper ms, count\n");
+        for (int i = 0; i < STAGE_NUM; i++)
+            for (int b = 0; b < LatencyHistogram::BUCKETS; b++)
+                if (hist[i].bucket(b) > 0) fprintf(fp, "%s,%0.6f,%lu\n", stage_names[i], LatencyHistogram::bucket_upper(b), (unsigned long)hist[i].bucket(b));
+        fclose(fp);
+    }
+    trace::write_chrome_json(out_prefix + "_trace.json");
+    printf("trajectory and latencies written to %s_*\n", out_prefix.c_str());
+
+    return 0;
+}
@@ -8,9 +8,11 @@
 #include <glog/logging.h>
 #include <execution>
 #include <list>
+#include <numeric>
 #include <thread>
 
 #include "eigen_types.h"
+#include "ivox3d_flat_map.hpp"
 #include "ivox3d_node.hpp"
 
 namespace faster_lio {
@@ -18,6 +20,7 @@ namespace faster_lio {
 enum class IVoxNodeType {
     DEFAULT,  // linear ivox
     PHC,      // phc ivox
+    SOA,      // linear ivox, flat open-addressing voxel table and SoA coordinates
 };
 
 /// traits for NodeType
@@ -34,6 +37,11 @@ struct IVoxNodeTypeTraits<IVoxNodeType::PHC, PointT, dim> {
     using NodeType = IVoxNodePhc<PointT, dim>;
 };
 
+template <typename PointT, int dim>
+struct IVoxNodeTypeTraits<IVoxNodeType::SOA, PointT, dim> {
+    using NodeType = IVoxNodeSoa<PointT, dim>;
+};
+
 template <int dim = 3, IVoxNodeType node_type = IVoxNodeType::DEFAULT, typename PointType = pcl::PointXYZ>
 class IVox {
    public:
@@ -61,7 +69,7 @@ class IVox {
      * constructor
      * @param options  ivox options
      */
-    explicit IVox(Options options) : options_(options) {
+    explicit IVox(Options options) : options_(options), flat_grids_(options.capacity_) {
         options_.inv_resolution_ = 1.0 / options_.resolution_;
         GenerateNearbyGrids();
     }
@@ -97,23 +105,37 @@ class IVox {
     /// position to grid
     KeyType Pos2Grid(const PtType& pt) const;
 
+    /// voxel of a grid key, nullptr if it does not exist
+    inline NodeType* FindGrid(const KeyType& key);
+
     Options options_;
     std::unordered_map<KeyType, typename std::list<std::pair<KeyType, NodeType>>::iterator, hash_vec<dim>>
         grids_map_;                                        // voxel hash map
     std::list<std::pair<KeyType, NodeType>> grids_cache_;  // voxel cache
+    IVoxFlatMap<KeyType, NodeType, dim> flat_grids_;       // voxel table, only used by IVoxNodeType::SOA
     std::vector<KeyType> nearby_grids_;                    // nearbys
 };
 
+template <int dim, IVoxNodeType node_type, typename PointType>
+typename IVox<dim, node_type, PointType>::NodeType* IVox<dim, node_type, PointType>::FindGrid(const KeyType& key) {
+    if constexpr (node_type == IVoxNodeType::SOA) {
+        return flat_grids_.Find(key);
+    } else {
+        auto iter = grids_map_.find(key);
+        return iter == grids_map_.end() ? nullptr : &iter->second->second;
+    }
+}
+
 template <int dim, IVoxNodeType node_type, typename PointType>
 bool IVox<dim, node_type, PointType>::GetClosestPoint(const PointType& pt, PointType& closest_pt) {
     std::vector<DistPoint> candidates;
     auto key = Pos2Grid(ToEigen<float, dim>(pt));
     std::for_each(nearby_grids_.begin(), nearby_grids_.end(), [&key, &candidates, &pt, this](const KeyType& delta) {
         auto dkey = key + delta;
-        auto iter = grids_map_.find(dkey);
-        if (iter != grids_map_.end()) {
+        NodeType* node = FindGrid(dkey);
+        if (node != nullptr) {
             DistPoint dist_point;
-            bool found = iter->second->second.NNPoint(pt, dist_point);
+            bool found = node->NNPoint(pt, dist_point);
             if (found) {
                 candidates.emplace_back(dist_point);
             }
@@ -148,12 +170,12 @@ bool IVox<dim, node_type, PointType>::GetClosestPoint(const PointType& pt, Point
 
     for (const KeyType& delta : nearby_grids_) {
         auto dkey = key + delta;
-        auto iter = grids_map_.find(dkey);
-        if (iter != grids_map_.end()) {
+        NodeType* node = FindGrid(dkey);
+        if (node != nullptr) {
 #ifdef INNER_TIMER
             auto t1 = std::chrono::high_resolution_clock::now();
 #endif
-            auto tmp = iter->second->second.KNNPointByCondition(candidates, pt, max_num, max_range);
+            auto tmp = node->KNNPointByCondition(candidates, pt, max_num, max_range);
 #ifdef INNER_TIMER
             auto t2 = std::chrono::high_resolution_clock::now();
             auto knn = std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count();
@@ -205,6 +227,9 @@ bool IVox<dim, node_type, PointType>::GetClosestPoint(const PointType& pt, Point
 
 template <int dim, IVoxNodeType node_type, typename PointType>
 size_t IVox<dim, node_type, PointType>::NumValidGrids() const {
+    if constexpr (node_type == IVoxNodeType::SOA) {
+        return flat_grids_.Size();
+    }
     return grids_map_.size();
 }
 
@@ -255,29 +280,93 @@ bool IVox<dim, node_type, PointType>::GetClosestPoint(const PointVector& cloud,
 
 template <int dim, IVoxNodeType node_type, typename PointType>
 void IVox<dim, node_type, PointType>::AddPoints(const PointVector& points_to_add) {
-    std::for_each(std::execution::unseq, points_to_add.begin(), points_to_add.end(), [this](const auto& pt) {
-        auto key = Pos2Grid(ToEigen<float, dim>(pt));
-
-        auto iter = grids_map_.find(key);
-        if (iter == grids_map_.end()) {
-            PointType center;
-            center.getVector3fMap() = key.template cast<float>() * options_.resolution_;
-
-            grids_cache_.push_front({key, NodeType(center, options_.resolution_)});
-            grids_map_.insert({key, grids_cache_.begin()});
-
-            grids_cache_.front().second.InsertPoint(pt);
+    if (points_to_add.empty()) {
+        return;
+    }
 
-            if (grids_map_.size() >= options_.capacity_) {
-                grids_map_.erase(grids_cache_.back().first);
-                grids_cache_.pop_back();
+    // grid keys of all points
+    std::vector<KeyType> keys(points_to_add.size());
+    std::vector<int> index(points_to_add.size());
+    std::iota(index.begin(), index.end(), 0);
+    std::for_each(std::execution::par_unseq, index.begin(), index.end(),
+                  [&keys, &points_to_add, this](int i) { keys[i] = Pos2Grid(ToEigen<float, dim>(points_to_add[i])); });
+
+    // group the points by voxel, points of one voxel keep their input order
+    std::sort(std::execution::par, index.begin(), index.end(), [&keys](int a, int b) {
+        for (int i = 0; i < dim; ++i) {
+            if (keys[a][i] != keys[b][i]) {
+                return keys[a][i] < keys[b][i];
             }
+        }
+        return a < b;
+    });
+    std::vector<int> group_begin;
+    for (int i = 0; i < index.size(); ++i) {
+        if (i == 0 || keys[index[i]] != keys[index[i - 1]]) {
+            group_begin.emplace_back(i);
+        }
+    }
+    const int num_groups = group_begin.size();
+    group_begin.emplace_back(index.size());
+
+    // voxels are looked up / created serially, once per voxel, in the order of the last point that hits them.
+    // this gives the same LRU order as inserting the points one by one
+    std::vector<int> group_order(num_groups);
+    std::iota(group_order.begin(), group_order.end(), 0);
+    std::sort(group_order.begin(), group_order.end(),
+              [&index, &group_begin](int a, int b) { return index[group_begin[a + 1] - 1] < index[group_begin[b + 1] - 1]; });
+
+    std::vector<NodeType*> group_nodes(num_groups, nullptr);
+    std::vector<uint8_t> group_is_new(num_groups, 0);
+    for (int g : group_order) {
+        const KeyType& key = keys[index[group_begin[g]]];
+        if constexpr (node_type == IVoxNodeType::SOA) {
+            group_is_new[g] = flat_grids_.Find(key) == nullptr;
+            flat_grids_.Touch(key, NodeType());
         } else {
-            iter->second->second.InsertPoint(pt);
-            grids_cache_.splice(grids_cache_.begin(), grids_cache_, iter->second);
-            grids_map_[key] = grids_cache_.begin();
+            auto iter = grids_map_.find(key);
+            if (iter == grids_map_.end()) {
+                grids_cache_.push_front({key, NodeType()});
+                grids_map_.insert({key, grids_cache_.begin()});
+                group_is_new[g] = 1;
+            } else {
+                grids_cache_.splice(grids_cache_.begin(), grids_cache_, iter->second);
+                grids_map_[key] = grids_cache_.begin();
+            }
+            group_nodes[g] = &grids_cache_.front().second;
+        }
+    }
+    if constexpr (node_type == IVoxNodeType::SOA) {
+        // the flat table may move its voxels while growing, so resolve them after all voxels exist
+        for (int g = 0; g < num_groups; ++g) {
+            group_nodes[g] = flat_grids_.Find(keys[index[group_begin[g]]]);
+        }
+    }
+
+    // every voxel is owned by exactly one group, so voxel construction and point insertion run in parallel
+    std::vector<int> groups(num_groups);
+    std::iota(groups.begin(), groups.end(), 0);
+    std::for_each(std::execution::par, groups.begin(), groups.end(), [&, this](int g) {
+        NodeType* node = group_nodes[g];
+        if (group_is_new[g]) {
+            PointType center;
+            center.getVector3fMap() = keys[index[group_begin[g]]].template cast<float>() * options_.resolution_;
+            *node = NodeType(center, options_.resolution_);
+        }
+        for (int i = group_begin[g]; i < group_begin[g + 1]; ++i) {
+            node->InsertPoint(points_to_add[index[i]]);
         }
     });
+
+    // evict the least recently used voxels
+    if constexpr (node_type == IVoxNodeType::SOA) {
+        flat_grids_.Shrink();
+    } else {
+        while (!grids_cache_.empty() && grids_map_.size() >= options_.capacity_) {
+            grids_map_.erase(grids_cache_.back().first);
+            grids_cache_.pop_back();
+        }
+    }
 }
 
 template <int dim, IVoxNodeType node_type, typename PointType>
@@ -289,13 +378,21 @@ template <int dim, IVoxNodeType node_type, typename PointType>
 std::vector<float> IVox<dim, node_type, PointType>::StatGridPoints() const {
     int num = grids_cache_.size(), valid_num = 0, max = 0, min = 100000000;
     int sum = 0, sum_square = 0;
-    for (auto& it : grids_cache_) {
-        int s = it.second.Size();
+    auto stat = [&](const NodeType& node) {
+        int s = node.Size();
         valid_num += s > 0;
         max = s > max ? s : max;
         min = s < min ? s : min;
         sum += s;
         sum_square += s * s;
+    };
+    if constexpr (node_type == IVoxNodeType::SOA) {
+        num = flat_grids_.Size();
+        std::for_each(flat_grids_.Nodes().begin(), flat_grids_.Nodes().end(), stat);
+    } else {
+        for (auto& it : grids_cache_) {
+            stat(it.second);
+        }
     }
     float ave = float(sum) / num;
     float stddev = num > 1 ? sqrt((float(sum_square) - num * ave * ave) / (num - 1)) : 0;
@@ -0,0 +1,167 @@
+#ifndef FASTER_LIO_IVOX3D_FLAT_MAP_H
+#define FASTER_LIO_IVOX3D_FLAT_MAP_H
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include "eigen_types.h"
+
+namespace faster_lio {
+
+/**
+ * Voxel container used by the SOA ivox node type
+ *
+ * Voxels are kept in one flat array, sorted by the morton code of their key every time the map is compacted, and are
+ * found through an open-addressing (linear probing) index table. Instead of moving a list element on every insert,
+ * each voxel records the tick of its last insertion; when the capacity is reached the least recently updated voxels
+ * are dropped in one batch.
+ */
+template <typename KeyType, typename NodeType, int dim>
+class IVoxFlatMap {
+   public:
+    explicit IVoxFlatMap(std::size_t capacity = 1000000) : capacity_(capacity) { Rehash(1024); }
+
+    void SetCapacity(std::size_t capacity) { capacity_ = capacity; }
+
+    /// find the voxel of a key, nullptr if it does not exist
+    inline NodeType* Find(const KeyType& key) {
+        std::size_t slot = Slot(key);
+        while (table_[slot] >= 0) {
+            if (keys_[table_[slot]] == key) {
+                return &nodes_[table_[slot]];
+            }
+            slot = (slot + 1) & mask_;
+        }
+        return nullptr;
+    }
+
+    /// find the voxel of a key or create it from init_node, and mark it as recently used
+    NodeType& Touch(const KeyType& key, const NodeType& init_node) {
+        std::size_t slot = Slot(key);
+        while (table_[slot] >= 0) {
+            if (keys_[table_[slot]] == key) {
+                ticks_[table_[slot]] = ++tick_;
+                return nodes_[table_[slot]];
+            }
+            slot = (slot + 1) & mask_;
+        }
+
+        if ((nodes_.size() + 1) * 2 > table_.size()) {
+            // grow the table and take the chance to restore the morton order
+            table_.resize(table_.size() * 2);
+            SortByMorton();
+            return Touch(key, init_node);
+        }
+
+        table_[slot] = static_cast<int>(nodes_.size());
+        keys_.emplace_back(key);
+        nodes_.emplace_back(init_node);
+        ticks_.emplace_back(++tick_);
+        return nodes_.back();
+    }
+
+    /// drop the least recently updated voxels once the capacity is reached, keeping 90% of the capacity
+    /// all references returned by Find / Touch are invalidated
+    void Shrink() {
+        if (nodes_.size() < capacity_) {
+            return;
+        }
+
+        std::size_t keep_num = capacity_ - capacity_ / 10;
+        std::vector<int> order(nodes_.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::nth_element(order.begin(), order.begin() + keep_num, order.end(),
+                         [this](int a, int b) { return ticks_[a] > ticks_[b]; });
+        order.resize(keep_num);
+        Compact(order);
+    }
+
+    /// reorder the voxels along the morton curve so that neighbouring voxels are close in memory
+    void SortByMorton() {
+        std::vector<int> order(nodes_.size());
+        std::iota(order.begin(), order.end(), 0);
+        Compact(order);
+    }
+
+    std::size_t Size() const { return nodes_.size(); }
+
+    const std::vector<NodeType>& Nodes() const { return nodes_; }
+
+   private:
+    inline std::size_t Slot(const KeyType& key) const {
+        return (uint64_t(hash_vec<dim>()(key)) * 11400714819323198485ull) >> shift_;
+    }
+
+    static uint64_t MortonCode(const KeyType& key) {
+        constexpr int bits = 64 / dim;
+        uint64_t code = 0;
+        for (int b = 0; b < bits; ++b) {
+            for (int i = 0; i < dim; ++i) {
+                uint64_t v = uint64_t(int64_t(key[i]) + (int64_t(1) << (bits - 1)));
+                code |= ((v >> b) & 1ull) << (b * dim + i);
+            }
+        }
+        return code;
+    }
+
+    /// keep the voxels listed in order, sorted by morton code, and rebuild the index table
+    void Compact(std::vector<int>& order) {
+        std::vector<uint64_t> codes(keys_.size());
+        for (int idx : order) {
+            codes[idx] = MortonCode(keys_[idx]);
+        }
+        std::sort(order.begin(), order.end(), [&codes](int a, int b) { return codes[a] < codes[b]; });
+
+        std::vector<KeyType> keys;
+        std::vector<NodeType> nodes;
+        std::vector<uint64_t> ticks;
+        keys.reserve(order.size());
+        nodes.reserve(order.size());
+        ticks.reserve(order.size());
+        for (int idx : order) {
+            keys.emplace_back(keys_[idx]);
+            nodes.emplace_back(std::move(nodes_[idx]));
+            ticks.emplace_back(ticks_[idx]);
+        }
+        keys_.swap(keys);
+        nodes_.swap(nodes);
+        ticks_.swap(ticks);
+        Rehash(table_.size());
+    }
+
+    void Rehash(std::size_t table_size) {
+        table_size = std::max<std::size_t>(table_size, 1024);
+        while (table_size < nodes_.size() * 2) {
+            table_size *= 2;
+        }
+        table_.assign(table_size, -1);
+        mask_ = table_size - 1;
+        shift_ = 64;
+        for (std::size_t s = table_size; s > 1; s >>= 1) {
+            shift_--;
+        }
+
+        for (std::size_t i = 0; i < keys_.size(); ++i) {
+            std::size_t slot = Slot(keys_[i]);
+            while (table_[slot] >= 0) {
+                slot = (slot + 1) & mask_;
+            }
+            table_[slot] = static_cast<int>(i);
+        }
+    }
+
+    std::size_t capacity_ = 1000000;
+    std::vector<KeyType> keys_;
+    std::vector<NodeType> nodes_;
+    std::vector<uint64_t> ticks_;
+    std::vector<int> table_;  // index into nodes_, -1 for empty slots
+    std::size_t mask_ = 0;
+    int shift_ = 64;
+    uint64_t tick_ = 0;
+};
+
+}  // namespace faster_lio
+
+#endif
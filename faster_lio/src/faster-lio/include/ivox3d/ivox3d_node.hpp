@@ -1,9 +1,14 @@
 #include <pcl/common/centroid.h>
 #include <algorithm>
 #include <cmath>
+#include <limits>
 #include <list>
 #include <vector>
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #include "hilbert.hpp"
 
 namespace faster_lio {
@@ -101,6 +106,36 @@ class IVoxNodePhc {
     Eigen::Matrix<float, dim, 1> min_cube_;
 };
 
+template <typename PointT, int dim = 3>
+class IVoxNodeSoa {
+   public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW;
+
+    struct DistPoint;
+
+    IVoxNodeSoa() = default;
+    IVoxNodeSoa(const PointT& center, const float& side_length) {}  /// same with phc
+
+    void InsertPoint(const PointT& pt);
+
+    inline bool Empty() const;
+
+    inline std::size_t Size() const;
+
+    inline PointT GetPoint(const std::size_t idx) const;
+
+    bool NNPoint(const PointT& cur_pt, DistPoint& dist_point) const;
+
+    int KNNPointByCondition(std::vector<DistPoint>& dis_points, const PointT& point, const int& K,
+                            const double& max_range);
+
+   private:
+    using FloatVector = std::vector<float, Eigen::aligned_allocator<float>>;
+
+    std::vector<PointT> points_;  // full points, only read when a neighbour is returned
+    FloatVector xs_, ys_, zs_;    // coordinates used for the distance computation
+};
+
 template <typename PointT, int dim>
 struct IVoxNode<PointT, dim>::DistPoint {
     double dist = 0;
@@ -204,6 +239,117 @@ int IVoxNode<PointT, dim>::KNNPointByCondition(std::vector<DistPoint>& dis_point
     return dis_points.size();
 }
 
+template <typename PointT, int dim>
+struct IVoxNodeSoa<PointT, dim>::DistPoint {
+    double dist = 0;
+    IVoxNodeSoa* node = nullptr;
+    int idx = 0;
+
+    DistPoint() = default;
+    DistPoint(const double d, IVoxNodeSoa* n, const int i) : dist(d), node(n), idx(i) {}
+
+    PointT Get() { return node->GetPoint(idx); }
+
+    inline bool operator()(const DistPoint& p1, const DistPoint& p2) { return p1.dist < p2.dist; }
+
+    inline bool operator<(const DistPoint& rhs) { return dist < rhs.dist; }
+};
+
+template <typename PointT, int dim>
+void IVoxNodeSoa<PointT, dim>::InsertPoint(const PointT& pt) {
+    points_.template emplace_back(pt);
+    xs_.emplace_back(pt.x);
+    ys_.emplace_back(pt.y);
+    zs_.emplace_back(pt.z);
+}
+
+template <typename PointT, int dim>
+bool IVoxNodeSoa<PointT, dim>::Empty() const {
+    return points_.empty();
+}
+
+template <typename PointT, int dim>
+std::size_t IVoxNodeSoa<PointT, dim>::Size() const {
+    return points_.size();
+}
+
+template <typename PointT, int dim>
+PointT IVoxNodeSoa<PointT, dim>::GetPoint(const std::size_t idx) const {
+    return points_[idx];
+}
+
+template <typename PointT, int dim>
+bool IVoxNodeSoa<PointT, dim>::NNPoint(const PointT& cur_pt, DistPoint& dist_point) const {
+    if (points_.empty()) {
+        return false;
+    }
+    int best_idx = 0;
+    float best_dist = std::numeric_limits<float>::max();
+    for (std::size_t i = 0; i < xs_.size(); ++i) {
+        float dx = xs_[i] - cur_pt.x, dy = ys_[i] - cur_pt.y, dz = zs_[i] - cur_pt.z;
+        float d = dx * dx + dy * dy + dz * dz;
+        if (d < best_dist) {
+            best_dist = d;
+            best_idx = i;
+        }
+    }
+    dist_point = DistPoint(best_dist, const_cast<IVoxNodeSoa*>(this), best_idx);
+    return true;
+}
+
+template <typename PointT, int dim>
+int IVoxNodeSoa<PointT, dim>::KNNPointByCondition(std::vector<DistPoint>& dis_points, const PointT& point,
+                                                  const int& K, const double& max_range) {
+    std::size_t old_size = dis_points.size();
+    const std::size_t num = xs_.size();
+    const float range2 = max_range * max_range;
+    std::size_t i = 0;
+
+#ifdef __AVX2__
+    const __m256 qx = _mm256_set1_ps(point.x);
+    const __m256 qy = _mm256_set1_ps(point.y);
+    const __m256 qz = _mm256_set1_ps(point.z);
+    const __m256 r2 = _mm256_set1_ps(range2);
+    alignas(32) float dist[8];
+    for (; i + 8 <= num; i += 8) {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(xs_.data() + i), qx);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(ys_.data() + i), qy);
+        __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(zs_.data() + i), qz);
+#ifdef __FMA__
+        __m256 d = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+#else
+        __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+#endif
+        int mask = _mm256_movemask_ps(_mm256_cmp_ps(d, r2, _CMP_LT_OQ));
+        if (mask == 0) {
+            continue;
+        }
+        _mm256_store_ps(dist, d);
+        while (mask) {
+            int lane = __builtin_ctz(mask);
+            dis_points.template emplace_back(DistPoint(dist[lane], this, i + lane));
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i < num; ++i) {
+        float dx = xs_[i] - point.x, dy = ys_[i] - point.y, dz = zs_[i] - point.z;
+        float d = dx * dx + dy * dy + dz * dz;
+        if (d < range2) {
+            dis_points.template emplace_back(DistPoint(d, this, i));
+        }
+    }
+
+    // sort by distance
+    if (old_size + K < dis_points.size()) {
+        std::nth_element(dis_points.begin() + old_size, dis_points.begin() + old_size + K - 1, dis_points.end());
+        dis_points.resize(old_size + K);
+    }
+
+    return dis_points.size();
+}
+
 template <typename PointT, int dim>
 struct IVoxNodePhc<PointT, dim>::DistPoint {
     double dist = 0;
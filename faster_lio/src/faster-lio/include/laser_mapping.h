@@ -22,6 +22,8 @@ class LaserMapping {
 
 #ifdef IVOX_NODE_TYPE_PHC
     using IVoxType = IVox<3, IVoxNodeType::PHC, PointType>;
+#elif defined(IVOX_NODE_TYPE_SOA)
+    using IVoxType = IVox<3, IVoxNodeType::SOA, PointType>;
 #else
     using IVoxType = IVox<3, IVoxNodeType::DEFAULT, PointType>;
 #endif
@@ -45,6 +45,8 @@ bool LaserMapping::InitWithoutROS(const std::string &config_yaml) {
         LOG(INFO) << "using phc ivox";
     } else if (std::is_same<IVoxType, IVox<3, IVoxNodeType::DEFAULT, pcl::PointXYZI>>::value == true) {
         LOG(INFO) << "using default ivox";
+    } else if (std::is_same<IVoxType, IVox<3, IVoxNodeType::SOA, pcl::PointXYZI>>::value == true) {
+        LOG(INFO) << "using soa ivox";
     }
 
     return true;
@@ -0,0 +1,218 @@
+#pragma once
+#ifndef _LOCAL_MAP_LIDAR_ODOMETRY_H_
+#define _LOCAL_MAP_LIDAR_ODOMETRY_H_
+
+#include "utility.h"
+
+#include <set>
+#include <unordered_map>
+
+/*
+    * Downsampled feature map of the keyframes around the robot, for scan-to-map matching.
+    *
+    * Every point falls into a voxel of leafSize, the map holds the centroid of each voxel like pcl::VoxelGrid would
+    * give for the union of all keyframe clouds. The sums behind the centroids are kept, so a keyframe is added or
+    * removed by visiting its own points only and the map is searched in place, nothing is concatenated, filtered or
+    * rebuilt per scan.
+    *
+    * For the search the voxels are grouped into cells of about searchCellSize. A nearest neighbor search visits the
+    * cells in growing rings around the point until the k nearest are known or the distance bound is reached.
+    */
+class LocalMap
+{
+public:
+
+    LocalMap() { setLeafSize(0.2, 0.5); }
+
+    void setLeafSize(float leafSize, float searchCellSize)
+    {
+        clear();
+        leaf = leafSize;
+        inverseLeaf = 1.0 / leafSize;
+        cellRatio = std::max(1, (int)std::round(searchCellSize / leafSize));
+        cellSize = cellRatio * leafSize;
+    }
+
+    void clear()
+    {
+        keyFrames.clear();
+        voxels.clear();
+        cells.clear();
+    }
+
+    // keyframe clouds are in the map frame
+    void addKeyFrame(int key, const pcl::PointCloud<PointType>::Ptr& cloud)
+    {
+        if (keyFrames.count(key))
+            removeKeyFrame(key);
+        keyFrames[key] = cloud;
+
+        for (const auto& p : cloud->points)
+        {
+            Key voxelKey = toVoxel(p);
+            auto it = voxels.find(voxelKey);
+            if (it == voxels.end())
+            {
+                it = voxels.emplace(voxelKey, Voxel()).first;
+                cells[toCell(voxelKey)].push_back(&it->second);
+            }
+            Voxel& voxel = it->second;
+            voxel.sum[0] += p.x; voxel.sum[1] += p.y; voxel.sum[2] += p.z; voxel.sum[3] += p.intensity;
+            voxel.count++;
+            voxel.updateCentroid();
+        }
+    }
+
+    void removeKeyFrame(int key)
+    {
+        auto keyFrame = keyFrames.find(key);
+        if (keyFrame == keyFrames.end())
+            return;
+
+        for (const auto& p : keyFrame->second->points)
+        {
+            Key voxelKey = toVoxel(p);
+            auto it = voxels.find(voxelKey);
+            if (it == voxels.end())
+                continue;
+            Voxel& voxel = it->second;
+            voxel.sum[0] -= p.x; voxel.sum[1] -= p.y; voxel.sum[2] -= p.z; voxel.sum[3] -= p.intensity;
+            voxel.count--;
+
+            if (voxel.count > 0)
+            {
+                voxel.updateCentroid();
+                continue;
+            }
+
+            // last point of the voxel is gone
+            Key cellKey = toCell(voxelKey);
+            std::vector<Voxel*>& cell = cells[cellKey];
+            *std::find(cell.begin(), cell.end(), &voxel) = cell.back();
+            cell.pop_back();
+            if (cell.empty())
+                cells.erase(cellKey);
+            voxels.erase(it);
+        }
+
+        keyFrames.erase(keyFrame);
+    }
+
+    bool hasKeyFrame(int key) const { return keyFrames.count(key) > 0; }
+
+    // number of downsampled points
+    int size() const { return voxels.size(); }
+
+    // k nearest downsampled points closer than sqrt(maxSqDis), nearest first
+    int nearestKSearch(const PointType& point, int k, float maxSqDis, std::vector<PointType>& points, std::vector<float>& sqDis) const
+    {
+        points.clear();
+        sqDis.clear();
+
+        Key center = toCell(toVoxel(point));
+        int maxRing = (int)std::ceil(std::sqrt(maxSqDis) / cellSize);
+        for (int ring = 0; ring <= maxRing; ++ring)
+        {
+            for (int dx = -ring; dx <= ring; ++dx)
+            for (int dy = -ring; dy <= ring; ++dy)
+            for (int dz = -ring; dz <= ring; ++dz)
+            {
+                if (std::max(std::abs(dx), std::max(std::abs(dy), std::abs(dz))) != ring)
+                    continue;
+                auto cell = cells.find(Key{center[0] + dx, center[1] + dy, center[2] + dz});
+                if (cell == cells.end())
+                    continue;
+
+                for (const Voxel* voxel : cell->second)
+                {
+                    const PointType& p = voxel->centroid;
+                    float d = (p.x - point.x) * (p.x - point.x) + (p.y - point.y) * (p.y - point.y) + (p.z - point.z) * (p.z - point.z);
+                    if (d >= maxSqDis || ((int)sqDis.size() == k && d >= sqDis.back()))
+                        continue;
+
+                    // insert sorted
+                    int j = std::min((int)sqDis.size(), k - 1);
+                    if ((int)sqDis.size() < k)
+                    {
+                        points.push_back(p);
+                        sqDis.push_back(d);
+                    }
+                    for (; j > 0 && sqDis[j - 1] > d; --j)
+                    {
+                        points[j] = points[j - 1];
+                        sqDis[j] = sqDis[j - 1];
+                    }
+                    points[j] = p;
+                    sqDis[j] = d;
+                }
+            }
+
+            // the cells of the next ring are at least ring * cellSize away
+            float bound = ring * cellSize;
+            if ((int)sqDis.size() == k && sqDis.back() <= bound * bound)
+                break;
+        }
+
+        return sqDis.size();
+    }
+
+    void getCloud(pcl::PointCloud<PointType>& cloud) const
+    {
+        cloud.clear();
+        cloud.reserve(voxels.size());
+        for (const auto& voxel : voxels)
+            cloud.push_back(voxel.second.centroid);
+    }
+
+private:
+
+    typedef std::array<int, 3> Key;
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            return ((size_t)key[0] * 73856093) ^ ((size_t)key[1] * 19349663) ^ ((size_t)key[2] * 83492791);
+        }
+    };
+
+    struct Voxel
+    {
+        double sum[4] = {0, 0, 0, 0};
+        int count = 0;
+        PointType centroid;
+
+        void updateCentroid()
+        {
+            centroid.x = sum[0] / count;
+            centroid.y = sum[1] / count;
+            centroid.z = sum[2] / count;
+            centroid.intensity = sum[3] / count;
+        }
+    };
+
+    Key toVoxel(const PointType& p) const
+    {
+        return Key{(int)std::floor(p.x * inverseLeaf), (int)std::floor(p.y * inverseLeaf), (int)std::floor(p.z * inverseLeaf)};
+    }
+
+    Key toCell(const Key& voxel) const
+    {
+        // floor division, also for negative voxel indices
+        Key cell;
+        for (int i = 0; i < 3; ++i)
+            cell[i] = voxel[i] >= 0 ? voxel[i] / cellRatio : -((-voxel[i] + cellRatio - 1) / cellRatio);
+        return cell;
+    }
+
+    float leaf;
+    float inverseLeaf;
+    int cellRatio;          // voxels per cell edge
+    float cellSize;
+
+    std::unordered_map<int, pcl::PointCloud<PointType>::Ptr> keyFrames;
+    std::unordered_map<Key, Voxel, KeyHash> voxels;         // node based, the cells point into it
+    std::unordered_map<Key, std::vector<Voxel*>, KeyHash> cells;
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include "utility.h"
+#include "localMap.h"
 #include "lio_sam/cloud_info.h"
 #include "lio_sam/save_map.h"
 
@@ -107,14 +108,9 @@ public:
     std::vector<PointType> coeffSelSurfVec;
     std::vector<bool> laserCloudOriSurfFlag;
 
-    map<int, pair<pcl::PointCloud<PointType>, pcl::PointCloud<PointType>>> laserCloudMapContainer;
-    pcl::PointCloud<PointType>::Ptr laserCloudCornerFromMap;
-    pcl::PointCloud<PointType>::Ptr laserCloudSurfFromMap;
-    pcl::PointCloud<PointType>::Ptr laserCloudCornerFromMapDS;
-    pcl::PointCloud<PointType>::Ptr laserCloudSurfFromMapDS;
-
-    pcl::KdTreeFLANN<PointType>::Ptr kdtreeCornerFromMap;
-    pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurfFromMap;
+    LocalMap localMapCorner; // downsampled corner features of the surrounding key frames
+    LocalMap localMapSurf; // downsampled surf features of the surrounding key frames
+    map<int, PointTypePose> localMapKeyPoses; // key frames in the local map and the poses they were added with
 
     pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurroundingKeyPoses;
     pcl::KdTreeFLANN<PointType>::Ptr kdtreeHistoryKeyPoses;
@@ -219,13 +215,9 @@ public:
         std::fill(laserCloudOriCornerFlag.begin(), laserCloudOriCornerFlag.end(), false);
         std::fill(laserCloudOriSurfFlag.begin(), laserCloudOriSurfFlag.end(), false);
 
-        laserCloudCornerFromMap.reset(new pcl::PointCloud<PointType>());
-        laserCloudSurfFromMap.reset(new pcl::PointCloud<PointType>());
-        laserCloudCornerFromMapDS.reset(new pcl::PointCloud<PointType>());
-        laserCloudSurfFromMapDS.reset(new pcl::PointCloud<PointType>());
-
-        kdtreeCornerFromMap.reset(new pcl::KdTreeFLANN<PointType>());
-        kdtreeSurfFromMap.reset(new pcl::KdTreeFLANN<PointType>());
+        localMapCorner.setLeafSize(mappingCornerLeafSize, 0.5);
+        localMapSurf.setLeafSize(mappingSurfLeafSize, 0.5);
+        localMapKeyPoses.clear();
 
         for (int i = 0; i < 6; ++i){
             transformTobeMapped[i] = 0;
@@ -898,43 +890,43 @@ public:
 
     void extractCloud(pcl::PointCloud<PointType>::Ptr cloudToExtract)
     {
-        // fuse the map
-        laserCloudCornerFromMap->clear();
-        laserCloudSurfFromMap->clear(); 
+        // key frames the local map should hold
+        std::set<int> keyFramesToExtract;
         for (int i = 0; i < (int)cloudToExtract->size(); ++i)
         {
             if (pointDistance(cloudToExtract->points[i], cloudKeyPoses3D->back()) > surroundingKeyframeSearchRadius)
                 continue;
+            keyFramesToExtract.insert((int)cloudToExtract->points[i].intensity);
+        }
 
-            int thisKeyInd = (int)cloudToExtract->points[i].intensity;
-            if (laserCloudMapContainer.find(thisKeyInd) != laserCloudMapContainer.end()) 
+        // remove the key frames that left, and the ones whose pose was corrected since they were added
+        for (auto it = localMapKeyPoses.begin(); it != localMapKeyPoses.end(); )
+        {
+            const PointTypePose& pose = cloudKeyPoses6D->points[it->first];
+            bool poseChanged = pose.x != it->second.x || pose.y != it->second.y || pose.z != it->second.z ||
+                               pose.roll != it->second.roll || pose.pitch != it->second.pitch || pose.yaw != it->second.yaw;
+            if (keyFramesToExtract.count(it->first) && !poseChanged)
             {
-                // transformed cloud available
-                *laserCloudCornerFromMap += laserCloudMapContainer[thisKeyInd].first;
-                *laserCloudSurfFromMap   += laserCloudMapContainer[thisKeyInd].second;
-            } else {
-                // transformed cloud not available
-                pcl::PointCloud<PointType> laserCloudCornerTemp = *transformPointCloud(cornerCloudKeyFrames[thisKeyInd],  &cloudKeyPoses6D->points[thisKeyInd]);
-                pcl::PointCloud<PointType> laserCloudSurfTemp = *transformPointCloud(surfCloudKeyFrames[thisKeyInd],    &cloudKeyPoses6D->points[thisKeyInd]);
-                *laserCloudCornerFromMap += laserCloudCornerTemp;
-                *laserCloudSurfFromMap   += laserCloudSurfTemp;
-                laserCloudMapContainer[thisKeyInd] = make_pair(laserCloudCornerTemp, laserCloudSurfTemp);
+                ++it;
+                continue;
             }
-            
+            localMapCorner.removeKeyFrame(it->first);
+            localMapSurf.removeKeyFrame(it->first);
+            it = localMapKeyPoses.erase(it);
         }
 
-        // Downsample the surrounding corner key frames (or map)
-        downSizeFilterCorner.setInputCloud(laserCloudCornerFromMap);
-        downSizeFilterCorner.filter(*laserCloudCornerFromMapDS);
-        laserCloudCornerFromMapDSNum = laserCloudCornerFromMapDS->size();
-        // Downsample the surrounding surf key frames (or map)
-        downSizeFilterSurf.setInputCloud(laserCloudSurfFromMap);
-        downSizeFilterSurf.filter(*laserCloudSurfFromMapDS);
-        laserCloudSurfFromMapDSNum = laserCloudSurfFromMapDS->size();
-
-        // clear map cache if too large
-        if (laserCloudMapContainer.size() > 1000)
-            laserCloudMapContainer.clear();
+        // add the key frames that joined
+        for (int thisKeyInd : keyFramesToExtract)
+        {
+            if (localMapKeyPoses.count(thisKeyInd))
+                continue;
+            localMapCorner.addKeyFrame(thisKeyInd, transformPointCloud(cornerCloudKeyFrames[thisKeyInd], &cloudKeyPoses6D->points[thisKeyInd]));
+            localMapSurf.addKeyFrame(thisKeyInd, transformPointCloud(surfCloudKeyFrames[thisKeyInd], &cloudKeyPoses6D->points[thisKeyInd]));
+            localMapKeyPoses[thisKeyInd] = cloudKeyPoses6D->points[thisKeyInd];
+        }
+
+        laserCloudCornerFromMapDSNum = localMapCorner.size();
+        laserCloudSurfFromMapDSNum = localMapSurf.size();
     }
 
     void extractSurroundingKeyFrames()
@@ -979,31 +971,31 @@ public:
         for (int i = 0; i < laserCloudCornerLastDSNum; i++)
         {
             PointType pointOri, pointSel, coeff;
-            std::vector<int> pointSearchInd;
+            std::vector<PointType> pointSearch;
             std::vector<float> pointSearchSqDis;
 
             pointOri = laserCloudCornerLastDS->points[i];
             pointAssociateToMap(&pointOri, &pointSel);
-            kdtreeCornerFromMap->nearestKSearch(pointSel, 5, pointSearchInd, pointSearchSqDis);
+            localMapCorner.nearestKSearch(pointSel, 5, 1.0, pointSearch, pointSearchSqDis);
 
             cv::Mat matA1(3, 3, CV_32F, cv::Scalar::all(0));
             cv::Mat matD1(1, 3, CV_32F, cv::Scalar::all(0));
             cv::Mat matV1(3, 3, CV_32F, cv::Scalar::all(0));
                     
-            if (pointSearchSqDis[4] < 1.0) {
+            if (pointSearchSqDis.size() == 5) {
                 float cx = 0, cy = 0, cz = 0;
                 for (int j = 0; j < 5; j++) {
-                    cx += laserCloudCornerFromMapDS->points[pointSearchInd[j]].x;
-                    cy += laserCloudCornerFromMapDS->points[pointSearchInd[j]].y;
-                    cz += laserCloudCornerFromMapDS->points[pointSearchInd[j]].z;
+                    cx += pointSearch[j].x;
+                    cy += pointSearch[j].y;
+                    cz += pointSearch[j].z;
                 }
                 cx /= 5; cy /= 5;  cz /= 5;
 
                 float a11 = 0, a12 = 0, a13 = 0, a22 = 0, a23 = 0, a33 = 0;
                 for (int j = 0; j < 5; j++) {
-                    float ax = laserCloudCornerFromMapDS->points[pointSearchInd[j]].x - cx;
-                    float ay = laserCloudCornerFromMapDS->points[pointSearchInd[j]].y - cy;
-                    float az = laserCloudCornerFromMapDS->points[pointSearchInd[j]].z - cz;
+                    float ax = pointSearch[j].x - cx;
+                    float ay = pointSearch[j].y - cy;
+                    float az = pointSearch[j].z - cz;
 
                     a11 += ax * ax; a12 += ax * ay; a13 += ax * az;
                     a22 += ay * ay; a23 += ay * az;
@@ -1071,12 +1063,12 @@ public:
         for (int i = 0; i < laserCloudSurfLastDSNum; i++)
         {
             PointType pointOri, pointSel, coeff;
-            std::vector<int> pointSearchInd;
+            std::vector<PointType> pointSearch;
             std::vector<float> pointSearchSqDis;
 
             pointOri = laserCloudSurfLastDS->points[i];
             pointAssociateToMap(&pointOri, &pointSel); 
-            kdtreeSurfFromMap->nearestKSearch(pointSel, 5, pointSearchInd, pointSearchSqDis);
+            localMapSurf.nearestKSearch(pointSel, 5, 1.0, pointSearch, pointSearchSqDis);
 
             Eigen::Matrix<float, 5, 3> matA0;
             Eigen::Matrix<float, 5, 1> matB0;
@@ -1086,11 +1078,11 @@ public:
             matB0.fill(-1);
             matX0.setZero();
 
-            if (pointSearchSqDis[4] < 1.0) {
+            if (pointSearchSqDis.size() == 5) {
                 for (int j = 0; j < 5; j++) {
-                    matA0(j, 0) = laserCloudSurfFromMapDS->points[pointSearchInd[j]].x;
-                    matA0(j, 1) = laserCloudSurfFromMapDS->points[pointSearchInd[j]].y;
-                    matA0(j, 2) = laserCloudSurfFromMapDS->points[pointSearchInd[j]].z;
+                    matA0(j, 0) = pointSearch[j].x;
+                    matA0(j, 1) = pointSearch[j].y;
+                    matA0(j, 2) = pointSearch[j].z;
                 }
 
                 matX0 = matA0.colPivHouseholderQr().solve(matB0);
@@ -1105,9 +1097,9 @@ public:
 
                 bool planeValid = true;
                 for (int j = 0; j < 5; j++) {
-                    if (fabs(pa * laserCloudSurfFromMapDS->points[pointSearchInd[j]].x +
-                             pb * laserCloudSurfFromMapDS->points[pointSearchInd[j]].y +
-                             pc * laserCloudSurfFromMapDS->points[pointSearchInd[j]].z + pd) > 0.2) {
+                    if (fabs(pa * pointSearch[j].x +
+                             pb * pointSearch[j].y +
+                             pc * pointSearch[j].z + pd) > 0.2) {
                         planeValid = false;
                         break;
                     }
@@ -1286,9 +1278,6 @@ public:
 
         if (laserCloudCornerLastDSNum > edgeFeatureMinValidNum && laserCloudSurfLastDSNum > surfFeatureMinValidNum)
         {
-            kdtreeCornerFromMap->setInputCloud(laserCloudCornerFromMapDS);
-            kdtreeSurfFromMap->setInputCloud(laserCloudSurfFromMapDS);
-
             for (int iterCount = 0; iterCount < 30; iterCount++)
             {
                 laserCloudOri->clear();
@@ -1587,8 +1576,7 @@ public:
 
         if (aLoopIsClosed == true)
         {
-            // clear map cache
-            laserCloudMapContainer.clear();
+            // the local map re-adds the key frames whose pose changed in extractCloud
             // clear path
             globalPath.poses.clear();
             // update key poses
@@ -1708,7 +1696,12 @@ public:
         // publish key poses
         publishCloud(pubKeyPoses, cloudKeyPoses3D, timeLaserInfoStamp, odometryFrame);
         // Publish surrounding key frames
-        publishCloud(pubRecentKeyFrames, laserCloudSurfFromMapDS, timeLaserInfoStamp, odometryFrame);
+        if (pubRecentKeyFrames.getNumSubscribers() != 0)
+        {
+            pcl::PointCloud<PointType>::Ptr localMapOut(new pcl::PointCloud<PointType>());
+            localMapSurf.getCloud(*localMapOut);
+            publishCloud(pubRecentKeyFrames, localMapOut, timeLaserInfoStamp, odometryFrame);
+        }
         // publish registered key frame
         if (pubRecentKeyFrame.getNumSubscribers() != 0)
         {
@@ -1748,8 +1741,10 @@ public:
                 slamInfo.key_frame_cloud = publishCloud(ros::Publisher(), cloudOut, timeLaserInfoStamp, lidarFrame);
                 slamInfo.key_frame_poses = publishCloud(ros::Publisher(), cloudKeyPoses6D, timeLaserInfoStamp, odometryFrame);
                 pcl::PointCloud<PointType>::Ptr localMapOut(new pcl::PointCloud<PointType>());
-                *localMapOut += *laserCloudCornerFromMapDS;
-                *localMapOut += *laserCloudSurfFromMapDS;
+                pcl::PointCloud<PointType> localMapSurfOut;
+                localMapCorner.getCloud(*localMapOut);
+                localMapSurf.getCloud(localMapSurfOut);
+                *localMapOut += localMapSurfOut;
                 slamInfo.key_frame_map = publishCloud(ros::Publisher(), localMapOut, timeLaserInfoStamp, odometryFrame);
                 pubSLAMInfo.publish(slamInfo);
                 lastSLAMInfoPubSize = cloudKeyPoses6D->size();
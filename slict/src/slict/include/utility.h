@@ -48,6 +48,7 @@
 #include <limits>
 #include <iomanip>
 #include <array>
+#include <execution>
 #include <thread>
 #include <random>
 #include <mutex>
@@ -960,7 +961,8 @@ namespace ufo::math
 
 template <typename PointType>
 void insertCloudToSurfelMap(ufo::map::SurfelMap &map,
-                            pcl::PointCloud<PointType> &pclCloud)
+                            pcl::PointCloud<PointType> &pclCloud,
+                            bool propagate = true)
 {
     int cloudSize = pclCloud.size();
 
@@ -975,7 +977,28 @@ void insertCloudToSurfelMap(ufo::map::SurfelMap &map,
         ufoCloud[i].z = (float)pclCloud.points[i].z;
     }
 
-    map.insertSurfelPoint(std::begin(ufoCloud), std::end(ufoCloud));
+    map.insertSurfelPoint(std::execution::par, std::begin(ufoCloud), std::end(ufoCloud), 0, propagate);
+}
+
+template <typename PointType>
+void eraseCloudFromSurfelMap(ufo::map::SurfelMap &map,
+                             pcl::PointCloud<PointType> &pclCloud,
+                             bool propagate = true)
+{
+    int cloudSize = pclCloud.size();
+
+    ufo::map::PointCloud ufoCloud;
+    ufoCloud.resize(cloudSize);
+
+    #pragma omp parallel for num_threads(omp_get_max_threads())
+    for(int i = 0; i < cloudSize; i++)
+    {
+        ufoCloud[i].x = (float)pclCloud.points[i].x;
+        ufoCloud[i].y = (float)pclCloud.points[i].y;
+        ufoCloud[i].z = (float)pclCloud.points[i].z;
+    }
+
+    map.eraseSurfelPoint(std::execution::par, std::begin(ufoCloud), std::end(ufoCloud), 0, propagate);
 }
 
 namespace Util
@@ -29,8 +29,11 @@
 
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
+#include <atomic>
 #include <condition_variable>
 #include <deque>
+#include <filesystem>
+#include <regex>
 #include <thread>
 
 #include <Eigen/Dense>
@@ -216,7 +219,54 @@ private:
     mutex  global_map_mtx;
     TicToc tt_ufmupdt;
     CloudXYZITPtr globalMap;
-    ufoSurfelMap  surfelMap;
+
+    // Surfel map, double buffered. The LIO thread associates with the front map while the back map is updated in
+    // the background after a loop closure. The two are swapped once the update is done.
+    struct SurfelOp
+    {
+        bool erase;
+        CloudXYZITPtr cloud;    // Points in world frame, never modified once in an op
+    };
+    shared_ptr<ufoSurfelMap> surfelMap;         // Front map
+    shared_ptr<ufoSurfelMap> surfelMapBack;     // Back map
+    vector<SurfelOp> surfelMapBackPending;      // Updates the front map had but the back map has yet to get
+
+    // Points each keyframe contributed to the surfel map, and the pose they were put in with
+    deque<CloudXYZITPtr> KfSurfelinB;
+    deque<CloudXYZITPtr> KfSurfelinW;
+    deque<mytf> KfSurfelAnchor;
+    double surfel_reanchor_dis = 0.05;  // Keyframes that moved less than this after a loop closure are not re-anchored
+    double surfel_reanchor_ang = 0.5;   // Same in degree
+    bool surfel_reanchor_due = false;
+
+    struct SurfelMapUpdate
+    {
+        vector<SurfelOp> ops;               // Catch up with the front map
+        vector<SurfelOp> reanchorOps;       // Move the keyframes to their new poses
+        vector<CloudXYZITPtr> kfCloudinW;   // Keyframes to build the global map from
+        CloudXYZITPtr globalMap;
+        double time = 0;
+    };
+    shared_ptr<SurfelMapUpdate> surfelMapUpdate;
+    thread surfelMapUpdateThread;
+    atomic<bool> surfelMapUpdateDone{false};
+
+    // Surfel map snapshots to resume a session from. A mirror of the surfel map gets the same ops as the front map on
+    // its own thread, and the nodes they changed are written as an LZ4 compressed ufomap delta every period. A session
+    // starts its chain of files with a full snapshot, loading takes the last full snapshot and the deltas after it.
+    string snapshot_dir = "";           // No snapshots if empty
+    double snapshot_period = 10.0;      // Seconds between two deltas
+    int snapshot_full_every = 20;       // Write a full snapshot after this many deltas, and remove the files before it
+    bool snapshot_load = false;         // Load the latest snapshot in snapshot_dir into the surfel map at start
+    shared_ptr<ufoSurfelMap> snapshotMap;
+    vector<SurfelOp> snapshotPending;   // Ops the mirror has yet to get
+    int snapshot_seq = 0;
+    bool snapshot_stop = false;         // Set once at shutdown, no ops are queued after it
+    bool snapshot_flush = false;        // Write the pending ops now instead of at the end of the period
+    mutex snapshot_mtx;
+    condition_variable snapshot_cv;
+    thread snapshotThread;
+    once_flag snapshot_stop_once;
 
     // Loop closure
     bool loop_en = true;
@@ -291,7 +341,13 @@ private:
 
 public:
     // Destructor
-    ~Estimator() {}
+    ~Estimator()
+    {
+        StopSurfelMapSnapshot();
+
+        if (surfelMapUpdateThread.joinable())
+            surfelMapUpdateThread.join();
+    }
 
     Estimator(ros::NodeHandlePtr &nh_ptr_) : nh_ptr(nh_ptr_)
     {
@@ -439,11 +495,15 @@ public:
         nh_ptr->param("/odom_q_noise", odom_q_noise, 0.1);
         nh_ptr->param("/odom_p_noise", odom_p_noise, 0.1);
         nh_ptr->param("/loop_weight", loop_weight, 0.1);
+
+        nh_ptr->param("/surfel_reanchor_dis", surfel_reanchor_dis, 0.05);
+        nh_ptr->param("/surfel_reanchor_ang", surfel_reanchor_ang, 0.5);
         
         // Map inertialization
         KfCloudPose = CloudPosePtr(new CloudPose());
         globalMap = CloudXYZITPtr(new CloudXYZIT());
-        surfelMap = ufoSurfelMap(leaf_size, surfel_map_depth);
+        surfelMap = make_shared<ufoSurfelMap>(leaf_size, surfel_map_depth);
+        surfelMapBack = make_shared<ufoSurfelMap>(leaf_size, surfel_map_depth);
 
         // Advertise the global map
         global_map_pub = nh_ptr->advertise<sensor_msgs::PointCloud2>("/global_map", 10);
@@ -467,6 +527,15 @@ public:
         loop_log_file.open(log_dir + "/loop_log.csv");
         loop_log_file.precision(std::numeric_limits<double>::digits10 + 1);
         // loop_log_file.close();
+
+        // Surfel map snapshots
+        nh_ptr->param("/snapshot_dir", snapshot_dir, string(""));
+        nh_ptr->param("/snapshot_period", snapshot_period, 10.0);
+        nh_ptr->param("/snapshot_full_every", snapshot_full_every, 20);
+        snapshot_load = GetBoolParam("/snapshot_load", false);
+
+        if (snapshot_dir != "")
+            StartSurfelMapSnapshot();
     }
 
     bool GetBoolParam(string param, bool default_value)
@@ -495,6 +564,7 @@ public:
             {
                 printf(KYEL "Data timeout, Buf: %d. exit!\n" RESET, packet_buf.size());
                 SaveTrajLog();
+                StopSurfelMapSnapshot();
                 exit(0);
             }
 
@@ -680,7 +750,7 @@ public:
                 // TicToc tt_assoc;
 
                 SwDepVsAssoc[i].clear();
-                AssociateCloudWithMap(SwTimeStep[i], surfelMap, mytf(sfQua[i].back(), sfPos[i].back()),
+                AssociateCloudWithMap(SwTimeStep[i], *surfelMap, mytf(sfQua[i].back(), sfPos[i].back()),
                                       SwCloud[i], SwCloudDsk[i], SwCloudDskDS[i], SwLidarCoef[i], SwDepVsAssoc[i]);
 
                 // printf("Assoc Time Begin: %f\n", tt_assoc.Toc());
@@ -757,7 +827,7 @@ public:
                     // TicToc tt_assoc;
 
                     SwDepVsAssoc[i].clear();
-                    AssociateCloudWithMap(SwTimeStep[i], surfelMap, mytf(sfQua[i].back(), sfPos[i].back()),
+                    AssociateCloudWithMap(SwTimeStep[i], *surfelMap, mytf(sfQua[i].back(), sfPos[i].back()),
                                           SwCloud[i], SwCloudDsk[i], SwCloudDskDS[i], SwLidarCoef[i], SwDepVsAssoc[i]);
 
                     // printf("Assoc Time Loop: %f\n", tt_assoc.Toc());
@@ -826,7 +896,7 @@ public:
                              report.mfcBuf = packet_buf.size(), report.keyfrm, report.margPerc, report.kfcand,
                              // active_knots.begin()->first, active_knots.rbegin()->first,
                              // report.fixed_knot_min, report.fixed_knot_max,
-                             surfelMap.size(),
+                             surfelMap->size(),
                              // Optimization initial costs
                              report.J0, report.J0Surf, report.J0Imu, report.J0Vel,
                              // Optimization final costs
@@ -890,6 +960,7 @@ public:
             {
                 DetectLoop();
                 BundleAdjustment(baReport);
+                UpdateSurfelMap(baReport);
             }
 
             tt_loopBA.Toc();
@@ -1766,11 +1837,20 @@ public:
         // Add keyframe pointcloud to surfel map
         if (marginalizedCloud != cloud)
         {
+            KfSurfelinB.push_back(CloudXYZITPtr(new CloudXYZIT(*marginalizedCloud)));
             pcl::transformPointCloud(*marginalizedCloud, *marginalizedCloud, p, q);
-            insertCloudToSurfelMap(surfelMap, *marginalizedCloud);
+            KfSurfelinW.push_back(marginalizedCloud);
         }
         else
-            insertCloudToSurfelMap(surfelMap, *KfCloudinW.back());
+        {
+            KfSurfelinB.push_back(KfCloudinB.back());
+            KfSurfelinW.push_back(KfCloudinW.back());
+        }
+        KfSurfelAnchor.push_back(mytf(q, p));
+
+        insertCloudToSurfelMap(*surfelMap, *KfSurfelinW.back());
+        surfelMapBackPending.push_back(SurfelOp{false, KfSurfelinW.back()});
+        QueueSurfelMapSnapshot({SurfelOp{false, KfSurfelinW.back()}});
 
         // printf("Af4 add: GMap: %d.\n", globalMap->size(), KfCloudinW.back()->size());
 
@@ -1823,10 +1903,15 @@ public:
             }
         }
 
+        int pointsDSCount = CloudDeskewedDS->size();
+        vector<PointXYZIT> pointsInW(pointsDSCount);
+        vector<ufo::map::Code> pointsCode(pointsDSCount);
+        vector<char> pointsValid(pointsDSCount, 0);
+
         #pragma omp parallel for num_threads(MAX_THREADS)
-        for(auto &point : CloudDeskewedDS->points)
+        for(int k = 0; k < pointsDSCount; k++)
         {
-            int i = (int)(point.intensity);
+            int i = (int)(CloudDeskewedDS->points[k].intensity);
 
             for (int depth = 0; depth < surfel_query_depth; depth++)
             {
@@ -1836,117 +1921,160 @@ public:
                 CloudCoef[idx].d2P = -1;
             }
             
-            // Set default value
-            PointXYZIT pointRaw = CloudSkewed->points[i];
             PointXYZIT pointInB = CloudDeskewed->points[i];
-            PointXYZIT pointInW = Util::transform_point(tf_W_B, pointInB);
 
             if(!Util::PointIsValid(pointInB) || pointInB.t < 0)
             {
                 // printf(KRED "Invalid surf point!: %f, %f, %f\n" RESET, pointInB.x, pointInB.y, pointInB.z);
-                pointInB.x = 0; pointInB.y = 0; pointInB.z = 0; pointInB.intensity = 0;
                 continue;
             }
 
-            // Query the surfel map with predicates
-            namespace ufopred = ufo::map::predicate;
-            auto pred = ufopred::HasSurfel()
-                     && ufopred::DepthMin(surfel_min_depth)
-                     && ufopred::DepthMax(surfel_query_depth - 1)
-                     && ufopred::NumSurfelPointsMin(surfel_min_point)
-                     && ufopred::SurfelPlanarityMin(0.2)    // At this stage, we still search for low planarity surfels to avoid losing track in narrow passages
-                     && ufopred::Intersects(ufo::geometry::Sphere(ufo::map::Point3(pointInW.x, pointInW.y, pointInW.z), surfel_intsect_rad));
-
-            vector<int> closest_depth(surfel_query_depth, -1);
-            vector<int> closest_npoints(surfel_query_depth, -1);
-            vector<double> closest_d2pln(surfel_query_depth, -1);
-            vector<double> closest_plnrt(surfel_query_depth, -1);
-            vector<Vector4d> closest_plane(surfel_query_depth, Vector4d(0, 0, 0, 0));
-            vector<Vector3d> closest_eigen(surfel_query_depth, Vector3d(0, 0, 0));
-
-            for (auto const &node : Map.query(pred))
+            pointsInW[k]   = Util::transform_point(tf_W_B, pointInB);
+            pointsCode[k]  = Map.toCode(ufo::map::Point3(pointsInW[k].x, pointsInW[k].y, pointsInW[k].z));
+            pointsValid[k] = 1;
+        }
+
+        // Query the points in the order of their code, so the points of a batch are close and share most of the
+        // traversal of the map
+        vector<int> queryOrder;
+        queryOrder.reserve(pointsDSCount);
+        for(int k = 0; k < pointsDSCount; k++)
+            if (pointsValid[k])
+                queryOrder.push_back(k);
+        std::sort(queryOrder.begin(), queryOrder.end(),
+                  [&pointsCode](int a, int b) { return pointsCode[a] < pointsCode[b]; });
+
+        // Predicates common to all points, each point adds the sphere around it
+        namespace ufopred = ufo::map::predicate;
+        auto pred = ufopred::HasSurfel()
+                 && ufopred::DepthMin(surfel_min_depth)
+                 && ufopred::DepthMax(surfel_query_depth - 1)
+                 && ufopred::NumSurfelPointsMin(surfel_min_point)
+                 && ufopred::SurfelPlanarityMin(0.2);   // At this stage, we still search for low planarity surfels to avoid losing track in narrow passages
+
+        int queryCount = queryOrder.size();
+        int batchSize  = max(1, (int)std::ceil(queryCount / (4.0*MAX_THREADS)));
+        int batchCount = (queryCount + batchSize - 1) / batchSize;
+
+        #pragma omp parallel for num_threads(MAX_THREADS) schedule(dynamic)
+        for(int b = 0; b < batchCount; b++)
+        {
+            int bFirst = b*batchSize;
+            int bLast  = min(queryCount, bFirst + batchSize);
+
+            vector<ufo::geometry::Sphere> spheres;
+            spheres.reserve(bLast - bFirst);
+            for(int q = bFirst; q < bLast; q++)
             {
-                auto const& surfel = Map.getSurfel(node);
+                PointXYZIT &pointInW = pointsInW[queryOrder[q]];
+                spheres.emplace_back(ufo::map::Point3(pointInW.x, pointInW.y, pointInW.z), surfel_intsect_rad);
+            }
 
-                double planarity = surfel.getPlanarity();
-                // If node depth is higher than the second level, only admit highly planar ones
-                if (node.depth() > 1 && planarity < surfel_min_plnrty)  // Keeping low planarity surfels in the second level as backup for losing track
-                    continue;
+            vector<size_t> offsets;
+            vector<ufo::map::Node> nodes;
+            Map.queryIntersectsBatch(pred, spheres.begin(), spheres.end(), offsets, nodes);
 
-                int depth     = node.depth();
-                int numPoint  = surfel.getNumPoints();
-                Vector3d mean = ufo::math::toEigen(surfel.getMean());
-                Vector3d norm = ufo::math::toEigen(surfel.getNormal());
-                Vector3d eig  = ufo::math::toEigen(surfel.getEigenValues());
+            for(int q = bFirst; q < bLast; q++)
+            {
+                int k = queryOrder[q];
+                int i = (int)(CloudDeskewedDS->points[k].intensity);
 
-                if(planarity < 0 || planarity > 1.0)
-                {
-                    Vector3d sum = ufo::math::toEigen(surfel.getSum());
-                    auto sumSq = surfel.getSumSquares();
-
-                    printf("%sInvalid planarity: %f. Depth: %d. Numpoint: %d. Sum: %f, %f, %f. Sumsq: %f, %f, %f, %f, %f, %f. Eig: %f, %f, %f\n" RESET,
-                           node.depth() == 0 ? KRED : KMAG,
-                           planarity, node.depth(), numPoint,
-                           sum.x(), sum.y(), sum.z(),
-                           sumSq[0], sumSq[1], sumSq[2], sumSq[3], sumSq[4], sumSq[5],
-                           eig(0), eig(1), eig(2)
-                          );
-                    continue;
-                }
+                PointXYZIT pointRaw = CloudSkewed->points[i];
+                PointXYZIT pointInB = CloudDeskewed->points[i];
+                PointXYZIT pointInW = pointsInW[k];
 
-                // ROS_ASSERT_MSG(planarity >= 0 && planarity <= 1.0, "plnrty: %f\n", planarity);
-                double d2pln = fabs(norm.dot(Vector3d(pointInW.x, pointInW.y, pointInW.z) - mean));
+                vector<int> closest_depth(surfel_query_depth, -1);
+                vector<int> closest_npoints(surfel_query_depth, -1);
+                vector<double> closest_d2pln(surfel_query_depth, -1);
+                vector<double> closest_plnrt(surfel_query_depth, -1);
+                vector<Vector4d> closest_plane(surfel_query_depth, Vector4d(0, 0, 0, 0));
+                vector<Vector3d> closest_eigen(surfel_query_depth, Vector3d(0, 0, 0));
 
-                if (closest_d2pln[depth] == -1 || d2pln < closest_d2pln[depth])
+                for (size_t n = offsets[q - bFirst]; n < offsets[q - bFirst + 1]; n++)
                 {
-                    closest_depth[depth]   = depth;
-                    closest_npoints[depth] = numPoint;
-                    closest_d2pln[depth]   = d2pln;
-                    closest_plnrt[depth]   = planarity;
-                    closest_eigen[depth]   = eig;
-                    closest_plane[depth]  << norm, -norm.dot(mean);
-                }
-            }
+                    auto const &node = nodes[n];
+                    auto const &surfel = Map.getSurfel(node);
 
-            bool point_associated = false;
-            for (int depth = 0; depth < surfel_query_depth; depth++)
-            {
-                // Write down the d2p for the original point
-                if (depth == surfel_min_depth)
-                    CloudCoef[i*surfel_query_depth + depth].d2P = closest_d2pln[depth];
+                    double planarity = surfel.getPlanarity();
+                    // If node depth is higher than the second level, only admit highly planar ones
+                    if (node.depth() > 1 && planarity < surfel_min_plnrty)  // Keeping low planarity surfels in the second level as backup for losing track
+                        continue;
 
-                if (closest_d2pln[depth] > dis_to_surfel_max || closest_d2pln[depth] == -1 || point_associated)
-                    continue;
+                    int depth     = node.depth();
+                    int numPoint  = surfel.getNumPoints();
+                    Vector3d mean = ufo::math::toEigen(surfel.getMean());
+                    Vector3d norm = ufo::math::toEigen(surfel.getNormal());
+                    Vector3d eig  = ufo::math::toEigen(surfel.getEigenValues());
 
-                double score = (1 - 0.9 * closest_d2pln[depth] / Util::pointDistance(pointInB))*closest_plnrt[depth];
+                    if(planarity < 0 || planarity > 1.0)
+                    {
+                        Vector3d sum = ufo::math::toEigen(surfel.getSum());
+                        auto sumSq = surfel.getSumSquares();
+
+                        printf("%sInvalid planarity: %f. Depth: %d. Numpoint: %d. Sum: %f, %f, %f. Sumsq: %f, %f, %f, %f, %f, %f. Eig: %f, %f, %f\n" RESET,
+                               node.depth() == 0 ? KRED : KMAG,
+                               planarity, node.depth(), numPoint,
+                               sum.x(), sum.y(), sum.z(),
+                               sumSq[0], sumSq[1], sumSq[2], sumSq[3], sumSq[4], sumSq[5],
+                               eig(0), eig(1), eig(2)
+                              );
+                        continue;
+                    }
 
-                // Weightage based on how close the point is to the plane
-                if (score > score_min)
+                    // ROS_ASSERT_MSG(planarity >= 0 && planarity <= 1.0, "plnrty: %f\n", planarity);
+                    double d2pln = fabs(norm.dot(Vector3d(pointInW.x, pointInW.y, pointInW.z) - mean));
+
+                    if (closest_d2pln[depth] == -1 || d2pln < closest_d2pln[depth])
+                    {
+                        closest_depth[depth]   = depth;
+                        closest_npoints[depth] = numPoint;
+                        closest_d2pln[depth]   = d2pln;
+                        closest_plnrt[depth]   = planarity;
+                        closest_eigen[depth]   = eig;
+                        closest_plane[depth]  << norm, -norm.dot(mean);
+                    }
+                }
+
+                bool point_associated = false;
+                for (int depth = 0; depth < surfel_query_depth; depth++)
                 {
-                    LidarCoef &coef = CloudCoef[i*surfel_query_depth + depth];
-
-                    coef.t      = timeStep.front().start_time + pointRaw.t;
-                    coef.n      = score*closest_plane[depth];
-                    coef.scale  = depth;
-                    coef.surfNp = closest_npoints[depth];
-                    coef.plnrty = closest_plnrt[depth];
-                    coef.d2P    = closest_d2pln[depth];
-                    coef.f      = Vector3d(pointRaw.x, pointRaw.y, pointRaw.z);
-                    coef.fdsk   = Vector3d(pointInB.x, pointInB.y, pointInB.z);
-                    coef.finW   = Vector3d(pointInW.x, pointInW.y, pointInW.z);
-                    
-                    for(auto &seg : timeStep)
+                    // Write down the d2p for the original point
+                    if (depth == surfel_min_depth)
+                        CloudCoef[i*surfel_query_depth + depth].d2P = closest_d2pln[depth];
+
+                    if (closest_d2pln[depth] > dis_to_surfel_max || closest_d2pln[depth] == -1 || point_associated)
+                        continue;
+
+                    double score = (1 - 0.9 * closest_d2pln[depth] / Util::pointDistance(pointInB))*closest_plnrt[depth];
+
+                    // Weightage based on how close the point is to the plane
+                    if (score > score_min)
                     {
-                        if(seg.start_time <= coef.t && coef.t <= seg.final_time)
+                        LidarCoef &coef = CloudCoef[i*surfel_query_depth + depth];
+
+                        coef.t      = timeStep.front().start_time + pointRaw.t;
+                        coef.n      = score*closest_plane[depth];
+                        coef.scale  = depth;
+                        coef.surfNp = closest_npoints[depth];
+                        coef.plnrty = closest_plnrt[depth];
+                        coef.d2P    = closest_d2pln[depth];
+                        coef.f      = Vector3d(pointRaw.x, pointRaw.y, pointRaw.z);
+                        coef.fdsk   = Vector3d(pointInB.x, pointInB.y, pointInB.z);
+                        coef.finW   = Vector3d(pointInW.x, pointInW.y, pointInW.z);
+                    
+                        for(auto &seg : timeStep)
                         {
-                            coef.dt = seg.dt();
-                            coef.u  = seg.start_time;
-                            coef.s  = (coef.t - seg.start_time)/seg.dt();
-                            break;
+                            if(seg.start_time <= coef.t && coef.t <= seg.final_time)
+                            {
+                                coef.dt = seg.dt();
+                                coef.u  = seg.start_time;
+                                coef.s  = (coef.t - seg.start_time)/seg.dt();
+                                break;
+                            }
                         }
-                    }
 
-                    point_associated = true;
+                        point_associated = true;
+                    }
                 }
             }
         }
@@ -2227,43 +2355,391 @@ public:
         // Solve the pose graph optimization problem
         OptimizePoseGraph(KfCloudPose, loopPairs, report);
 
-        TicToc tt_rebuildmap;
-
-        // Recompute the keyframe pointclouds
+        // Recompute the keyframe pointclouds. Fresh clouds are made as the old ones may be in a surfel map update.
         #pragma omp parallel for num_threads(MAX_THREADS)
         for(int i = 0; i < KfCloudPose->size(); i++)
         {
             myTf tf_W_B(KfCloudPose->points[i]);
-            pcl::transformPointCloud(*KfCloudinB[i], *KfCloudinW[i], tf_W_B.pos, tf_W_B.rot);
+            CloudXYZITPtr cloudInW(new CloudXYZIT());
+            pcl::transformPointCloud(*KfCloudinB[i], *cloudInW, tf_W_B.pos, tf_W_B.rot);
+            KfCloudinW[i] = cloudInW;
         }
 
-        // Recompute the globalmap and ufomap
+        // Re-anchor the keyframes in the surfel map
+        surfel_reanchor_due = true;
+    }
+
+    void UpdateSurfelMap(BAReport &report)
+    {
+        // Swap the maps once the back map is updated
+        if (surfelMapUpdate != nullptr && surfelMapUpdateDone)
         {
-            lock_guard<mutex> lock(global_map_mtx);
-            globalMap->clear();
-            surfelMap.clear();
+            surfelMapUpdateThread.join();
 
-            for(int i = 0; i < KfCloudPose->size(); i++)
-                *globalMap += *KfCloudinW[i];
+            // Keyframes admitted during the update are already in the front map, the back map gets them now.
+            // The old front map gets the re-anchoring when it is the back map.
+            applySurfelOps(*surfelMapBack, surfelMapBackPending);
+            surfelMapBackPending = surfelMapUpdate->reanchorOps;
+            swap(surfelMap, surfelMapBack);
+            QueueSurfelMapSnapshot(surfelMapUpdate->reanchorOps);
 
-            // Downsample the global map
-            pcl::UniformSampling<PointXYZIT> downsampler;
-            downsampler.setRadiusSearch(leaf_size);
-            downsampler.setInputCloud(globalMap);
-            downsampler.filter(*globalMap);
+            {
+                lock_guard<mutex> lock(global_map_mtx);
+                for(int i = surfelMapUpdate->kfCloudinW.size(); i < KfCloudinW.size(); i++)
+                    *surfelMapUpdate->globalMap += *KfCloudinW[i];
+                globalMap = surfelMapUpdate->globalMap;
+            }
 
             Util::publishCloud(global_map_pub, *globalMap, ros::Time(KfCloudPose->points.back().t), string("world"));
 
-            // Build the surfelmap
-            insertCloudToSurfelMap(surfelMap, *globalMap);
-            
             // Increment the ufomap version
             ufomap_version++;
+
+            report.rebuildmap_time = surfelMapUpdate->time;
+            surfelMapUpdate = nullptr;
+        }
+
+        // Start an update if the keyframes moved and none is running
+        if (surfelMapUpdate != nullptr || !surfel_reanchor_due)
+            return;
+
+        surfel_reanchor_due = false;
+        surfelMapUpdate = make_shared<SurfelMapUpdate>();
+        surfelMapUpdate->ops.swap(surfelMapBackPending);
+
+        // Keyframes that moved beyond the threshold are erased from the map and put in at the new pose
+        vector<int> reanchorKf;
+        for(int i = 0; i < KfSurfelAnchor.size(); i++)
+        {
+            myTf tf_W_B(KfCloudPose->points[i]);
+            if ((tf_W_B.pos - KfSurfelAnchor[i].pos).norm() > surfel_reanchor_dis
+                || Util::angleDiff(tf_W_B.rot, KfSurfelAnchor[i].rot) > surfel_reanchor_ang)
+                reanchorKf.push_back(i);
         }
 
-        tt_rebuildmap.Toc();
+        vector<CloudXYZITPtr> reanchorCloud(reanchorKf.size());
+        #pragma omp parallel for num_threads(MAX_THREADS)
+        for(int j = 0; j < reanchorKf.size(); j++)
+        {
+            int i = reanchorKf[j];
+            if (KfSurfelinB[i] == KfCloudinB[i])
+                reanchorCloud[j] = KfCloudinW[i];
+            else
+            {
+                myTf tf_W_B(KfCloudPose->points[i]);
+                reanchorCloud[j] = CloudXYZITPtr(new CloudXYZIT());
+                pcl::transformPointCloud(*KfSurfelinB[i], *reanchorCloud[j], tf_W_B.pos, tf_W_B.rot);
+            }
+        }
+
+        for(int j = 0; j < reanchorKf.size(); j++)
+        {
+            int i = reanchorKf[j];
+            surfelMapUpdate->reanchorOps.push_back(SurfelOp{true, KfSurfelinW[i]});
+            surfelMapUpdate->reanchorOps.push_back(SurfelOp{false, reanchorCloud[j]});
+            KfSurfelinW[i] = reanchorCloud[j];
+            KfSurfelAnchor[i] = myTf(KfCloudPose->points[i]);
+        }
+
+        surfelMapUpdate->kfCloudinW.assign(KfCloudinW.begin(), KfCloudinW.end());
+
+        printf(KYEL "Surfel map update: %d / %d keyframes re-anchored, %d pending updates.\n" RESET,
+                    (int)reanchorKf.size(), (int)KfSurfelAnchor.size(), (int)surfelMapUpdate->ops.size());
 
-        report.rebuildmap_time = tt_rebuildmap.GetLastStop();
+        surfelMapUpdateDone = false;
+        surfelMapUpdateThread = thread(&Estimator::UpdateSurfelMapBack, this, surfelMapUpdate);
+    }
+
+    // Runs on its own thread, touches only the back map and the update
+    void UpdateSurfelMapBack(shared_ptr<SurfelMapUpdate> update)
+    {
+        TicToc tt_update;
+
+        applySurfelOps(*surfelMapBack, update->ops);
+        applySurfelOps(*surfelMapBack, update->reanchorOps);
+
+        // Rebuild the global map
+        update->globalMap = CloudXYZITPtr(new CloudXYZIT());
+        for(auto &cloud : update->kfCloudinW)
+            *update->globalMap += *cloud;
+
+        pcl::UniformSampling<PointXYZIT> downsampler;
+        downsampler.setRadiusSearch(leaf_size);
+        downsampler.setInputCloud(update->globalMap);
+        downsampler.filter(*update->globalMap);
+
+        update->time = tt_update.Toc();
+        surfelMapUpdateDone = true;
+    }
+
+    void applySurfelOps(ufoSurfelMap &map, const vector<SurfelOp> &ops, bool propagate = true)
+    {
+        for(const SurfelOp &op : ops)
+        {
+            if (op.erase)
+                eraseCloudFromSurfelMap(map, *op.cloud, propagate);
+            else
+                insertCloudToSurfelMap(map, *op.cloud, propagate);
+        }
+    }
+
+    void StartSurfelMapSnapshot()
+    {
+        std::filesystem::create_directories(snapshot_dir);
+
+        // Continue the numbering of the files already there
+        int lastSeq = -1;
+        vector<string> chain = SurfelMapSnapshotChain(snapshot_dir, lastSeq);
+        snapshot_seq = lastSeq + 1;
+
+        snapshotMap = make_shared<ufoSurfelMap>(leaf_size, surfel_map_depth);
+
+        if (snapshot_load && !chain.empty())
+        {
+            TicToc tt_load;
+
+            if (!LoadSurfelMapSnapshot({surfelMap, surfelMapBack, snapshotMap}, chain))
+            {
+                // Start from an empty map rather than from a partial one
+                printf(KRED "Failed to load the surfel map snapshot in %s. Starting with an empty map.\n" RESET,
+                            snapshot_dir.c_str());
+                surfelMap = make_shared<ufoSurfelMap>(leaf_size, surfel_map_depth);
+                surfelMapBack = make_shared<ufoSurfelMap>(leaf_size, surfel_map_depth);
+                snapshotMap = make_shared<ufoSurfelMap>(leaf_size, surfel_map_depth);
+            }
+            else
+            {
+                printf(KYEL "Surfel map loaded from %d snapshot files in %s. Nodes: %d. Time: %f ms.\n" RESET,
+                            (int)chain.size(), snapshot_dir.c_str(), (int)surfelMap->size(), tt_load.Toc());
+
+                if (surfelMap->resolution() != leaf_size || surfelMap->depthLevels() != surfel_map_depth)
+                    printf(KRED "Snapshot resolution %f, depth %d differ from leaf_size %f, surfel_map_depth %d. "
+                                "Using the snapshot's.\n" RESET,
+                                surfelMap->resolution(), surfelMap->depthLevels(), leaf_size, surfel_map_depth);
+            }
+        }
+
+        snapshot_stop = false;
+        snapshotThread = thread(&Estimator::SurfelMapSnapshotLoop, this);
+    }
+
+    // Writes the ops not written yet as a last delta and ends the snapshot thread. Only for shutdown, it can be reached
+    // from several threads but stops the snapshots once.
+    void StopSurfelMapSnapshot()
+    {
+        call_once(snapshot_stop_once, [this]()
+        {
+            if (!snapshotThread.joinable())
+                return;
+
+            {
+                lock_guard<mutex> lock(snapshot_mtx);
+                snapshot_stop = true;
+            }
+            snapshot_cv.notify_one();
+            snapshotThread.join();
+        });
+    }
+
+    // Wakes the snapshot thread to write the pending ops without waiting for the period to end
+    void FlushSurfelMapSnapshot()
+    {
+        if (snapshot_dir == "")
+            return;
+
+        {
+            lock_guard<mutex> lock(snapshot_mtx);
+            snapshot_flush = true;
+        }
+        snapshot_cv.notify_one();
+    }
+
+    void QueueSurfelMapSnapshot(const vector<SurfelOp> &ops)
+    {
+        if (snapshot_dir == "")
+            return;
+
+        lock_guard<mutex> lock(snapshot_mtx);
+
+        // Nothing would write them anymore
+        if (snapshot_stop)
+            return;
+
+        snapshotPending.insert(snapshotPending.end(), ops.begin(), ops.end());
+    }
+
+    // The snapshot files in dir by sequence number, with whether they are full snapshots and their paths
+    std::map<int, pair<bool, string>> SurfelMapSnapshotFiles(const string &dir)
+    {
+        std::map<int, pair<bool, string>> files;
+        if (std::filesystem::is_directory(dir))
+        {
+            std::regex pattern("surfel_map_([0-9]+)_(full|delta)\\.ufo");
+            std::smatch match;
+            for (auto const &entry : std::filesystem::directory_iterator(dir))
+            {
+                string name = entry.path().filename().string();
+                if (std::regex_match(name, match, pattern))
+                    files[stoi(match[1])] = make_pair(match[2] == "full", entry.path().string());
+            }
+        }
+
+        return files;
+    }
+
+    // The files to load for the latest snapshot in dir: its last full snapshot and the deltas after it
+    vector<string> SurfelMapSnapshotChain(const string &dir, int &lastSeq)
+    {
+        vector<string> chain;
+        for (auto const &file : SurfelMapSnapshotFiles(dir))
+        {
+            if (file.second.first)
+                chain.clear();
+
+            // Deltas before the first full snapshot belong to no chain
+            if (file.second.first || !chain.empty())
+                chain.push_back(file.second.second);
+
+            lastSeq = file.first;
+        }
+
+        return chain;
+    }
+
+    // Reads every file of the chain once and parses the same bytes into each of the maps, side by side
+    bool LoadSurfelMapSnapshot(const vector<shared_ptr<ufoSurfelMap>> &maps, const vector<string> &chain)
+    {
+        int numMaps = maps.size();
+        vector<char> loaded(numMaps, 1);
+        for (const string &file : chain)
+        {
+            string bytes;
+            try
+            {
+                std::ifstream in;
+                in.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+                in.open(file, std::ios_base::in | std::ios_base::binary);
+
+                std::stringstream buffer;
+                buffer << in.rdbuf();
+                bytes = buffer.str();
+            }
+            catch (const std::exception &e)
+            {
+                printf(KRED "Failed to read surfel map snapshot %s: %s\n" RESET, file.c_str(), e.what());
+                return false;
+            }
+
+            #pragma omp parallel for num_threads(numMaps)
+            for(int i = 0; i < numMaps; i++)
+            {
+                if (!loaded[i])
+                    continue;
+
+                try
+                {
+                    std::istringstream stream(bytes, std::ios_base::in | std::ios_base::binary);
+                    stream.exceptions(std::istream::failbit | std::istream::badbit);
+                    maps[i]->read(stream, false);
+                }
+                catch (const std::exception &e)
+                {
+                    printf(KRED "Failed to parse surfel map snapshot %s: %s\n" RESET, file.c_str(), e.what());
+                    loaded[i] = 0;
+                }
+            }
+
+            if (std::find(loaded.begin(), loaded.end(), 0) != loaded.end())
+                return false;
+        }
+
+        for (auto &map : maps)
+            map->updateModifiedNodes(std::execution::par);
+
+        return true;
+    }
+
+    // Runs on its own thread, touches only the mirror map and the snapshot files
+    void SurfelMapSnapshotLoop()
+    {
+        auto period = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(snapshot_period));
+        auto next = chrono::steady_clock::now() + period;
+        int deltas = -1;    // Deltas since the last full snapshot, none is written yet
+
+        unique_lock<mutex> lock(snapshot_mtx);
+        while(true)
+        {
+            snapshot_cv.wait_until(lock, next, [this]{ return snapshot_stop || snapshot_flush; });
+            snapshot_flush = false;
+            if (chrono::steady_clock::now() >= next)
+                next += period;
+
+            vector<SurfelOp> ops;
+            ops.swap(snapshotPending);
+            bool stop = snapshot_stop;
+            lock.unlock();
+
+            if (!ops.empty())
+            {
+                applySurfelOps(*snapshotMap, ops, false);
+
+                bool full = deltas < 0 || deltas >= snapshot_full_every;
+                if (WriteSurfelMapSnapshot(full))
+                    deltas = full ? 0 : deltas + 1;
+                else
+                    deltas = -1;    // The changes are lost from the chain, start a new one
+            }
+
+            if (stop)
+                break;
+
+            lock.lock();
+        }
+    }
+
+    bool WriteSurfelMapSnapshot(bool full)
+    {
+        TicToc tt_write;
+
+        string file = snapshot_dir + "/" + (boost::format("surfel_map_%06d_%s.ufo") % snapshot_seq % (full ? "full" : "delta")).str();
+        try
+        {
+            // Written under a temporary name so a crash never leaves a truncated snapshot
+            if (full)
+            {
+                snapshotMap->updateModifiedNodes();
+                snapshotMap->write(file + ".tmp", 0, true);
+            }
+            else
+                snapshotMap->writeAndUpdateModified(file + ".tmp", true);
+
+            std::filesystem::rename(file + ".tmp", file);
+        }
+        catch (const std::exception &e)
+        {
+            printf(KRED "Failed to write surfel map snapshot %s: %s\n" RESET, file.c_str(), e.what());
+            return false;
+        }
+
+        // A full snapshot supersedes all files before it, also those of earlier sessions
+        if (full)
+        {
+            for (auto const &old : SurfelMapSnapshotFiles(snapshot_dir))
+            {
+                if (old.first >= snapshot_seq)
+                    break;
+
+                std::error_code ec;
+                if (!std::filesystem::remove(old.second.second, ec) && ec)
+                    printf(KRED "Failed to remove surfel map snapshot %s: %s\n" RESET,
+                                old.second.second.c_str(), ec.message().c_str());
+            }
+        }
+        snapshot_seq++;
+
+        printf(KYEL "Surfel map snapshot %s written. Time: %f ms.\n" RESET, file.c_str(), tt_write.Toc());
+
+        return true;
     }
 
     void OptimizePoseGraph(CloudPosePtr &kfCloud, const deque<LoopPrior> &loops, BAReport &report)
@@ -2551,6 +3027,8 @@ public:
 
     void SaveTrajLog()
     {
+        FlushSurfelMapSnapshot();
+
         printf(KYEL "Logging the map start ...\n" RESET);
 
         printf("Logging cloud pose: %s.\n", (log_dir + "/KfCloudPose.pcd").c_str());
@@ -2601,6 +3079,7 @@ int main(int argc, char **argv)
     spinner.spin();
 
     estimator.SaveTrajLog();
+    estimator.StopSurfelMapSnapshot();
 
     return 0;
 }
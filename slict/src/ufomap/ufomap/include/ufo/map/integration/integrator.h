@@ -63,6 +63,7 @@
 #include <algorithm>
 #include <execution>
 #include <future>
+#include <numeric>
 #include <thread>
 #include <type_traits>
 #include <vector>
@@ -95,58 +96,45 @@ class Integrator
 				return;
 			}
 
-			// Get the points [first, last) falling into the node
-			auto first_point_it = std::cbegin(p.points);
-			auto last_point_it = std::cend(p.points);
-
-			// Create and retrieve the node
-			auto node = map.createNode(p.code);
-
-			// Get current occupancy
-			auto logit = map.getOccupancyLogit(node);
+			integrateHit(map, map.createNode(p.code), p, prob);
+		});
 
-			// Update occupancy
-			map.increaseOccupancyLogit(node, prob, false);
+		// FIXME: Increment time step
+		time_step_ += time_step_auto_inc_;
+	}
 
-			// Update time step
-			if constexpr (is_base_of_template_v<TimeMapBase, std::decay_t<Map>>) {
-				map.setTimeStep(node, time_step_, false);
-			}
+	/*!
+	 * Integrate hits in parallel. The nodes are created subtree by subtree concurrently, then
+	 * updated concurrently. Nothing is propagated, call updateModifiedNodes afterwards.
+	 *
+	 * @param cloud Integration cloud, sorted by code as toIntegrationCloud gives it.
+	 */
+	template <class ExecutionPolicy, class Map, class P,
+	          typename = std::enable_if_t<
+	              std::is_execution_policy_v<std::decay_t<ExecutionPolicy>>>>
+	void integrateHits(ExecutionPolicy policy, Map& map,
+	                   IntegrationCloud<P> const& cloud) const
+	{
+		auto prob = map.toOccupancyChangeLogit(
+		    occupancy_prob_hit_);  // + map.toOccupancyChangeLogit(occupancy_prob_miss_)
 
-			// Update color
-			if constexpr (is_base_of_template_v<ColorMapBase, std::decay_t<Map>> &&
-			              std::is_base_of_v<RGBColor, P>) {
-				RGBColor avg_color = RGBColor::average(first_point_it, last_point_it);
-
-				if (avg_color.set()) {
-					double total_logit = logit + prob;
-					double weight = prob / total_logit;
-					map.setColor(node,
-					             RGBColor::average(
-					                 {{avg_color, weight}, {map.getColor(node), 1.0 - weight}}),
-					             false);  // TODO: Update
-				}
+		std::vector<std::size_t> hits;
+		std::vector<Code> codes;
+		hits.reserve(cloud.size());
+		codes.reserve(cloud.size());
+		for (std::size_t i = 0; i != cloud.size(); ++i) {
+			if (cloud[i].valid()) {
+				hits.push_back(i);
+				codes.push_back(cloud[i].code);
 			}
+		}
 
-			// Update semantics
-			if constexpr (is_base_of_template_v<SemanticMapBase, std::decay_t<Map>> &&
-			              std::is_base_of_v<SemanticPair, P>) {
-				// FIXME: Implement correctly
-
-				std::vector<SemanticPair> semantics(first_point_it, last_point_it);
-
-				// Remove label 0
-				semantics.erase(std::remove(std::begin(semantics), std::end(semantics),
-				                            [](auto sem) { return 0 == sem.label; }),
-				                std::end(semantics));
-
-				// Decrease all
-				map.decreaseSemantic(node, semantic_value_miss_, false);
+		auto nodes = map.createNodes(policy, codes);
 
-				// Incrase hits
-				map.increaseSemantics(node, std::cbegin(semantics), std::cend(semantics),
-				                      semantic_value_hit_ + semantic_value_miss_, false);
-			}
+		std::vector<std::size_t> indices(hits.size());
+		std::iota(std::begin(indices), std::end(indices), 0);
+		for_each(policy, indices, [&](std::size_t i) {
+			integrateHit(map, nodes[i], cloud[hits[i]], prob);
 		});
 
 		// FIXME: Increment time step
@@ -173,6 +161,28 @@ class Integrator
 		});
 	}
 
+	/*!
+	 * Integrate misses in parallel, like integrateHits. Nothing is propagated.
+	 */
+	template <class ExecutionPolicy, class Map,
+	          typename = std::enable_if_t<
+	              std::is_execution_policy_v<std::decay_t<ExecutionPolicy>>>>
+	void integrateMisses(ExecutionPolicy policy, Map& map, Misses misses) const
+	{
+		auto prob = map.toOccupancyChangeLogit(occupancy_prob_miss_);
+
+		std::sort(policy, std::begin(misses), std::end(misses));
+		auto nodes = map.createNodes(policy, misses);
+
+		for_each(policy, nodes, [&map, prob, time_step = time_step_](auto node) {
+			map.decreaseOccupancyLogit(node, prob, false);
+
+			if constexpr (is_base_of_template_v<TimeMapBase, std::decay_t<Map>>) {
+				map.setTimeStep(node, time_step, false);
+			}
+		});
+	}
+
 	//
 	// Insert point cloud
 	//
@@ -254,6 +264,63 @@ class Integrator
 		insertPointCloud(map, cloud, frame_origin.transform(sensor_origin), propagate);
 	}
 
+	/*!
+	 * Integrate a point cloud into a map in parallel. Ray casting is used to clear free space
+	 * between the points in the point cloud and the sensor origin. The misses and the hits
+	 * are integrated subtree by subtree concurrently and propagated once at the end.
+	 *
+	 * @param policy Execution policy for the integration and the propagation.
+	 * @param map Map to integrate into.
+	 * @param cloud Point cloud in global reference frame to integrate.
+	 * @param sensor_origin Origin of the sensor in global reference frame.
+	 * @param propagate Whether to update the inner nodes of the map.
+	 */
+	template <class ExecutionPolicy, class Map, class P,
+	          typename = std::enable_if_t<
+	              std::is_execution_policy_v<std::decay_t<ExecutionPolicy>>>>
+	void insertPointCloud(ExecutionPolicy policy, Map& map, PointCloudT<P> const& cloud,
+	                      Point3 const sensor_origin, bool const propagate = true) const
+	{
+		// Create integration cloud
+		IntegrationCloud<P> ic =
+		    0 > max_range_
+		        ? toIntegrationCloud(map, cloud, hit_depth_)
+		        : toIntegrationCloud(map, cloud, sensor_origin, max_range_, hit_depth_);
+
+		// Ray cast to get free space
+		Misses misses =
+		    isDiscretize()
+		        ? getMissesDiscreteFast(map, ic, sensor_origin, false, getMissDepth())
+		        : getMisses(map, ic, sensor_origin, false, getMissDepth());
+
+		// Integrate into the map
+		integrateMisses(policy, map, std::move(misses));
+		integrateHits(policy, map, ic);
+
+		if (propagate) {
+			// Propagate information in the map
+			map.updateModifiedNodes(policy);
+		}
+	}
+
+	/*!
+	 * Integrate a point cloud into a map in parallel, see above.
+	 *
+	 * @param frame_origin Origin of reference frame, determines transform to be applied to
+	 * cloud and sensor_origin.
+	 */
+	template <class ExecutionPolicy, class Map, class P,
+	          typename = std::enable_if_t<
+	              std::is_execution_policy_v<std::decay_t<ExecutionPolicy>>>>
+	void insertPointCloud(ExecutionPolicy policy, Map& map, PointCloudT<P> cloud,
+	                      Point3 const sensor_origin, math::Pose6f frame_origin,
+	                      bool const propagate = true) const
+	{
+		applyTransform(cloud, frame_origin);
+		insertPointCloud(policy, map, cloud, frame_origin.transform(sensor_origin),
+		                 propagate);
+	}
+
 	//
 	// Getters
 	//
@@ -380,6 +447,66 @@ class Integrator
 		semantic_value_miss_ = value;
 	}
 
+ private:
+	//
+	// Integrate hit
+	//
+
+	// Update the node of the points in p, without propagating
+	template <class Map, class P, class Logit>
+	void integrateHit(Map& map, Node node, IntegrationPoint<P> const& p, Logit prob) const
+	{
+		// Get the points [first, last) falling into the node
+		auto first_point_it = std::cbegin(p.points);
+		auto last_point_it = std::cend(p.points);
+
+		// Get current occupancy
+		auto logit = map.getOccupancyLogit(node);
+
+		// Update occupancy
+		map.increaseOccupancyLogit(node, prob, false);
+
+		// Update time step
+		if constexpr (is_base_of_template_v<TimeMapBase, std::decay_t<Map>>) {
+			map.setTimeStep(node, time_step_, false);
+		}
+
+		// Update color
+		if constexpr (is_base_of_template_v<ColorMapBase, std::decay_t<Map>> &&
+		              std::is_base_of_v<RGBColor, P>) {
+			RGBColor avg_color = RGBColor::average(first_point_it, last_point_it);
+
+			if (avg_color.set()) {
+				double total_logit = logit + prob;
+				double weight = prob / total_logit;
+				map.setColor(node,
+				             RGBColor::average(
+				                 {{avg_color, weight}, {map.getColor(node), 1.0 - weight}}),
+				             false);  // TODO: Update
+			}
+		}
+
+		// Update semantics
+		if constexpr (is_base_of_template_v<SemanticMapBase, std::decay_t<Map>> &&
+		              std::is_base_of_v<SemanticPair, P>) {
+			// FIXME: Implement correctly
+
+			std::vector<SemanticPair> semantics(first_point_it, last_point_it);
+
+			// Remove label 0
+			semantics.erase(std::remove(std::begin(semantics), std::end(semantics),
+			                            [](auto sem) { return 0 == sem.label; }),
+			                std::end(semantics));
+
+			// Decrease all
+			map.decreaseSemantic(node, semantic_value_miss_, false);
+
+			// Incrase hits
+			map.increaseSemantics(node, std::cbegin(semantics), std::cend(semantics),
+			                      semantic_value_hit_ + semantic_value_miss_, false);
+		}
+	}
+
  private:
 	// If there should be discretization
 	bool discretize_ = true;
@@ -72,6 +72,7 @@
 #include <numeric>
 #include <optional>
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <vector>
 
@@ -946,6 +947,47 @@ class OctreeBase
 		return createNode(toCode(x, y, z, depth));
 	}
 
+	/*!
+	 * @brief Create the nodes of many codes at once, in parallel.
+	 *
+	 * The nodes are created together with their parents marked modified, as if they had been
+	 * changed with propagate set to false. Changing them afterwards with propagate set to
+	 * false touches no node but their own, so different nodes can be changed concurrently and
+	 * the changes propagated once with updateModifiedNodes.
+	 *
+	 * @param codes Codes sorted by code, none the ancestor of another.
+	 * @return The node of each code, in the same order.
+	 */
+	template <class ExecutionPolicy, typename = std::enable_if_t<std::is_execution_policy_v<
+	                                     std::decay_t<ExecutionPolicy>>>>
+	std::vector<Node> createNodes(ExecutionPolicy policy, std::vector<Code> const& codes)
+	{
+		std::vector<Node> nodes(codes.size());
+		if (codes.empty()) {
+			return nodes;
+		}
+
+		depth_t const max_depth =
+		    std::max_element(std::cbegin(codes), std::cend(codes),
+		                     [](Code a, Code b) { return a.depth() < b.depth(); })
+		        ->depth();
+		if (max_depth >= depthLevels()) {
+			// The root, which has no parents
+			setModified(getRoot(), true);
+			std::fill(std::begin(nodes), std::end(nodes), getRootNode());
+			return nodes;
+		}
+
+		for_each(policy, sortedSubtrees(codes, max_depth),
+		         [this, &codes, &nodes](SortedSubtree const& subtree) {
+			         for (std::size_t i = subtree.first; i != subtree.last; ++i) {
+				         nodes[i] = createModifiedNode(*subtree.node, subtree.depth, codes[i]);
+			         }
+		         });
+
+		return nodes;
+	}
+
 	//
 	// Create bv node
 	//
@@ -1444,6 +1486,46 @@ class OctreeBase
 		return queryK(k, std::forward<Predicates>(predicates), d_first);
 	}
 
+	/*!
+	 * @brief Query for many geometries at once.
+	 *
+	 * Gives, for every geometry, the nodes query(predicates && Intersects(geometry)) gives
+	 * and in the same order. The tree is traversed once for the whole batch: a node is
+	 * checked against the geometries that intersect its parent, and against the predicates
+	 * once for all of them. Geometries close to each other share most of the traversal, so
+	 * a batch should be spatially coherent, e.g. sorted by code.
+	 *
+	 * @param predicates The predicates all geometries have in common.
+	 * @param first,last The geometries.
+	 * @param offsets The nodes of the i:th geometry are [offsets[i], offsets[i + 1]) in nodes.
+	 * @param nodes The nodes of all geometries.
+	 */
+	template <class Predicates, class RandomIt>
+	void queryIntersectsBatch(Predicates const& predicates, RandomIt first, RandomIt last,
+	                          std::vector<std::size_t>& offsets,
+	                          std::vector<Node>& nodes) const
+	{
+		std::size_t const num = std::distance(first, last);
+
+		std::vector<std::uint32_t> active(num);
+		std::iota(std::begin(active), std::end(active), 0);
+		std::vector<std::pair<std::uint32_t, Node>> results;
+		queryIntersectsBatchRecurs(predicates, first, getRootNodeBV(), active, 0, results);
+
+		// Group the results by geometry, keeping their order
+		offsets.assign(num + 1, 0);
+		for (auto const& [index, node] : results) {
+			++offsets[index + 1];
+		}
+		std::partial_sum(std::cbegin(offsets), std::cend(offsets), std::begin(offsets));
+
+		std::vector<std::size_t> pos(std::cbegin(offsets), std::prev(std::cend(offsets)));
+		nodes.resize(results.size());
+		for (auto const& [index, node] : results) {
+			nodes[pos[index]++] = node;
+		}
+	}
+
 	template <
 	    class Geometry, class Predicates, class OutputIt,
 	    std::enable_if_t<not std::is_invocable_r_v<double, Geometry, NodeBV>, bool> = true>
@@ -2535,6 +2617,228 @@ class OctreeBase
 		}
 	}
 
+	//
+	// Query intersects batch
+	//
+
+	// active[active_first, active.size()) are the geometries intersecting the parent of node
+	template <class Predicates, class RandomIt>
+	void queryIntersectsBatchRecurs(Predicates const& predicates, RandomIt geometries,
+	                                NodeBV const& node, std::vector<std::uint32_t>& active,
+	                                std::size_t active_first,
+	                                std::vector<std::pair<std::uint32_t, Node>>& results) const
+	{
+		std::size_t const first = active.size();
+		auto const bv = node.getBoundingVolume();
+		for (std::size_t i = active_first; i != first; ++i) {
+			if (geometry::intersects(bv, *std::next(geometries, active[i]))) {
+				active.push_back(active[i]);
+			}
+		}
+
+		if (first != active.size()) {
+			if (predicate::PredicateValueCheck<Predicates>::apply(predicates, derived(), node)) {
+				for (std::size_t i = first; i != active.size(); ++i) {
+					results.emplace_back(active[i], node);
+				}
+			}
+
+			if (isParent(node) &&
+			    predicate::PredicateInnerCheck<Predicates>::apply(predicates, derived(), node)) {
+				// Siblings the way the query iterator steps through them, for the same bounding volumes
+				auto child = getNodeChild(node, 0);
+				for (unsigned int idx = 0; idx != 8; ++idx) {
+					child = getNodeSibling(child, idx);
+					queryIntersectsBatchRecurs(predicates, geometries, child, active, first, results);
+				}
+			}
+		}
+
+		active.resize(first);
+	}
+
+	//
+	// Apply sorted
+	//
+
+	/*!
+	 * @brief Sort codes of the same depth with a radix sort.
+	 *
+	 * @param codes The codes, sorted on return.
+	 * @return The permutation, the i:th sorted code was at perm[i] before.
+	 */
+	Permuation sortCodes(std::vector<Code>& codes) const
+	{
+		Permuation perm(codes.size());
+		std::iota(std::begin(perm), std::end(perm), 0);
+		if (codes.size() < 2) {
+			return perm;
+		}
+
+		std::vector<Code> codes_tmp(codes.size());
+		Permuation perm_tmp(codes.size());
+
+		// Least significant digit first, 8 bits at a time, over the bits used at this depth
+		Code::code_t const first_bit = 3 * codes.front().depth();
+		Code::code_t const last_bit = 3 * depthLevels();
+		for (Code::code_t shift = first_bit; shift < last_bit; shift += 8) {
+			std::array<std::size_t, 257> offset{};
+			for (Code const& code : codes) {
+				++offset[((code.code() >> shift) & 0xFF) + 1];
+			}
+
+			// All codes have the same digit
+			if (std::any_of(std::cbegin(offset), std::cend(offset),
+			                [n = codes.size()](std::size_t count) { return n == count; })) {
+				continue;
+			}
+
+			std::partial_sum(std::cbegin(offset), std::cend(offset), std::begin(offset));
+			for (std::size_t i = 0; i != codes.size(); ++i) {
+				std::size_t const j = offset[(codes[i].code() >> shift) & 0xFF]++;
+				codes_tmp[j] = codes[i];
+				perm_tmp[j] = perm[i];
+			}
+			codes.swap(codes_tmp);
+			perm.swap(perm_tmp);
+		}
+
+		return perm;
+	}
+
+	struct SortedSubtree {
+		InnerNode* node;
+		depth_t depth;
+		std::size_t first;
+		std::size_t last;
+	};
+
+	/*!
+	 * @brief Split sorted codes into the subtrees they fall into, for the subtrees to be
+	 * worked on concurrently.
+	 *
+	 * The subtrees are at the highest depth above max_depth that gives enough of them to keep
+	 * the threads busy. The paths down to the subtrees are created and marked modified, so the
+	 * subtrees share no nodes that are changed while working on them.
+	 *
+	 * @param codes Codes sorted by code, none with a depth above max_depth.
+	 * @param max_depth The highest depth of the codes, has to be lower than depthLevels().
+	 * @return The subtrees, [first, last) are the codes in each.
+	 */
+	std::vector<SortedSubtree> sortedSubtrees(std::vector<Code> const& codes,
+	                                          depth_t max_depth)
+	{
+		// Number of consecutive codes that first differ at each depth
+		std::array<std::size_t, MAX_DEPTH_LEVELS + 1> num_diff{};
+		for (std::size_t i = 1; i != codes.size(); ++i) {
+			Code::code_t const diff = codes[i - 1].code() ^ codes[i].code();
+			if (0 != diff) {
+				++num_diff[(63 - __builtin_clzll(diff)) / 3];
+			}
+		}
+		std::size_t const min_subtrees = 8 * std::max(1U, std::thread::hardware_concurrency());
+		depth_t split_depth = max_depth + 1;
+		for (std::size_t num_subtrees = 1, d = depthLevels() - 1; d > max_depth; --d) {
+			num_subtrees += num_diff[d];
+			if (min_subtrees <= num_subtrees) {
+				split_depth = d;
+				break;
+			}
+		}
+
+		std::vector<SortedSubtree> subtrees;
+		for (std::size_t first = 0; first != codes.size();) {
+			Code const ancestor = codes[first].toDepth(split_depth);
+			std::size_t last = first + 1;
+			while (last != codes.size() && codes[last].toDepth(split_depth) == ancestor) {
+				++last;
+			}
+
+			InnerNode* node = &getRoot();
+			for (depth_t d = depthLevels(); d > split_depth; --d) {
+				createInnerChildren(*node, d);
+				setModified(*node, true);
+				node = &getInnerChild(*node, ancestor.indexAtDepth(d - 1));
+			}
+
+			subtrees.push_back(SortedSubtree{node, split_depth, first, last});
+			first = last;
+		}
+
+		return subtrees;
+	}
+
+	// Create the node of code in the subtree of node at depth, marking it and the path down to
+	// it modified
+	Node createModifiedNode(InnerNode& node, depth_t depth, Code code)
+	{
+		InnerNode* cur = &node;
+		setModified(*cur, true);
+		for (auto const min_depth = std::max(depth_t(1), code.depth()); min_depth < depth;
+		     --depth) {
+			createInnerChildren(*cur, depth);
+			cur = &getInnerChild(*cur, code.indexAtDepth(depth - 1));
+			setModified(*cur, true);
+		}
+
+		if (0 == code.depth()) {
+			createLeafChildren(*cur);
+			LeafNode& child = getLeafChild(*cur, code.indexAtDepth(0));
+			setModified(child, true);
+			return Node(&child, code);
+		} else {
+			return Node(cur, code);
+		}
+	}
+
+	/*!
+	 * @brief Apply f to the nodes of the sorted codes.
+	 *
+	 * f(node, first, last) is called once for every run [first, last) of equal codes. The
+	 * codes are split by their ancestor at the highest depth that gives enough subtrees to
+	 * keep the threads busy. The paths down to the subtrees are created first, then the
+	 * subtrees are applied to concurrently, as they share no nodes.
+	 *
+	 * @param codes Sorted codes of the same depth.
+	 */
+	template <class ExecutionPolicy, class TernaryFunction,
+	          typename = std::enable_if_t<
+	              std::is_execution_policy_v<std::decay_t<ExecutionPolicy>>>>
+	void applySorted(ExecutionPolicy policy, std::vector<Code> const& codes,
+	                 TernaryFunction f, bool propagate)
+	{
+		if (codes.empty()) {
+			return;
+		}
+
+		depth_t const depth = codes.front().depth();
+		if (depth >= depthLevels()) {
+			// FIXME: Should this be here?
+			if (depth == depthLevels()) {
+				apply(
+				    codes.front(),
+				    [&f, n = codes.size()](LeafNode& node) { f(node, 0, n); }, false);
+			}
+		} else {
+			for_each(policy, sortedSubtrees(codes, depth), [this, &codes, &f](
+			                                                   SortedSubtree const& subtree) {
+				for (std::size_t first = subtree.first; first != subtree.last;) {
+					std::size_t last = first + 1;
+					while (last != subtree.last && codes[last] == codes[first]) {
+						++last;
+					}
+					applyRecurs(*subtree.node, subtree.depth, codes[first],
+					            [&f, first, last](LeafNode& node) { f(node, first, last); });
+					first = last;
+				}
+			});
+		}
+
+		if (propagate) {
+			updateModifiedNodes(policy);
+		}
+	}
+
 	//
 	// Get root
 	//
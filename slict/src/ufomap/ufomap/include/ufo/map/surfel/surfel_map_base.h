@@ -50,9 +50,11 @@
 // STL
 #include <cstdint>
 #include <deque>
+#include <execution>
 #include <functional>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 namespace ufo::map
 {
@@ -322,6 +324,30 @@ class SurfelMapBase
 		}
 	}
 
+	/*!
+	 * @brief Insert the points in [first, last) with the codes computed in parallel and radix
+	 * sorted, and the subtrees holding them updated concurrently.
+	 *
+	 * @param first,last Random access range of points.
+	 */
+	template <class ExecutionPolicy, class RandomIt,
+	          typename = std::enable_if_t<
+	              std::is_execution_policy_v<std::decay_t<ExecutionPolicy>>>>
+	void insertSurfelPoint(ExecutionPolicy policy, RandomIt first, RandomIt last,
+	                       depth_t depth = 0, bool propagate = true)
+	{
+		std::vector<Point3> points;
+		std::vector<Code> codes = sortedCodes(policy, first, last, depth, points);
+
+		derived().applySorted(
+		    policy, codes,
+		    [&points](LeafNode& node, std::size_t f, std::size_t l) {
+			    insertSurfelPoint(node, std::next(std::cbegin(points), f),
+			                      std::next(std::cbegin(points), l));
+		    },
+		    propagate);
+	}
+
 	void insertSurfelPoint(std::initializer_list<Point3> points, depth_t depth = 0,
 	                       bool propagate = true)
 	{
@@ -378,6 +404,29 @@ class SurfelMapBase
 		}
 	}
 
+	/*!
+	 * @brief Erase the points in [first, last), in parallel like insertSurfelPoint.
+	 *
+	 * @param first,last Random access range of points.
+	 */
+	template <class ExecutionPolicy, class RandomIt,
+	          typename = std::enable_if_t<
+	              std::is_execution_policy_v<std::decay_t<ExecutionPolicy>>>>
+	void eraseSurfelPoint(ExecutionPolicy policy, RandomIt first, RandomIt last,
+	                      depth_t depth = 0, bool propagate = true)
+	{
+		std::vector<Point3> points;
+		std::vector<Code> codes = sortedCodes(policy, first, last, depth, points);
+
+		derived().applySorted(
+		    policy, codes,
+		    [&points](LeafNode& node, std::size_t f, std::size_t l) {
+			    eraseSurfelPoint(node, std::next(std::cbegin(points), f),
+			                     std::next(std::cbegin(points), l));
+		    },
+		    propagate);
+	}
+
 	void eraseSurfelPoint(std::initializer_list<Point3> points, depth_t depth = 0,
 	                      bool propagate = true)
 	{
@@ -534,6 +583,28 @@ class SurfelMapBase
 		getSurfel(node).removePoint(first, last);
 	}
 
+	//
+	// Sorted codes
+	//
+
+	// Codes of the points in [first, last) sorted, and the points in the same order
+	template <class ExecutionPolicy, class RandomIt>
+	std::vector<Code> sortedCodes(ExecutionPolicy policy, RandomIt first, RandomIt last,
+	                              depth_t depth, std::vector<Point3>& points) const
+	{
+		std::vector<Code> codes(std::distance(first, last));
+		std::transform(policy, first, last, std::begin(codes),
+		               [this, depth](auto const& point) { return derived().toCode(point, depth); });
+
+		Permuation const perm = derived().sortCodes(codes);
+
+		points.resize(perm.size());
+		std::transform(policy, std::cbegin(perm), std::cend(perm), std::begin(points),
+		               [first](std::size_t i) { return Point3(*std::next(first, i)); });
+
+		return codes;
+	}
+
 	//
 	// Update node
 	//